@@ -0,0 +1,72 @@
+#ifndef __RECORDER_CODEC_H_
+#define __RECORDER_CODEC_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Compressed blocks, shared by the tracing library (compression,
+ * see recorder-utils.c) and the reader (decompression):
+ *
+ * | size_t compressed_size | size_t decompressed_size | int codec |
+ * | int num_chunks | size_t chunk_size | size_t compressed size of each chunk |
+ * | chunk 0 | chunk 1 | ... |
+ *
+ * The input is cut into chunks of chunk_size bytes (the last one may
+ * be shorter) that are compressed independently, so they can be
+ * compressed and decompressed in parallel. compressed_size is the
+ * total size of the chunks.
+ *
+ * zlib is always available, zstd and lz4 only if enabled at configure
+ * time (RECORDER_ENABLE_ZSTD and RECORDER_ENABLE_LZ4). The codec is
+ * stored in every block, so each stream (CST, CFG, timestamps) can
+ * use a different one. If compression fails, the chunks of the block
+ * are stored as they are (RECORDER_CODEC_STORED) rather than lost.
+ */
+
+#define RECORDER_CODEC_ZLIB     0
+#define RECORDER_CODEC_ZSTD     1
+#define RECORDER_CODEC_LZ4      2
+#define RECORDER_CODEC_STORED   3       // not compressed
+#define RECORDER_NUM_CODECS     4
+
+#define RECORDER_BLOCK_HEADER_SIZE  (3*sizeof(size_t) + 2*sizeof(int))
+#define RECORDER_COMPRESSION_CHUNK  (4*1024*1024)
+
+// Size of the header and the chunk table
+static inline size_t recorder_block_meta_size(int num_chunks) {
+    return RECORDER_BLOCK_HEADER_SIZE + num_chunks * sizeof(size_t);
+}
+
+static const char* const recorder_codec_names[RECORDER_NUM_CODECS] = {"zlib", "zstd", "lz4", "stored"};
+
+static inline bool recorder_codec_available(int codec) {
+    switch(codec) {
+        case RECORDER_CODEC_ZLIB:
+        case RECORDER_CODEC_STORED:
+            return true;
+#ifdef RECORDER_ENABLE_ZSTD
+        case RECORDER_CODEC_ZSTD:
+            return true;
+#endif
+#ifdef RECORDER_ENABLE_LZ4
+        case RECORDER_CODEC_LZ4:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/*
+ * Return the codec id of the given name, -1 if unknown
+ */
+static inline int recorder_codec_by_name(const char* name) {
+    for(int codec = 0; codec < RECORDER_NUM_CODECS; codec++) {
+        if(strcmp(name, recorder_codec_names[codec]) == 0)
+            return codec;
+    }
+    return -1;
+}
+
+#endif
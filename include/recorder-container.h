@@ -0,0 +1,68 @@
+#ifndef __RECORDER_CONTAINER_H_
+#define __RECORDER_CONTAINER_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Single-file trace container (recorder.trace), written by the
+ * tracing library at finalize time if RECORDER_TRACE_CONTAINER is
+ * set (see recorder-container.c), read by the reader through mmap():
+ *
+ * | RecorderContainerHeader | RecorderSection * num_sections |
+ * | section | section | ... | RecorderRankIndex * num_ranks |
+ *
+ * Each section is one of the files a trace otherwise consists of
+ * (VERSION, recorder.mt, recorder.cst, ug.cfg, ...), copied as is
+ * and starting at a multiple of alignment, so the compressed blocks
+ * inside can be decompressed straight from the mapping. The per-rank
+ * index points to the CST, grammar and timestamps of every rank, so
+ * a reader only needs to touch the parts of the ranks it decodes.
+ * All offsets are from the start of the container.
+ */
+
+#define RECORDER_CONTAINER_NAME         "recorder.trace"
+#define RECORDER_CONTAINER_MAGIC        "RECTRACE"
+#define RECORDER_CONTAINER_VERSION      1
+#define RECORDER_CONTAINER_ALIGNMENT    4096
+
+#define RECORDER_CODEC_NONE             -1      // section is not compressed
+
+typedef struct RecorderContainerHeader_t {
+    char   magic[8];
+    int    version;
+    int    num_sections;
+    int    num_ranks;
+    int    alignment;
+    size_t index_offset;        // RecorderRankIndex of each rank
+} RecorderContainerHeader;
+
+typedef struct RecorderSection_t {
+    char   name[32];            // name of the file it replaces
+    size_t offset;
+    size_t size;
+    int    codec;               // of the blocks inside, RECORDER_CODEC_NONE if none
+    int    rank;                // -1 unless it belongs to a single rank
+} RecorderSection;
+
+/*
+ * With interprocess compression all ranks share the CST section
+ * (recorder.cst) and ranks with the same grammar point to the same
+ * block of ug.cfg. ts_size is 0 if there are no timestamps.
+ */
+typedef struct RecorderRankIndex_t {
+    size_t cst_offset, cst_size;
+    size_t cfg_offset, cfg_size;
+    size_t ts_offset,  ts_size;
+} RecorderRankIndex;
+
+static inline size_t recorder_container_align(size_t offset) {
+    return (offset + RECORDER_CONTAINER_ALIGNMENT - 1) / RECORDER_CONTAINER_ALIGNMENT * RECORDER_CONTAINER_ALIGNMENT;
+}
+
+static inline bool recorder_container_valid(const RecorderContainerHeader* header) {
+    return memcmp(header->magic, RECORDER_CONTAINER_MAGIC, 8) == 0 &&
+           header->version == RECORDER_CONTAINER_VERSION;
+}
+
+#endif
@@ -7,6 +7,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#ifdef __cplusplus
+extern "C++" {      // the C++ tools include us inside extern "C"
+#endif
+#include <mpi.h>
+#ifdef __cplusplus
+}
+#endif
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
 #endif
@@ -19,7 +26,7 @@
  * major.minor guarantees compatibility
  */
 #define RECORDER_VERSION_MAJOR  2
-#define RECORDER_VERSION_MINOR  5
+#define RECORDER_VERSION_MINOR  6
 #define RECORDER_VERSION_PATCH  0
 
 #define RECORDER_POSIX          0
@@ -46,6 +53,20 @@ typedef struct Record_t {
 } Record;
 
 
+/*
+ * Duration statistics of a call signature, in seconds. Kept instead
+ * of per-call timestamps in statistics-only timing mode.
+ * Bucket 0 of the histogram counts calls shorter than one tick of
+ * the time resolution, bucket i > 0 the ones of [2^(i-1), 2^i) ticks,
+ * the last bucket has no upper bound.
+ */
+#define RECORDER_STATS_BUCKETS  32
+typedef struct CallStats_t {
+    double min, max;
+    double sum, sum_sq;
+    int    histogram[RECORDER_STATS_BUCKETS];
+} CallStats;
+
 /*
  * Call Signature
  */
@@ -55,10 +76,42 @@ typedef struct CallSignature_t {
     int rank;
     int terminal_id;
     int count;
+    int flushed_count;      // count as of the last flush, see cst_flush_segment()
+    CallStats *stats;       // NULL unless in statistics-only timing mode
     UT_hash_handle hh;
 } CallSignature;
 
 
+/*
+ * Memory budget: functions whose offset and count arguments are
+ * replaced by RECORDER_REDUCED_ARG in their call signatures once the
+ * CST grows too large, see cs_reduce_detail(). The values are either
+ * kept in a separate side stream (recorder.args) or dropped.
+ * args are the indices of the offset and count arguments, -1 if none.
+ */
+#define RECORDER_MAX_FUNCS              256         // function ids are unsigned char
+#define RECORDER_REDUCED_ARG            "*"
+#define RECORDER_REDUCED_ARGS_NONE      0
+#define RECORDER_REDUCED_ARGS_STREAM    1
+#define RECORDER_REDUCED_ARGS_DROP      2
+
+static const struct {
+    const char* func;
+    int args[2];
+} reducible_funcs[] = {
+    {"pread",   {3, 2}},        {"pread64",  {3, 2}},
+    {"pwrite",  {3, 2}},        {"pwrite64", {3, 2}},
+    {"read",    {2, -1}},       {"write",    {2, -1}},
+    {"lseek",   {1, -1}},       {"lseek64",  {1, -1}},
+    {"fread",   {1, 2}},        {"fwrite",   {1, 2}},
+    {"fseek",   {1, -1}},
+    {"MPI_File_read_at",  {1, 3}},  {"MPI_File_read_at_all",  {1, 3}},
+    {"MPI_File_write_at", {1, 3}},  {"MPI_File_write_at_all", {1, 3}},
+    {"MPI_File_read",     {2, -1}}, {"MPI_File_read_all",     {2, -1}},
+    {"MPI_File_write",    {2, -1}}, {"MPI_File_write_all",    {2, -1}},
+};
+#define NUM_REDUCIBLE_FUNCS ((int)(sizeof(reducible_funcs)/sizeof(reducible_funcs[0])))
+
 typedef struct RecorderMetadata_t {
     int    total_ranks;
     bool   posix_tracing;
@@ -69,14 +122,50 @@ typedef struct RecorderMetadata_t {
     bool   store_call_depth;     // Wether to store the call depth
     double start_ts;
     double time_resolution;
-    int    ts_buffer_elements;
-    bool   ts_compression;              // whether to compress timestamps (using zlib)
+    int    ts_buffer_size;
+    bool   ts_compression;              // whether to compress timestamps (see RECORDER_TIME_CODEC)
+    bool   ts_stats_only;               // per-signature duration statistics instead of timestamps
     bool   interprocess_compression;    // interprocess compression of cst/cfg
     bool   interprocess_pattern_recognition;
     bool   intraprocess_pattern_recognition;
+    int    reduced_args;                // RECORDER_REDUCED_ARGS_*, how reduced signatures were recorded
+    unsigned char reduced_funcs[RECORDER_MAX_FUNCS];    // functions with reduced signatures on any rank
 } RecorderMetadata;
 
 
+/*
+ * Timestamps of the buffered records, in ticks of ts_resolution,
+ * encoded as they are recorded into two streams of varints (see
+ * recorder-varint.h): the difference of each tstart to the previous
+ * one in the first half of buf, zigzag-encoded as a call is recorded
+ * only once it returns, i.e., after the calls it makes, and the
+ * duration (tend - tstart) in the second half. Varints have no upper bound, so long gaps and
+ * calls can not overflow.
+ */
+typedef struct TimestampBuffer_t {
+    unsigned char* buf;
+    size_t size;                // size of buf in bytes
+    size_t delta_len;           // bytes used in the first half
+    size_t duration_len;        // bytes used in the second half
+    int    records;
+    int    stream;              // id of the TimestampStream it belongs to
+} TimestampBuffer;
+
+/*
+ * Timestamps of the records of one thread, in the order the thread
+ * recorded them. tid is the one stored in the call signatures, i.e.,
+ * 0 for all threads if thread ids are not stored, so the reader
+ * can tell which stream a record belongs to.
+ */
+typedef struct TimestampStream_t {
+    pthread_t       tid;        // key
+    int             id;         // streams are numbered in creation order
+    int64_t         prev_tstart;    // in ticks since ts_origin, delta compression for timestamps
+    TimestampBuffer ts;         // memory buffer for timestamps, spill to file once full.
+    UT_hash_handle  hh;
+} TimestampStream;
+
+
 /**
  * Per-process CST and CFG
  */
@@ -97,13 +186,94 @@ typedef struct RecorderLogger_t {
     char cfg_path[1024];
 
     double    start_ts;
-    double    prev_tstart;      // delta compression for timestamps
-    FILE*     ts_file;
-    uint32_t* ts;               // memory buffer for timestamps (tstart, tend-tstart)
-    int       ts_index;         // current position of ts buffer, spill to file once full.
-    int       ts_max_elements;  // max elements can be stored in the buffer
+    double    ts_origin;        // local start time, tick 0 of the timestamps
+    FILE*     ts_file;          // spilled blocks, only created once ts_blocks exceeds ts_spill_limit
+    unsigned char* ts_blocks;   // blocks of spilled buffers kept in memory, see ts_store()
+    size_t    ts_blocks_len;
+    size_t    ts_blocks_cap;
+    size_t    ts_spill_limit;
+    TimestampStream* ts_streams;    // one per thread, see ts_append()
+    int       ts_num_streams;
+    size_t    ts_buffer_size;   // size of the buffer of each stream in bytes
+    size_t    ts_memory;        // bytes of all timestamp buffers
     double    ts_resolution;
     bool      ts_compression;
+    bool      ts_stats_only;    // Keep CallStats in the CST, no timestamps at all
+
+    // Incremental spill of full timestamp buffers, see ts_spill().
+    // While the spill thread writes out ts_spare, ts_spilling
+    // is set and write_record() fills the other buffer. The
+    // spare buffer is shared by all streams.
+    TimestampBuffer ts_spare;
+    bool            ts_spilling;
+    bool            ts_spill_thread;        // Wether to spill from a background thread
+    bool            ts_spill_running;
+    bool            ts_spill_stop;
+    pthread_t       ts_spill_tid;
+    pthread_mutex_t ts_spill_mutex;
+    pthread_cond_t  ts_spill_cond;
+
+    // Epoch mode: bound the in-memory grammar by periodically
+    // flushing it to cfg_epoch_file and starting a new one.
+    // The CST stays global. See recorder-cst-cfg.c
+    FILE*     cfg_epoch_file;
+    int       cfg_epochs;           // number of grammar epochs flushed so far
+    size_t    epoch_memory;         // flush once grammar+cst memory grows by this many bytes, 0: disabled
+    double    epoch_interval;       // flush every epoch_interval seconds, 0: disabled
+    double    epoch_tstart;         // start time of the current epoch
+    size_t    epoch_base_memory;    // grammar+cst memory at the start of the current epoch
+    bool      cfg_recompression;    // Wether to re-compress the grammar at finalize time
+    bool      cfg_dictionary;       // Wether to factor rules shared by ranks into ug.dict
+
+    // Background flusher: every flush_interval seconds, append what
+    // was recorded since the last flush (timestamp blocks, new CST
+    // entries, a grammar epoch) to the per-rank segment files and
+    // update the index N.idx, see flusher_thread().
+    double          flush_interval;     // in seconds, 0: disabled
+    int             flushed_records;    // num_records at the last flush
+    FILE*           cst_segment_file;
+    int             cst_flushed;        // terminal id of the first CST entry not flushed yet
+    size_t          cst_segment_bytes;  // written to the segment file so far
+    bool            flusher_running;
+    bool            flusher_stop;
+    pthread_t       flusher_tid;
+    pthread_mutex_t flusher_mutex;
+    pthread_cond_t  flusher_cond;
+
+    // Two-level finalize: ranks of a node first aggregate through
+    // shared memory, then only node leaders talk to each other.
+    // Both are MPI_COMM_NULL when disabled, leader_comm is also
+    // MPI_COMM_NULL on ranks that are not node leaders.
+    bool      node_aggregation;
+    MPI_Comm  node_comm;
+    MPI_Comm  leader_comm;
+
+    // In-flight write of recorder.ts, see ts_merge_files_begin()
+    MPI_Request ts_merge_request;
+    MPI_File    ts_merge_fh;
+    MPI_Win     ts_merge_win;
+    void*       ts_merge_buf;
+
+    bool      trace_container;      // Wether to pack the trace into a single file, see recorder-container.h
+
+    // Memory budget: once grammar+cst memory gets close to it, the
+    // function with the most signatures is switched to reduced ones,
+    // see cs_reduce_detail(). The dropped arguments go to args_stream
+    // as zigzag varints, in record order, unless reduced_args is DROP.
+    // Beyond args_spill_limit bytes the stream is appended to the
+    // per-rank args file, see cs_append_reduced_args().
+    size_t    memory_budget;        // in bytes, 0: unlimited
+    size_t    budget_next_check;    // grammar+cst memory that triggers the next reduction
+    int       reduced_args;         // RECORDER_REDUCED_ARGS_STREAM or RECORDER_REDUCED_ARGS_DROP
+    unsigned char reduced_funcs[RECORDER_MAX_FUNCS];
+    int       cst_func_entries[RECORDER_MAX_FUNCS];    // CST entries of each function
+    unsigned char* args_stream;     // allocated with recorder_malloc()
+    size_t    args_stream_len;
+    size_t    args_stream_cap;
+    size_t    args_stream_values;
+    size_t    args_spill_limit;
+    FILE*     args_file;            // spilled blocks, only created once args_stream exceeds args_spill_limit
+    bool      args_lost;            // out of memory or a failed write, the values are not saved
 
     bool      store_tid;            // Wether to store thread id
     bool      store_call_depth;     // Wether to store the call depth
@@ -135,14 +305,34 @@ void write_record(Record* record);
 /* recorder-cst-cfg.c */
 int  cs_key_args_start();
 int  cs_key_args_strlen(Record* record);
+// Local work to run while an internal collective is in flight
+typedef void (*OverlapFunc)(void* arg);
+
 int  cs_key_length(Record* record);
 char* compose_cs_key(Record *record, int* key_len);
 Record* cs_to_record(CallSignature* cs);
+void cs_stats_add(CallSignature* cs, double duration, double resolution);
+void cs_stats_merge(CallStats* dst, CallStats* src);
+int  cs_reduce_args(RecorderLogger* logger, Record* record, int64_t* values);
+void cs_append_reduced_args(RecorderLogger* logger, int64_t* values, int n);
+void cs_reduce_detail(RecorderLogger* logger, size_t memory);
+void save_reduced_args(RecorderLogger* logger);
+void cleanup_reduced_args(RecorderLogger* logger);
 void cleanup_cst(CallSignature* cst);
 void save_cst_local(RecorderLogger* logger);
-void save_cst_merged(RecorderLogger* logger);
+void save_cst_merged(RecorderLogger* logger, int* update_terminal_id, OverlapFunc overlap, void* overlap_arg);
 void save_cfg_local(RecorderLogger* logger);
-void save_cfg_merged(RecorderLogger* logger);
+void save_cfg_merged(RecorderLogger* logger, int* serialized_grammar, int serialized_integers);
+void cfg_flush_epoch(RecorderLogger* logger);
+void cfg_cleanup_epochs(RecorderLogger* logger);
+void cst_get_segment_filename(RecorderLogger* logger, char* filename);
+void cst_flush_segment(RecorderLogger* logger);
+void cst_cleanup_segments(RecorderLogger* logger);
+int* serialize_cfg(RecorderLogger* logger, int* serialized_integers);
+
+
+/* recorder-container.c */
+void recorder_write_container(RecorderLogger* logger);
 
 
 
@@ -111,7 +111,16 @@ int digram_delete(Digram **digram_table, Symbol *symbol);
 
 /* recorder_sequitur_logger.c */
 int* serialize_grammar(Grammar *grammar, int* serialized_integers);
-void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank, int mpi_size);
+void sequitur_update_serialized(int *serialized_grammar, int *update_terminal_id);
+unsigned char* sequitur_encode_grammar(int *serialized_grammar, int *encoded_bytes);
+void sequitur_save_unique_grammars(const char* path, int* local_grammar, int dict_rules, int mpi_rank, int mpi_size);
+
+/* recorder_sequitur_dictionary.c */
+int* sequitur_factor_grammars(const char* path, int* local_grammar, int* integers,
+                              int* dict_rules, int mpi_rank, int mpi_size);
+
+/* recorder_sequitur_minimize.c */
+int* sequitur_minimize_grammar(int *serialized_grammar, int serialized_integers, int *minimized_integers);
 
 /* recorder_sequitur_utils.c */
 void  sequitur_print_rules(Grammar *grammar);
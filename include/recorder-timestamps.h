@@ -10,13 +10,44 @@
 void ts_get_filename(RecorderLogger* logger, char* ts_filename);
 
 /*
- * write out the current buffer to the per-rank timestamp filename
+ * set up the timestamp streams, the buffer of each stream
+ * (logger->ts_buffer_size bytes) is allocated on its first record
  */
-void ts_write_out(RecorderLogger* logger);
+void ts_init(RecorderLogger* logger);
+
+/*
+ * encode the timestamps of one record into the stream of
+ * thread tid, spills its buffer with ts_spill() once it is full
+ */
+void ts_append(RecorderLogger* logger, pthread_t tid, double tstart, double tend);
+
+/*
+ * called by ts_append() once the buffer of a stream is full, hands
+ * the buffer over to the spill thread, which compresses and appends
+ * it to the per-rank timestamp file as one block, and returns
+ * with an empty buffer
+ */
+void ts_spill(RecorderLogger* logger, TimestampStream* stream);
+
+/*
+ * write all timestamps recorded so far to the per-rank file,
+ * returns its size. Called by the background flusher with the
+ * logger locked.
+ */
+size_t ts_flush(RecorderLogger* logger);
+
+/*
+ * wait for the spill thread, write out what is left in the
+ * buffers and the directory of streams, and free the buffers
+ */
+void ts_spill_finalize(RecorderLogger* logger);
 
 /* 
  * merge per-rank timestamp files into a single file
+ * the write to the merged file is non-blocking, begin() posts
+ * it and end() waits for it, other work can run in between
  */
-void ts_merge_files(RecorderLogger* logger);
+void ts_merge_files_begin(RecorderLogger* logger);
+void ts_merge_files_end(RecorderLogger* logger);
 
 #endif
@@ -3,12 +3,17 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <mpi.h>
 
 void utils_init();
 void utils_finalize();
 void* recorder_malloc(size_t size);
 void recorder_free(void* ptr, size_t size);
+size_t recorder_memory_usage();                 // bytes currently allocated by recorder_malloc()
+uint64_t recorder_hash64(const void* buf, size_t len);  // 64-bit FNV-1a, fingerprint of a buffer
+uint32_t recorder_hash32(const void* buf, size_t len);  // 32-bit djb2, independent check of a fingerprint
 pthread_t recorder_gettid(void);
 long get_file_size(const char *filename);       // return the size of a file
 int accept_filename(const char *filename);      // if include the file in trace
@@ -24,20 +29,59 @@ char* realrealpath(const char* path);           // return the absolute path (map
 int mkpath(char* file_path, mode_t mode);       // recursive mkdir()
 
 
+/*
+ * private duplicate of comm for our own collectives, cached until
+ * the user frees comm; the one of MPI_COMM_WORLD is created at init
+ */
+void recorder_init_internal_comms();
+MPI_Comm recorder_internal_comm(MPI_Comm comm);
+void recorder_free_internal_comm(MPI_Comm comm);
+
 // recorder send/recv/bcast only handles MPI_BYTE stream
 void recorder_send( void *buf, size_t count, int dst, int tag, MPI_Comm comm);
 void recorder_recv( void *buf, size_t count, int src, int tag, MPI_Comm comm);
 void recorder_bcast(void *buf, size_t count, int root, MPI_Comm comm);
 void recorder_barrier(MPI_Comm comm);
+MPI_Datatype recorder_bytes_type(size_t count);     // count contiguous bytes, count may exceed INT_MAX
 
 int min_in_array(int* arr, size_t len);
 double recorder_log2(int val);
 int recorder_ceil(double val);
 /*
- * compress buf using zlib and then write to the output file
+ * streams of trace data, each compressed with its own codec,
+ * see recorder-codec.h and RECORDER_CST_CODEC, RECORDER_CFG_CODEC
+ * and RECORDER_TIME_CODEC
+ */
+enum {
+    RECORDER_STREAM_CST,
+    RECORDER_STREAM_CFG,
+    RECORDER_STREAM_TS,
+    RECORDER_NUM_STREAMS
+};
+/*
+ * compress buf using the codec of the stream and then write
+ * the block to the output file
  * the file stream must has been opened with write permission.
+ * if compression fails the chunks are stored uncompressed.
+ * return false if writing failed, the file is then
+ * truncated back to where the block started.
+ */
+bool recorder_write_block(unsigned char* buf, size_t buf_size, FILE* out_file, int stream);
+int recorder_stream_codec(int stream);          // codec used by the stream, see recorder-codec.h
+/*
+ * same as recorder_write_block() but compress into a newly
+ * malloc()ed block, laid out exactly as it would be on disk.
+ * if compression fails the chunks are stored uncompressed,
+ * NULL is only returned if out of memory
+ */
+unsigned char* recorder_compress_block(unsigned char* buf, size_t buf_size, size_t* block_size, int stream);
+/*
+ * collectively write at most one block per rank into a single file:
+ * | num_blocks | offset of block 0 | ... | offset of block n-1 | blocks |
+ * block_index is -1 on ranks without a block
  */
-void recorder_write_zlib(unsigned char* buf, size_t buf_size, FILE* out_file);
+void recorder_write_indexed_blocks(const char* filename, void* block, size_t block_size,
+                                   int block_index, int num_blocks, MPI_Comm comm);
 int recorder_debug_level();
 
 #define RECORDER_LOG(level, ...)                  \
@@ -0,0 +1,52 @@
+#ifndef __RECORDER_VARINT_H_
+#define __RECORDER_VARINT_H_
+#include <stdint.h>
+
+/*
+ * LEB128-style variable-length integers, shared by the
+ * tracing library (encoding) and the reader (decoding).
+ *
+ * Signed values are zigzag-encoded first so small
+ * negative numbers (e.g., rule ids) also stay short.
+ */
+
+#define VARINT_MAX_BYTES 10     // a uint64_t takes at most 10 bytes
+
+static inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * Write v to buf, return the number of bytes written
+ */
+static inline int varint_put(unsigned char* buf, uint64_t v) {
+    int n = 0;
+    while(v >= 0x80) {
+        buf[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (unsigned char)v;
+    return n;
+}
+
+/*
+ * Read a varint from *buf and advance *buf past it
+ */
+static inline uint64_t varint_get(unsigned char** buf) {
+    uint64_t v = 0;
+    int shift = 0;
+    unsigned char* p = *buf;
+    while(*p & 0x80) {
+        v |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= (uint64_t)(*p++) << shift;
+    *buf = p;
+    return v;
+}
+
+#endif
@@ -12,6 +12,7 @@
 #define RECORDER_TRACES_DIR         		        "RECORDER_TRACES_DIR"
 #define RECORDER_TIME_RESOLUTION    		        "RECORDER_TIME_RESOLUTION"
 #define RECORDER_TIME_COMPRESSION                   "RECORDER_TIME_COMPRESSION"
+#define RECORDER_TIME_STATS_ONLY                    "RECORDER_TIME_STATS_ONLY"
 #define RECORDER_STORE_POINTER        		        "RECORDER_STORE_POINTER"
 #define RECORDER_STORE_TID            		        "RECORDER_STORE_TID"
 #define RECORDER_STORE_CALL_DEPTH          		    "RECORDER_STORE_CALL_DEPTH"
@@ -21,6 +22,22 @@
 #define RECORDER_EXCLUSION_FILE     		        "RECORDER_EXCLUSION_FILE"
 #define RECORDER_INCLUSION_FILE     		        "RECORDER_INCLUSION_FILE"
 #define RECORDER_DEBUG_LEVEL                        "RECORDER_DEBUG_LEVEL"
+#define RECORDER_EPOCH_MEMORY                       "RECORDER_EPOCH_MEMORY"
+#define RECORDER_EPOCH_INTERVAL                     "RECORDER_EPOCH_INTERVAL"
+#define RECORDER_CFG_RECOMPRESSION                  "RECORDER_CFG_RECOMPRESSION"
+#define RECORDER_CFG_DICTIONARY                     "RECORDER_CFG_DICTIONARY"
+#define RECORDER_NODE_AGGREGATION                   "RECORDER_NODE_AGGREGATION"
+#define RECORDER_BUFFER_SIZE                        "RECORDER_BUFFER_SIZE"
+#define RECORDER_BUFFER_SPILL_THREAD                "RECORDER_BUFFER_SPILL_THREAD"
+#define RECORDER_BUFFER_SPILL_LIMIT                 "RECORDER_BUFFER_SPILL_LIMIT"
+#define RECORDER_CST_CODEC                          "RECORDER_CST_CODEC"
+#define RECORDER_CFG_CODEC                          "RECORDER_CFG_CODEC"
+#define RECORDER_TIME_CODEC                         "RECORDER_TIME_CODEC"
+#define RECORDER_COMPRESSION_THREADS                "RECORDER_COMPRESSION_THREADS"
+#define RECORDER_FLUSH_INTERVAL                     "RECORDER_FLUSH_INTERVAL"
+#define RECORDER_TRACE_CONTAINER                    "RECORDER_TRACE_CONTAINER"
+#define RECORDER_MEMORY_BUDGET                      "RECORDER_MEMORY_BUDGET"
+#define RECORDER_REDUCED_ARGS                       "RECORDER_REDUCED_ARGS"
 
 /*
  * Allowing users to exclude the interception
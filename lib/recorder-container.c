@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+#include "recorder.h"
+#include "recorder-codec.h"
+#include "recorder-container.h"
+
+/*
+ * Pack the files of a finished trace into a single container, see
+ * recorder-container.h for the layout. Called by all ranks once they
+ * have written their files: rank 0 lays out the sections and builds
+ * the rank index, then every rank copies its share of the sections
+ * to their offsets in the container with MPI-IO, and rank 0 adds the
+ * header, the section table and the index. The separate files are
+ * only removed once all of the container has been written.
+ */
+
+#define CONTAINER_COPY_BUFFER   (4*1024*1024)
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+typedef struct ContainerBuilder_t {
+    RecorderLogger*  logger;
+    RecorderSection* sections;
+    int              num_sections;
+    size_t           end;           // end of the last section
+} ContainerBuilder;
+
+static void section_path(ContainerBuilder* cb, const char* name, char* path) {
+    sprintf(path, "%s/%s", cb->logger->traces_dir, name);
+}
+
+// Add the file as a section if it exists, return its index, -1 if not
+static int add_section(ContainerBuilder* cb, const char* name, int codec, int rank) {
+    char path[1100];
+    section_path(cb, name, path);
+    if(GOTCHA_REAL_CALL(access)(path, F_OK) == -1)
+        return -1;
+
+    RecorderSection* section = &cb->sections[cb->num_sections];
+    memset(section, 0, sizeof(RecorderSection));
+    strncpy(section->name, name, sizeof(section->name) - 1);
+    section->size   = get_file_size(path);
+    section->offset = recorder_container_align(cb->end);
+    section->codec  = codec;
+    section->rank   = rank;
+    cb->end = section->offset + section->size;
+    return cb->num_sections++;
+}
+
+// Read size bytes at offset of the file of a section, return false on error
+static bool read_section(ContainerBuilder* cb, RecorderSection* section, size_t offset, void* buf, size_t size) {
+    char path[1100];
+    section_path(cb, section->name, path);
+    FILE* f = GOTCHA_REAL_CALL(fopen)(path, "rb");
+    bool ok = f != NULL &&
+              GOTCHA_REAL_CALL(fseek)(f, offset, SEEK_SET) == 0 &&
+              GOTCHA_REAL_CALL(fread)(buf, 1, size, f) == size;
+    if(f != NULL)
+        GOTCHA_REAL_CALL(fclose)(f);
+    if(!ok)
+        RECORDER_LOGERR("[Recorder] failed to read %s, keep the separate trace files\n", path);
+    return ok;
+}
+
+// On-disk size of the compressed block at offset, see recorder-codec.h
+static bool block_size_at(ContainerBuilder* cb, RecorderSection* section, size_t offset, size_t* size) {
+    unsigned char header[RECORDER_BLOCK_HEADER_SIZE];
+    if(!read_section(cb, section, offset, header, RECORDER_BLOCK_HEADER_SIZE))
+        return false;
+    size_t compressed_size;
+    int num_chunks;
+    memcpy(&compressed_size, header, sizeof(size_t));
+    memcpy(&num_chunks, header + 2*sizeof(size_t) + sizeof(int), sizeof(int));
+    *size = recorder_block_meta_size(num_chunks) + compressed_size;
+    return true;
+}
+
+/*
+ * Locate the CST, grammar and timestamps of every rank. cst and cfg
+ * are the section indices of each rank, ts and ug_mt are -1 if the
+ * file does not exist. Return false if a CST or grammar is missing
+ * or cannot be read.
+ */
+static bool build_rank_index(ContainerBuilder* cb, RecorderRankIndex* index, int* cst, int* cfg, int ts, int ug_mt) {
+    int nprocs = cb->logger->nprocs;
+    bool ok = true;
+
+    for(int rank = 0; rank < nprocs; rank++) {
+        if(cst[rank] < 0 || cfg[rank] < 0) {
+            RECORDER_LOGERR("[Recorder] the call signatures or grammar of rank %d are missing, "
+                            "keep the separate trace files\n", rank);
+            return false;
+        }
+    }
+
+    if(cb->logger->interprocess_compression) {
+        if(ug_mt < 0) {
+            RECORDER_LOGERR("[Recorder] ug.mt is missing, keep the separate trace files\n");
+            return false;
+        }
+        // One CST for all, grammar ug_ids[rank] of ug.cfg
+        // | num_blocks | offset of block 0 | ... | blocks |
+        int* ug_ids = recorder_malloc(sizeof(int) * nprocs);
+        RecorderSection* cfg_section = &cb->sections[cfg[0]];
+        size_t num_blocks = 0;
+        size_t* offsets = NULL;
+        ok = read_section(cb, &cb->sections[ug_mt], 0, ug_ids, sizeof(int) * nprocs) &&
+             read_section(cb, cfg_section, 0, &num_blocks, sizeof(size_t));
+        if(ok) {
+            offsets = recorder_malloc(sizeof(size_t) * num_blocks);
+            ok = read_section(cb, cfg_section, sizeof(size_t), offsets, sizeof(size_t) * num_blocks);
+        }
+
+        for(int rank = 0; ok && rank < nprocs; rank++) {
+            size_t block_offset = offsets[ug_ids[rank]];
+            index[rank].cst_offset = cb->sections[cst[rank]].offset;
+            index[rank].cst_size   = cb->sections[cst[rank]].size;
+            index[rank].cfg_offset = cfg_section->offset + block_offset;
+            ok = block_size_at(cb, cfg_section, block_offset, &index[rank].cfg_size);
+        }
+        if(offsets)
+            recorder_free(offsets, sizeof(size_t) * num_blocks);
+        recorder_free(ug_ids, sizeof(int) * nprocs);
+    } else {
+        // One section each
+        for(int rank = 0; rank < nprocs; rank++) {
+            RecorderSection* cst_section = &cb->sections[cst[rank]];
+            RecorderSection* cfg_section = &cb->sections[cfg[rank]];
+            index[rank].cst_offset = cst_section->offset;
+            index[rank].cst_size   = cst_section->size;
+            index[rank].cfg_offset = cfg_section->offset;
+            index[rank].cfg_size   = cfg_section->size;
+        }
+    }
+
+    // recorder.ts: | size of each rank's part | part of rank 0 | ... |
+    if(!ok || ts < 0)
+        return ok;
+    size_t* ts_sizes = recorder_malloc(sizeof(size_t) * nprocs);
+    ok = read_section(cb, &cb->sections[ts], 0, ts_sizes, sizeof(size_t) * nprocs);
+    size_t offset = cb->sections[ts].offset + sizeof(size_t) * nprocs;
+    for(int rank = 0; ok && rank < nprocs; rank++) {
+        index[rank].ts_offset = offset;
+        index[rank].ts_size   = ts_sizes[rank];
+        offset += ts_sizes[rank];
+    }
+    recorder_free(ts_sizes, sizeof(size_t) * nprocs);
+    return ok;
+}
+
+/*
+ * Run by rank 0: add the sections, locate the data of every rank
+ * and fill in the header. Return false if the trace is incomplete.
+ */
+static bool layout_container(ContainerBuilder* cb, RecorderRankIndex* index, RecorderContainerHeader* header) {
+    RecorderLogger* logger = cb->logger;
+    int nprocs = logger->nprocs;
+
+    int cst_codec = recorder_stream_codec(RECORDER_STREAM_CST);
+    int cfg_codec = recorder_stream_codec(RECORDER_STREAM_CFG);
+    int ts_codec  = logger->ts_compression ? recorder_stream_codec(RECORDER_STREAM_TS) : RECORDER_CODEC_NONE;
+
+    add_section(cb, "VERSION", RECORDER_CODEC_NONE, -1);
+    add_section(cb, "recorder.mt", RECORDER_CODEC_NONE, -1);
+
+    // Section indices of the CST and grammar of each rank
+    int* cst = recorder_malloc(sizeof(int) * nprocs);
+    int* cfg = recorder_malloc(sizeof(int) * nprocs);
+    int ug_mt = -1;
+    if(logger->interprocess_compression) {
+        int shared_cst = add_section(cb, "recorder.cst", cst_codec, -1);
+        ug_mt = add_section(cb, "ug.mt", RECORDER_CODEC_NONE, -1);
+        add_section(cb, "ug.dict", cfg_codec, -1);
+        int shared_cfg = add_section(cb, "ug.cfg", cfg_codec, -1);
+        for(int rank = 0; rank < nprocs; rank++) {
+            cst[rank] = shared_cst;
+            cfg[rank] = shared_cfg;
+        }
+    } else {
+        for(int rank = 0; rank < nprocs; rank++) {
+            char name[32];
+            sprintf(name, "%d.cst", rank);
+            cst[rank] = add_section(cb, name, cst_codec, rank);
+            sprintf(name, "%d.cfg", rank);
+            cfg[rank] = add_section(cb, name, cfg_codec, rank);
+        }
+    }
+    int ts = add_section(cb, "recorder.ts", ts_codec, -1);
+    add_section(cb, "recorder.args", recorder_stream_codec(RECORDER_STREAM_TS), -1);
+
+    bool ok = build_rank_index(cb, index, cst, cfg, ts, ug_mt);
+    recorder_free(cst, sizeof(int) * nprocs);
+    recorder_free(cfg, sizeof(int) * nprocs);
+
+    memcpy(header->magic, RECORDER_CONTAINER_MAGIC, 8);
+    header->version      = RECORDER_CONTAINER_VERSION;
+    header->num_sections = cb->num_sections;
+    header->num_ranks    = nprocs;
+    header->alignment    = RECORDER_CONTAINER_ALIGNMENT;
+    header->index_offset = recorder_container_align(cb->end);
+    return ok;
+}
+
+/*
+ * The rank that copies a section and removes its file: the rank it
+ * belongs to, or round-robin for the shared ones. recorder.ts is
+ * copied by all ranks, each its own part, rank 0 the sizes in front.
+ */
+static int section_owner(ContainerBuilder* cb, int i) {
+    RecorderSection* section = &cb->sections[i];
+    if(section->rank >= 0)
+        return section->rank;
+    if(strcmp(section->name, "recorder.ts") == 0)
+        return 0;
+    return i % cb->logger->nprocs;
+}
+
+static bool write_at(MPI_File fh, size_t offset, void* buf, size_t size) {
+    MPI_Status status;
+    int count = 0;
+    if(GOTCHA_REAL_CALL(MPI_File_write_at)(fh, offset, buf, size, MPI_BYTE, &status) != MPI_SUCCESS)
+        return false;
+    PMPI_Get_count(&status, MPI_BYTE, &count);
+    return count == size;
+}
+
+// Copy size bytes at src_offset of the file of a section to dst_offset of the container
+static bool copy_range(ContainerBuilder* cb, MPI_File fh, RecorderSection* section,
+                       size_t src_offset, size_t dst_offset, size_t size, void* buf) {
+    if(size == 0)
+        return true;
+
+    char path[1100];
+    section_path(cb, section->name, path);
+    FILE* in = GOTCHA_REAL_CALL(fopen)(path, "rb");
+    bool ok = in != NULL && GOTCHA_REAL_CALL(fseek)(in, src_offset, SEEK_SET) == 0;
+    while(ok && size > 0) {
+        size_t n = MIN(size, CONTAINER_COPY_BUFFER);
+        ok = GOTCHA_REAL_CALL(fread)(buf, 1, n, in) == n &&
+             write_at(fh, dst_offset, buf, n);
+        dst_offset += n;
+        size       -= n;
+    }
+    if(in != NULL)
+        GOTCHA_REAL_CALL(fclose)(in);
+    if(!ok)
+        RECORDER_LOGERR("[Recorder] failed to copy %s into the container\n", path);
+    return ok;
+}
+
+// Copy the sections, or parts of them, this rank is responsible for
+static bool copy_sections(ContainerBuilder* cb, MPI_File fh, RecorderRankIndex* index) {
+    int rank = cb->logger->rank;
+    void* buf = malloc(CONTAINER_COPY_BUFFER);
+    bool ok = true;
+
+    for(int i = 0; ok && i < cb->num_sections; i++) {
+        RecorderSection* section = &cb->sections[i];
+        if(strcmp(section->name, "recorder.ts") == 0) {
+            size_t sizes = sizeof(size_t) * cb->logger->nprocs;
+            if(rank == 0)
+                ok = copy_range(cb, fh, section, 0, section->offset, sizes, buf);
+            ok = ok && copy_range(cb, fh, section, index[rank].ts_offset - section->offset,
+                                  index[rank].ts_offset, index[rank].ts_size, buf);
+        } else if(section_owner(cb, i) == rank) {
+            ok = copy_range(cb, fh, section, 0, section->offset, section->size, buf);
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+void recorder_write_container(RecorderLogger* logger) {
+    GOTCHA_SET_REAL_CALL(fopen,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fread,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fseek,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fclose, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(remove, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(access, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(MPI_File_open, RECORDER_MPIIO);
+    GOTCHA_SET_REAL_CALL(MPI_File_write_at, RECORDER_MPIIO);
+    GOTCHA_SET_REAL_CALL(MPI_File_close, RECORDER_MPIIO);
+
+    int nprocs = logger->nprocs;
+    int max_sections = 7 + 2*nprocs;
+    ContainerBuilder cb = {
+        .logger       = logger,
+        .sections     = recorder_malloc(sizeof(RecorderSection) * max_sections),
+        .num_sections = 0,
+    };
+    RecorderRankIndex* index = recorder_malloc(sizeof(RecorderRankIndex) * nprocs);
+    memset(index, 0, sizeof(RecorderRankIndex) * nprocs);
+    RecorderContainerHeader header;
+    memset(&header, 0, sizeof(header));
+
+    // Sections start after the header and the section table,
+    // whose size is not known yet, so reserve the maximum
+    cb.end = sizeof(RecorderContainerHeader) + sizeof(RecorderSection) * max_sections;
+
+    // Rank 0 lays out the container, the others only
+    // need the sections and the index to copy their share
+    int layout[2] = {0, 0};         // laid out, number of sections
+    if(logger->rank == 0) {
+        layout[0] = layout_container(&cb, index, &header);
+        layout[1] = cb.num_sections;
+    }
+    recorder_bcast(layout, sizeof(layout), 0, MPI_COMM_WORLD);
+    cb.num_sections = layout[1];
+
+    char container_path[1100];
+    section_path(&cb, RECORDER_CONTAINER_NAME, container_path);
+    MPI_Comm comm = recorder_internal_comm(MPI_COMM_WORLD);
+    MPI_File fh;
+    int ok = layout[0];
+    if(ok) {
+        recorder_bcast(cb.sections, sizeof(RecorderSection) * cb.num_sections, 0, MPI_COMM_WORLD);
+        recorder_bcast(index, sizeof(RecorderRankIndex) * nprocs, 0, MPI_COMM_WORLD);
+        ok = GOTCHA_REAL_CALL(MPI_File_open)(comm, container_path, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+                                             MPI_INFO_NULL, &fh) == MPI_SUCCESS;
+        if(!ok && logger->rank == 0)
+            RECORDER_LOGERR("[Recorder] failed to create %s, keep the separate trace files\n", container_path);
+    }
+
+    if(ok) {
+        PMPI_File_set_size(fh, 0);          // in case a larger file exists
+        ok = copy_sections(&cb, fh, index);
+        if(logger->rank == 0) {
+            ok = ok && write_at(fh, 0, &header, sizeof(header)) &&
+                 write_at(fh, sizeof(header), cb.sections, sizeof(RecorderSection) * cb.num_sections) &&
+                 write_at(fh, header.index_offset, index, sizeof(RecorderRankIndex) * nprocs);
+        }
+        // Only a container that reached the file system is complete
+        if(PMPI_File_sync(fh) != MPI_SUCCESS)
+            ok = 0;
+        if(GOTCHA_REAL_CALL(MPI_File_close)(&fh) != MPI_SUCCESS)
+            ok = 0;
+        PMPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, comm);
+
+        if(ok) {
+            // The container replaces the separate files
+            for(int i = 0; i < cb.num_sections; i++) {
+                if(section_owner(&cb, i) != logger->rank)
+                    continue;
+                char path[1100];
+                section_path(&cb, cb.sections[i].name, path);
+                GOTCHA_REAL_CALL(remove)(path);
+            }
+        } else if(logger->rank == 0) {
+            RECORDER_LOGERR("[Recorder] failed to write %s, keep the separate trace files\n", container_path);
+            GOTCHA_REAL_CALL(remove)(container_path);
+        }
+    }
+
+    recorder_free(index, sizeof(RecorderRankIndex) * nprocs);
+    recorder_free(cb.sections, sizeof(RecorderSection) * max_sections);
+}
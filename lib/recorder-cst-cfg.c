@@ -5,6 +5,7 @@
 #include <errno.h>
 #include "recorder.h"
 #include "recorder-sequitur.h"
+#include "recorder-varint.h"
 
 
 /**
@@ -127,32 +128,312 @@ Record* cs_to_record(CallSignature *cs) {
     return record;
 }
 
+/*
+ * Statistics-only timing mode: account one call of the
+ * given duration (in seconds) to the signature
+ */
+void cs_stats_add(CallSignature* cs, double duration, double resolution) {
+    CallStats *stats = cs->stats;
+    if(stats == NULL) {
+        stats = cs->stats = recorder_malloc(sizeof(CallStats));
+        memset(stats, 0, sizeof(CallStats));
+        stats->min = duration;
+        stats->max = duration;
+    }
+    if(duration < stats->min) stats->min = duration;
+    if(duration > stats->max) stats->max = duration;
+    stats->sum    += duration;
+    stats->sum_sq += duration * duration;
+
+    uint64_t ticks = duration > 0 ? (uint64_t)(duration / resolution) : 0;
+    int bucket = 0;
+    while(ticks && bucket < RECORDER_STATS_BUCKETS-1) {
+        ticks >>= 1;
+        bucket++;
+    }
+    stats->histogram[bucket]++;
+}
+
+void cs_stats_merge(CallStats* dst, CallStats* src) {
+    if(src->min < dst->min) dst->min = src->min;
+    if(src->max > dst->max) dst->max = src->max;
+    dst->sum    += src->sum;
+    dst->sum_sq += src->sum_sq;
+    for(int i = 0; i < RECORDER_STATS_BUCKETS; i++)
+        dst->histogram[i] += src->histogram[i];
+}
+
+static CallStats* cs_stats_dup(CallStats* src) {
+    CallStats *stats = recorder_malloc(sizeof(CallStats));
+    memcpy(stats, src, sizeof(CallStats));
+    return stats;
+}
+
+/**
+ * Memory budget
+ *
+ * Once grammar+cst memory reaches budget_next_check, the reducible
+ * function with the most CST entries is switched to reduced call
+ * signatures: from then on its offset and count arguments are
+ * replaced by RECORDER_REDUCED_ARG before the key is composed, so
+ * e.g. all pwrite() calls to the same file share one signature.
+ * Signatures recorded before stay as they are.
+ *
+ * reduced_funcs[func_id] is 1 + the index of the function in
+ * reducible_funcs, 0 if not reduced. It is set with the logger
+ * locked but read by write_record() before taking the lock, so
+ * both sides access it atomically.
+ */
+void cs_reduce_detail(RecorderLogger* logger, size_t memory) {
+    int victim = -1, most = 1;
+    for(int k = 0; k < NUM_REDUCIBLE_FUNCS; k++) {
+        unsigned char func_id = get_function_id_by_name(reducible_funcs[k].func);
+        if(logger->reduced_funcs[func_id]) continue;
+        if(logger->cst_func_entries[func_id] > most) {
+            most = logger->cst_func_entries[func_id];
+            victim = k;
+        }
+    }
+
+    // Check again a bit later, either to give the reduction a chance
+    // before reducing the next one, or because functions with a single
+    // signature so far may still get more
+    logger->budget_next_check = memory + logger->memory_budget / 20;
+
+    if(victim < 0) {
+        static bool reported = false;
+        if(!reported)
+            RECORDER_LOGERR("[Recorder] rank %d: over the memory budget, no function to reduce yet\n", logger->rank);
+        reported = true;
+        return;
+    }
+
+    unsigned char func_id = get_function_id_by_name(reducible_funcs[victim].func);
+    __atomic_store_n(&logger->reduced_funcs[func_id], 1 + victim, __ATOMIC_RELAXED);
+    RECORDER_LOGINFO("[Recorder] rank %d: memory budget, %s (%d signatures) switched to reduced signatures\n",
+                     logger->rank, reducible_funcs[victim].func, most);
+}
+
+/*
+ * Replace the offset and count arguments of a record of a reduced
+ * function, their values are returned in values. Return how many
+ * were replaced, 0 if the function is not reduced. The strings come
+ * from itoa(), so the placeholder always fits.
+ */
+int cs_reduce_args(RecorderLogger* logger, Record* record, int64_t* values) {
+    int k = __atomic_load_n(&logger->reduced_funcs[record->func_id], __ATOMIC_RELAXED) - 1;
+    if(k < 0)
+        return 0;
+    int n = 0;
+    for(int j = 0; j < 2; j++) {
+        int idx = reducible_funcs[k].args[j];
+        if(idx < 0 || idx >= record->arg_count || record->args[idx] == NULL)
+            continue;
+        values[n++] = atoll(record->args[idx]);
+        strcpy(record->args[idx], RECORDER_REDUCED_ARG);
+    }
+    return n;
+}
+
+static void args_get_filename(RecorderLogger* logger, char* args_filename) {
+    sprintf(args_filename, "%s/%d.args", logger->traces_dir, logger->rank);
+}
+
+/*
+ * Without all values the reader cannot tell which record a value
+ * belongs to, so after a failure none are kept and the reader shows
+ * RECORDER_REDUCED_ARG, as with RECORDER_REDUCED_ARGS=drop
+ */
+static void args_stream_lost(RecorderLogger* logger, const char* reason) {
+    RECORDER_LOGERR("[Recorder] rank %d: %s, the reduced arguments are lost\n", logger->rank, reason);
+    logger->args_lost = true;
+    recorder_free(logger->args_stream, logger->args_stream_cap);
+    logger->args_stream = NULL;
+    logger->args_stream_len = 0;
+    logger->args_stream_cap = 0;
+}
+
+/*
+ * Append the stream to the per-rank args file as one compressed
+ * block, like ts_write_blocks() does for the timestamps. The file
+ * is only created then, so usually the stream is written once,
+ * straight to recorder.args at finalize time.
+ */
+static void args_spill(RecorderLogger* logger) {
+    GOTCHA_SET_REAL_CALL(fopen, RECORDER_POSIX);
+    if(logger->args_file == NULL) {
+        char args_filename[1024];
+        args_get_filename(logger, args_filename);
+        logger->args_file = GOTCHA_REAL_CALL(fopen)(args_filename, "w+b");
+    }
+    if(logger->args_file == NULL ||
+       !recorder_write_block(logger->args_stream, logger->args_stream_len, logger->args_file, RECORDER_STREAM_TS)) {
+        args_stream_lost(logger, "failed to write the args file");
+        return;
+    }
+    logger->args_stream_len = 0;
+}
+
+/*
+ * Called with the logger locked, values in record order. Once the
+ * stream exceeds args_spill_limit bytes it is spilled, but only if the
+ * traces directory exists (non-MPI programs create it at finalize time).
+ */
+void cs_append_reduced_args(RecorderLogger* logger, int64_t* values, int n) {
+    if(logger->args_lost)
+        return;
+    if(logger->args_stream_len + VARINT_MAX_BYTES*n > logger->args_stream_cap) {
+        size_t cap = logger->args_stream_cap ? logger->args_stream_cap * 2 : 4096;
+        unsigned char* stream = recorder_malloc(cap);
+        if(stream == NULL) {
+            args_stream_lost(logger, "out of memory");
+            return;
+        }
+        if(logger->args_stream_len)
+            memcpy(stream, logger->args_stream, logger->args_stream_len);
+        recorder_free(logger->args_stream, logger->args_stream_cap);
+        logger->args_stream = stream;
+        logger->args_stream_cap = cap;
+    }
+    for(int i = 0; i < n; i++)
+        logger->args_stream_len += varint_put(logger->args_stream + logger->args_stream_len, zigzag_encode(values[i]));
+    logger->args_stream_values += n;
+
+    if(logger->args_stream_len >= logger->args_spill_limit && logger->directory_created)
+        args_spill(logger);
+}
+
+/*
+ * Write the side streams of all ranks into recorder.args, one entry
+ * per rank (see recorder_write_indexed_blocks()). An entry is a
+ * compressed block with the part of the stream still in memory:
+ * | size_t number of values | size_t spilled bytes | size_t tail bytes | tail varints |
+ * followed by the blocks spilled to the args file (spilled bytes),
+ * each one a compressed | varints |. The reader concatenates the
+ * spilled varints and the tail, and puts the values back, in record
+ * order, wherever it finds RECORDER_REDUCED_ARG.
+ */
+void save_reduced_args(RecorderLogger* logger) {
+    GOTCHA_SET_REAL_CALL(fopen,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fread,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fwrite, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fseek,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(ftell,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fclose, RECORDER_POSIX);
+
+    size_t header[3] = {logger->args_stream_values, 0, logger->args_stream_len};
+    if(logger->args_file) {
+        GOTCHA_REAL_CALL(fseek)(logger->args_file, 0, SEEK_END);
+        header[1] = GOTCHA_REAL_CALL(ftell)(logger->args_file);
+    }
+
+    unsigned char* entry = NULL;
+    size_t block_size = 0;
+    size_t len = sizeof(header) + logger->args_stream_len;
+    unsigned char* buf = logger->args_lost ? NULL : recorder_malloc(len);
+    if(buf) {
+        memcpy(buf, header, sizeof(header));
+        if(logger->args_stream_len)
+            memcpy(buf + sizeof(header), logger->args_stream, logger->args_stream_len);
+        entry = recorder_compress_block(buf, len, &block_size, RECORDER_STREAM_TS);
+        recorder_free(buf, len);
+    }
+
+    // followed by the spilled blocks
+    if(entry && header[1] > 0) {
+        unsigned char* tmp = realloc(entry, block_size + header[1]);
+        if(tmp) {
+            entry = tmp;
+            GOTCHA_REAL_CALL(fseek)(logger->args_file, 0, SEEK_SET);
+            if(GOTCHA_REAL_CALL(fread)(entry + block_size, 1, header[1], logger->args_file) == header[1])
+                block_size += header[1];
+            else
+                tmp = NULL;
+        }
+        if(tmp == NULL) {
+            free(entry);
+            entry = NULL;
+        }
+    }
+
+    // Without an entry the reader shows the arguments as RECORDER_REDUCED_ARG
+    if(entry == NULL && !logger->args_lost)
+        RECORDER_LOGERR("[Recorder] rank %d: failed to save the reduced arguments\n", logger->rank);
+
+    char args_filename[1096];
+    sprintf(args_filename, "%s/recorder.args", logger->traces_dir);
+
+    int mpi_initialized;
+    PMPI_Initialized(&mpi_initialized);
+    if(mpi_initialized) {
+        recorder_write_indexed_blocks(args_filename, entry, block_size, entry ? logger->rank : -1, logger->nprocs,
+                                      recorder_internal_comm(MPI_COMM_WORLD));
+    } else if(entry) {
+        size_t index[2] = {1, 2*sizeof(size_t)};
+        FILE* f = GOTCHA_REAL_CALL(fopen)(args_filename, "wb");
+        GOTCHA_REAL_CALL(fwrite)(index, sizeof(size_t), 2, f);
+        GOTCHA_REAL_CALL(fwrite)(entry, 1, block_size, f);
+        GOTCHA_REAL_CALL(fclose)(f);
+    }
+    free(entry);
+}
+
+// Release the side stream and remove the args file, if it was spilled
+void cleanup_reduced_args(RecorderLogger* logger) {
+    recorder_free(logger->args_stream, logger->args_stream_cap);
+    logger->args_stream = NULL;
+    logger->args_stream_len = 0;
+    logger->args_stream_cap = 0;
+    if(logger->args_file) {
+        GOTCHA_SET_REAL_CALL(fclose, RECORDER_POSIX);
+        GOTCHA_SET_REAL_CALL(remove, RECORDER_POSIX);
+        GOTCHA_REAL_CALL(fclose)(logger->args_file);
+        logger->args_file = NULL;
+        char args_filename[1024];
+        args_get_filename(logger, args_filename);
+        GOTCHA_REAL_CALL(remove)(args_filename);
+    }
+}
+
 void cleanup_cst(CallSignature* cst) {
     CallSignature *entry, *tmp;
     HASH_ITER(hh, cst, entry, tmp) {
         HASH_DEL(cst, entry);
+        if(entry->stats)
+            recorder_free(entry->stats, sizeof(CallStats));
         recorder_free(entry->key, entry->key_len);
         recorder_free(entry, sizeof(CallSignature));
     }
     cst = NULL;
 }
 
-void* serialize_cst(CallSignature *cst, size_t *len) {
+/*
+ * | int entries | entry 0 | entry 1 | ...
+ * Each entry:
+ * | int terminal_id | int rank | int key_len | unsigned count | key | CallStats |
+ * The CallStats are only there in statistics-only timing mode,
+ * in which case every entry has them.
+ *
+ * Serializes the entries from first to the end of the hash table
+ * (i.e., those added after it), there must be exactly entries of them.
+ */
+static void* serialize_cst_from(CallSignature *first, int entries, size_t *len) {
     *len = sizeof(int);
 
-    CallSignature *entry, *tmp;
-    HASH_ITER(hh, cst, entry, tmp) {
+    CallSignature *entry;
+    for(entry = first; entry; entry = entry->hh.next) {
         *len = *len + entry->key_len + sizeof(int)*3 + sizeof(unsigned);
+        if(entry->stats)
+            *len += sizeof(CallStats);
     }
 
-    int entries = HASH_COUNT(cst);
     void *res = recorder_malloc(*len);
     void *ptr = res;
 
     memcpy(ptr, &entries, sizeof(int));
     ptr += sizeof(int);
 
-    HASH_ITER(hh, cst, entry, tmp) {
+    for(entry = first; entry; entry = entry->hh.next) {
 
         memcpy(ptr, &entry->terminal_id, sizeof(int));
         ptr = ptr + sizeof(int);
@@ -168,243 +449,755 @@ void* serialize_cst(CallSignature *cst, size_t *len) {
 
         memcpy(ptr, entry->key, entry->key_len);
         ptr = ptr + entry->key_len;
+
+        if(entry->stats) {
+            memcpy(ptr, entry->stats, sizeof(CallStats));
+            ptr = ptr + sizeof(CallStats);
+        }
     }
 
     return res;
 }
 
-CallSignature* deserialize_cst(void *data) {
-    int num;
-    memcpy(&num, data, sizeof(int));
+void* serialize_cst(CallSignature *cst, size_t *len) {
+    return serialize_cst_from(cst, HASH_COUNT(cst), len);
+}
 
-    void *ptr = data + sizeof(int);
+void cst_get_segment_filename(RecorderLogger* logger, char* segment_filename) {
+    sprintf(segment_filename, "%s/%d.cst.segments", logger->traces_dir, logger->rank);
+}
 
-    CallSignature *cst= NULL, *entry = NULL;
-    for(int i = 0; i < num; i++) {
-        entry = recorder_malloc(sizeof(CallSignature));
+/**
+ * Background flusher
+ *
+ * Append the CST entries added since the last flush to the per-rank
+ * segment file, as one serialized CST (see serialize_cst()), followed
+ * by the entries flushed before whose count changed since:
+ * | int updates | update 0 | update 1 | ... |
+ * Each update:
+ * | int terminal_id | int count | CallStats |
+ * The CallStats are only there in statistics-only timing mode.
+ * Entries never change their terminal id, so replaying the segments
+ * of a rank in order gives its full CST as of the last flush.
+ */
+void cst_flush_segment(RecorderLogger* logger) {
+    GOTCHA_SET_REAL_CALL(fopen,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fwrite, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fflush, RECORDER_POSIX);
+
+    if(logger->cst_segment_file == NULL) {
+        char segment_filename[1024];
+        cst_get_segment_filename(logger, segment_filename);
+        logger->cst_segment_file = GOTCHA_REAL_CALL(fopen) (segment_filename, "wb");
+        if(logger->cst_segment_file == NULL) {
+            RECORDER_LOGERR("[Recorder] failed to open %s\n", segment_filename);
+            return;
+        }
+    }
 
-        memcpy( &(entry->terminal_id), ptr, sizeof(int) );
-        ptr += sizeof(int);
+    // Entries are kept in insertion, i.e., terminal id order,
+    // so the new ones are at the end
+    CallSignature *new_entries = NULL, *entry, *tmp;
+    int updates = 0;
+    size_t update_len = sizeof(int);
+    HASH_ITER(hh, logger->cst, entry, tmp) {
+        if(entry->terminal_id >= logger->cst_flushed) {
+            new_entries = entry;
+            break;
+        }
+        if(entry->count != entry->flushed_count) {
+            updates++;
+            update_len += sizeof(int)*2 + (entry->stats ? sizeof(CallStats) : 0);
+        }
+    }
 
-        memcpy( &(entry->rank), ptr, sizeof(int) );
-        ptr += sizeof(int);
+    size_t len;
+    void *data = serialize_cst_from(new_entries, logger->current_cfg_terminal - logger->cst_flushed, &len);
+
+    void *update = recorder_malloc(update_len);
+    void *ptr = update;
+    memcpy(ptr, &updates, sizeof(int));
+    ptr += sizeof(int);
+    HASH_ITER(hh, logger->cst, entry, tmp) {
+        if(entry->terminal_id < logger->cst_flushed && entry->count != entry->flushed_count) {
+            memcpy(ptr, &entry->terminal_id, sizeof(int));
+            ptr += sizeof(int);
+            memcpy(ptr, &entry->count, sizeof(int));
+            ptr += sizeof(int);
+            if(entry->stats) {
+                memcpy(ptr, entry->stats, sizeof(CallStats));
+                ptr += sizeof(CallStats);
+            }
+        }
+        entry->flushed_count = entry->count;
+    }
 
-        memcpy( &(entry->key_len), ptr, sizeof(int) );
-        ptr += sizeof(int);
+    GOTCHA_REAL_CALL(fwrite)(data, 1, len, logger->cst_segment_file);
+    GOTCHA_REAL_CALL(fwrite)(update, 1, update_len, logger->cst_segment_file);
+    GOTCHA_REAL_CALL(fflush)(logger->cst_segment_file);
+    recorder_free(data, len);
+    recorder_free(update, update_len);
 
-        memcpy( &(entry->count), ptr, sizeof(unsigned) );
-        ptr += sizeof(unsigned);
+    logger->cst_flushed = logger->current_cfg_terminal;
+    logger->cst_segment_bytes += len + update_len;
+}
 
-        entry->key = recorder_malloc(entry->key_len);
-        memcpy( entry->key, ptr, entry->key_len );
-        ptr += entry->key_len;
+void cst_cleanup_segments(RecorderLogger* logger) {
+    if(logger->cst_segment_file == NULL) return;
 
-        HASH_ADD_KEYPTR(hh, cst, entry->key, entry->key_len, entry);
-    }
+    GOTCHA_REAL_CALL(fclose)(logger->cst_segment_file);
+    logger->cst_segment_file = NULL;
 
-    return cst;
+    char segment_filename[1024];
+    cst_get_segment_filename(logger, segment_filename);
+    GOTCHA_REAL_CALL(remove)(segment_filename);
 }
 
-
 void save_cst_local(RecorderLogger* logger) {
     FILE* f = GOTCHA_REAL_CALL(fopen) (logger->cst_path, "wb");
     size_t len;
     void* data = serialize_cst(logger->cst, &len);
-    recorder_write_zlib((unsigned char*)data, len, f);
+    if(!recorder_write_block((unsigned char*)data, len, f, RECORDER_STREAM_CST))
+        RECORDER_LOGERR("[Recorder] failed to write %s\n", logger->cst_path);
     GOTCHA_REAL_CALL(fclose)(f);
 }
 
-CallSignature* copy_cst(CallSignature* origin) {
-    CallSignature* cst = NULL;
-    CallSignature *entry, *tmp, *new_entry;
-    HASH_ITER(hh, origin, entry, tmp) {
-        new_entry = recorder_malloc(sizeof(CallSignature));
-        new_entry->terminal_id = entry->terminal_id;
-        new_entry->key_len = entry->key_len;
-        new_entry->rank = entry->rank;
-        new_entry->count = entry->count;
-        new_entry->key = recorder_malloc(entry->key_len);
-        memcpy(new_entry->key, entry->key, entry->key_len);
-        HASH_ADD_KEYPTR(hh, cst, new_entry->key, new_entry->key_len, new_entry);
-    }
-    return cst;
+// What a contributor sends first for each signature
+typedef struct CSFingerprint_t {
+    uint64_t fp;
+    uint32_t check;
+    int key_len;
+    int rank;
+    int count;
+} CSFingerprint;
+
+// Owner side, one per distinct fingerprint
+typedef struct FingerprintEntry_t {
+    uint64_t fp;                // key
+    CSFingerprint first;        // the first (lowest rank) contributor
+    int count;                  // merged count of all matching contributors
+    CallStats *stats;           // merged stats, in recv_stats, NULL if no stats
+    CallSignature *cs;          // created once the key arrives
+    UT_hash_handle hh;
+} FingerprintEntry;
+
+static CallSignature* new_shard_entry(CallSignature **shard, void* key, CSFingerprint *f, int count,
+                                      CallStats *stats) {
+    CallSignature *cs = recorder_malloc(sizeof(CallSignature));
+    cs->key = recorder_malloc(f->key_len);
+    memcpy(cs->key, key, f->key_len);
+    cs->key_len = f->key_len;
+    cs->rank = f->rank;
+    cs->count = count;
+    cs->stats = stats ? cs_stats_dup(stats) : NULL;
+    cs->terminal_id = -1;
+    HASH_ADD_KEYPTR(hh, *shard, cs->key, cs->key_len, cs);
+    return cs;
 }
 
-CallSignature* compress_csts(RecorderLogger* logger) {
+/**
+ * Hash-partitioned merge of the CSTs of all ranks
+ *
+ * Every signature is merged by its owner rank, fingerprint % nprocs.
+ * The fingerprint is recorder_hash64() of the key, and recorder_hash32()
+ * serves as an independent check.
+ * Since most signatures are the same on all ranks, the full keys are
+ * only sent when needed:
+ *
+ * 1. Contributors send (fingerprint, check, key length, rank, count)
+ *    of all their signatures to the owners, and the CallStats in
+ *    statistics-only timing mode.
+ * 2. Owners merge by fingerprint and ask only the first contributor
+ *    of each fingerprint for the key. A contributor whose check or key
+ *    length differs from the first one is a fingerprint collision; it
+ *    is asked for its key too and merged by the full key.
+ * 3. Contributors send the requested keys.
+ * 4. Owners number their shard entries, offset by an exscan over the
+ *    shard sizes, and send the terminal id of each received signature
+ *    back to its contributor.
+ *
+ * @cst: the CST to merge, terminal ids must be 0..entries-1
+ * @comm: the ranks taking part in the merge
+ * @with_stats: whether the signatures carry CallStats
+ * @update_terminal_id: [out] local terminal id -> merged terminal id
+ * @overlap: if not NULL, called while the fingerprints are in flight
+ * @return: the shard of the merged CST owned by this rank
+ */
+CallSignature* compress_csts(CallSignature* cst, MPI_Comm comm, bool with_stats, int* update_terminal_id,
+                             OverlapFunc overlap, void* overlap_arg) {
+    int rank, nprocs;
+    PMPI_Comm_rank(comm, &rank);
+    PMPI_Comm_size(comm, &nprocs);
+    int entries = HASH_COUNT(cst);
 
-    int my_rank = logger->rank;
-    int other_rank;
-    int mask = 1;
-    bool done = false;
+    size_t int_array = sizeof(int) * nprocs;
+    int *send_entries = recorder_malloc(int_array);
+    int *sdispls      = recorder_malloc(int_array);
+    int *recv_entries = recorder_malloc(int_array);
+    int *rdispls      = recorder_malloc(int_array);
+    int *send_bytes   = recorder_malloc(int_array);
+    int *sbyte_displs = recorder_malloc(int_array);
+    int *recv_bytes   = recorder_malloc(int_array);
+    int *rbyte_displs = recorder_malloc(int_array);
+    int *pos          = recorder_malloc(int_array);
+    memset(send_entries, 0, int_array);
+
+    // 1. Send fingerprints, grouped by owner. sent[] remembers
+    // which local signature went where, in the same order.
+    CallSignature *entry, *tmp;
+    HASH_ITER(hh, cst, entry, tmp) {
+        send_entries[recorder_hash64(entry->key, entry->key_len) % nprocs]++;
+    }
+    for(int i = 0; i < nprocs; i++)
+        sdispls[i] = (i == 0) ? 0 : sdispls[i-1] + send_entries[i-1];
 
-    int phases = recorder_ceil(recorder_log2(logger->nprocs));
+    CSFingerprint *fps = recorder_malloc(sizeof(CSFingerprint) * entries);
+    CallStats *stats = with_stats ? recorder_malloc(sizeof(CallStats) * entries) : NULL;
+    CallSignature **sent = recorder_malloc(sizeof(CallSignature*) * entries);
+    memcpy(pos, sdispls, int_array);
+    HASH_ITER(hh, cst, entry, tmp) {
+        uint64_t fp = recorder_hash64(entry->key, entry->key_len);
+        int i = pos[fp % nprocs]++;
+        fps[i].fp      = fp;
+        fps[i].check   = recorder_hash32(entry->key, entry->key_len);
+        fps[i].key_len = entry->key_len;
+        fps[i].rank    = entry->rank;
+        fps[i].count   = entry->count;
+        if(with_stats)
+            stats[i] = *entry->stats;
+        sent[i] = entry;
+    }
 
-    CallSignature* merged_cst = copy_cst(logger->cst);
+    PMPI_Alltoall(send_entries, 1, MPI_INT, recv_entries, 1, MPI_INT, comm);
+    int total_recv = 0;
+    for(int i = 0; i < nprocs; i++) {
+        rdispls[i] = total_recv;
+        total_recv += recv_entries[i];
+    }
 
-    for(int k = 0; k < phases; k++, mask*=2) {
-        if(done) break;
+    // The count arguments are in bytes
+    for(int i = 0; i < nprocs; i++) {
+        send_bytes[i]   = send_entries[i] * sizeof(CSFingerprint);
+        sbyte_displs[i] = sdispls[i] * sizeof(CSFingerprint);
+        recv_bytes[i]   = recv_entries[i] * sizeof(CSFingerprint);
+        rbyte_displs[i] = rdispls[i] * sizeof(CSFingerprint);
+    }
+    CSFingerprint *recv_fps = recorder_malloc(sizeof(CSFingerprint) * total_recv);
+    MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    PMPI_Ialltoallv(fps, send_bytes, sbyte_displs, MPI_BYTE,
+                    recv_fps, recv_bytes, rbyte_displs, MPI_BYTE, comm, &requests[0]);
+
+    // The stats go in the same order as the fingerprints
+    CallStats *recv_stats = NULL;
+    MPI_Datatype stats_type;
+    if(with_stats) {
+        recv_stats = recorder_malloc(sizeof(CallStats) * total_recv);
+        PMPI_Type_contiguous(sizeof(CallStats), MPI_BYTE, &stats_type);
+        PMPI_Type_commit(&stats_type);
+        PMPI_Ialltoallv(stats, send_entries, sdispls, stats_type,
+                        recv_stats, recv_entries, rdispls, stats_type, comm, &requests[1]);
+    }
+    if(overlap)
+        overlap(overlap_arg);
+    PMPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+    if(with_stats)
+        PMPI_Type_free(&stats_type);
+
+    // 2. Merge by fingerprint, in source rank order,
+    // and decide which keys we need
+    FingerprintEntry *fp_table = NULL, *fe, *fe_tmp;
+    FingerprintEntry **recv_fe = recorder_malloc(sizeof(FingerprintEntry*) * total_recv);
+    char *need_key = recorder_malloc(total_recv);
+    char *send_key = recorder_malloc(entries);
+    int collisions = 0;
+    for(int i = 0; i < total_recv; i++) {
+        CSFingerprint *f = &recv_fps[i];
+        HASH_FIND(hh, fp_table, &f->fp, sizeof(uint64_t), fe);
+        if(fe == NULL) {
+            fe = recorder_malloc(sizeof(FingerprintEntry));
+            fe->fp    = f->fp;
+            fe->first = *f;
+            fe->count = f->count;
+            fe->stats = with_stats ? &recv_stats[i] : NULL;
+            fe->cs    = NULL;
+            HASH_ADD(hh, fp_table, fp, sizeof(uint64_t), fe);
+            recv_fe[i]  = fe;
+            need_key[i] = 1;
+        } else if(fe->first.check == f->check && fe->first.key_len == f->key_len) {
+            fe->count  += f->count;
+            if(with_stats)
+                cs_stats_merge(fe->stats, &recv_stats[i]);
+            recv_fe[i]  = fe;
+            need_key[i] = 0;
+        } else {
+            recv_fe[i]  = NULL;
+            need_key[i] = 1;
+            collisions++;
+        }
+    }
+    if(collisions)
+        RECORDER_LOGDBG("[Recorder] %d call signature fingerprint collisions\n", collisions);
 
-        other_rank = my_rank ^ mask;     // other_rank = my_rank XOR 2^k
+    PMPI_Alltoallv(need_key, recv_entries, rdispls, MPI_CHAR,
+                   send_key, send_entries, sdispls, MPI_CHAR, comm);
 
-        if(other_rank >= logger->nprocs) continue;
+    // 3. Send the requested keys
+    memset(send_bytes, 0, int_array);
+    for(int dst = 0; dst < nprocs; dst++) {
+        for(int i = sdispls[dst]; i < sdispls[dst] + send_entries[dst]; i++)
+            if(send_key[i]) send_bytes[dst] += sent[i]->key_len;
+    }
+    int total_send_bytes = 0;
+    for(int i = 0; i < nprocs; i++) {
+        sbyte_displs[i] = total_send_bytes;
+        total_send_bytes += send_bytes[i];
+    }
+    char *keys = recorder_malloc(total_send_bytes);
+    char *ptr = keys;
+    for(int i = 0; i < entries; i++) {
+        if(!send_key[i]) continue;
+        memcpy(ptr, sent[i]->key, sent[i]->key_len);
+        ptr += sent[i]->key_len;
+    }
 
-        size_t size, remain_cst_size;
-        void* buf;
-        void* buf_ptr;
+    PMPI_Alltoall(send_bytes, 1, MPI_INT, recv_bytes, 1, MPI_INT, comm);
+    int total_recv_bytes = 0;
+    for(int i = 0; i < nprocs; i++) {
+        rbyte_displs[i] = total_recv_bytes;
+        total_recv_bytes += recv_bytes[i];
+    }
+    char *recv_keys = recorder_malloc(total_recv_bytes);
+    PMPI_Alltoallv(keys, send_bytes, sbyte_displs, MPI_BYTE,
+                   recv_keys, recv_bytes, rbyte_displs, MPI_BYTE, comm);
+    recorder_free(keys, total_send_bytes);
+
+    // 4. Build the shard. Keys arrive in the same order as the
+    // fingerprints that asked for them.
+    CallSignature *shard = NULL;
+    CallSignature **recv_cs = recorder_malloc(sizeof(CallSignature*) * total_recv);
+    ptr = recv_keys;
+    for(int i = 0; i < total_recv; i++) {
+        CSFingerprint *f = &recv_fps[i];
+        fe = recv_fe[i];
+        if(need_key[i] && fe) {
+            fe->cs = new_shard_entry(&shard, ptr, &fe->first, fe->count, fe->stats);
+        } else if(need_key[i]) {
+            // collision, merge by the full key
+            CallStats *f_stats = with_stats ? &recv_stats[i] : NULL;
+            HASH_FIND(hh, shard, ptr, f->key_len, entry);
+            if(entry) {
+                entry->count += f->count;
+                if(with_stats)
+                    cs_stats_merge(entry->stats, f_stats);
+            } else {
+                entry = new_shard_entry(&shard, ptr, f, f->count, f_stats);
+            }
+            recv_cs[i] = entry;
+        }
+        if(need_key[i])
+            ptr += f->key_len;
+    }
 
-        // bigger ranks send to smaller ranks
-        if(my_rank < other_rank) {
-            recorder_recv(&size, sizeof(size), other_rank, mask, MPI_COMM_WORLD);
-            buf = recorder_malloc(size);
-            recorder_recv(buf, size, other_rank, mask, MPI_COMM_WORLD);
+    int shard_entries = 0;
+    for(int i = 0; i < total_recv; i++) {
+        if(recv_fe[i])
+            recv_cs[i] = recv_fe[i]->cs;
+        if(recv_cs[i]->terminal_id == -1)
+            recv_cs[i]->terminal_id = shard_entries++;
+    }
 
-            int cst_rank, entries, key_len;
-            unsigned count;
-            void *ptr = buf;
-            memcpy(&entries, ptr, sizeof(int));
-            ptr = ptr + sizeof(int);
-            for(int i = 0; i < entries; i++) {
-                // skip 4 bytes terminal id
-                ptr = ptr + sizeof(int);
+    int base = 0;
+    PMPI_Exscan(&shard_entries, &base, 1, MPI_INT, MPI_SUM, comm);
+    if(rank == 0) base = 0;     // undefined on rank 0
+    HASH_ITER(hh, shard, entry, tmp) {
+        entry->terminal_id += base;
+    }
 
-                // 4 bytes rank
-                memcpy(&cst_rank, ptr, sizeof(int));
-                ptr = ptr + sizeof(int);
+    // 5. Send the merged terminal ids back to the contributors
+    int *slots = recorder_malloc(sizeof(int) * total_recv);
+    int *ids   = recorder_malloc(sizeof(int) * entries);
+    for(int i = 0; i < total_recv; i++)
+        slots[i] = recv_cs[i]->terminal_id;
+    PMPI_Alltoallv(slots, recv_entries, rdispls, MPI_INT,
+                   ids, send_entries, sdispls, MPI_INT, comm);
+    for(int i = 0; i < entries; i++)
+        update_terminal_id[sent[i]->terminal_id] = ids[i];
+
+    HASH_ITER(hh, fp_table, fe, fe_tmp) {
+        HASH_DEL(fp_table, fe);
+        recorder_free(fe, sizeof(FingerprintEntry));
+    }
+    recorder_free(ids, sizeof(int) * entries);
+    recorder_free(slots, sizeof(int) * total_recv);
+    recorder_free(recv_cs, sizeof(CallSignature*) * total_recv);
+    recorder_free(recv_keys, total_recv_bytes);
+    recorder_free(send_key, entries);
+    recorder_free(need_key, total_recv);
+    recorder_free(recv_fe, sizeof(FingerprintEntry*) * total_recv);
+    recorder_free(recv_fps, sizeof(CSFingerprint) * total_recv);
+    recorder_free(sent, sizeof(CallSignature*) * entries);
+    recorder_free(fps, sizeof(CSFingerprint) * entries);
+    if(with_stats) {
+        recorder_free(recv_stats, sizeof(CallStats) * total_recv);
+        recorder_free(stats, sizeof(CallStats) * entries);
+    }
+    recorder_free(send_entries, int_array);
+    recorder_free(sdispls, int_array);
+    recorder_free(recv_entries, int_array);
+    recorder_free(rdispls, int_array);
+    recorder_free(send_bytes, int_array);
+    recorder_free(sbyte_displs, int_array);
+    recorder_free(recv_bytes, int_array);
+    recorder_free(rbyte_displs, int_array);
+    recorder_free(pos, int_array);
+
+    return shard;
+}
 
-                // 4 bytes key length
-                memcpy(&key_len, ptr, sizeof(int));
-                ptr = ptr + sizeof(int);
 
-                // 4 bytes count
+/**
+ * Two-level CST merge
+ *
+ * 1. Every rank serializes its CST into its own segment of a
+ *    shared-memory window on node_comm.
+ * 2. The node leader merges the segments of all ranks on the node
+ *    into a node CST, recording the node terminal id of every local
+ *    signature directly in a second window, one segment per rank.
+ * 3. Only the leaders run compress_csts() on leader_comm; the leader
+ *    then rewrites the node ids in place with the merged ids.
+ *
+ * The overlap work runs on the other ranks while their leader merges.
+ *
+ * @return: the leader's shard of the merged CST, NULL on other ranks
+ */
+static CallSignature* compress_csts_two_level(RecorderLogger* logger, int* update_terminal_id,
+                                              OverlapFunc overlap, void* overlap_arg) {
+    int node_rank, node_size;
+    PMPI_Comm_rank(logger->node_comm, &node_rank);
+    PMPI_Comm_size(logger->node_comm, &node_size);
+
+    size_t len;
+    void *data = serialize_cst(logger->cst, &len);
+    void *segment;
+    MPI_Win cst_win;
+    PMPI_Win_allocate_shared(len, 1, MPI_INFO_NULL, logger->node_comm, &segment, &cst_win);
+    memcpy(segment, data, len);
+    recorder_free(data, len);
+
+    int *mapping;
+    MPI_Win map_win;
+    PMPI_Win_allocate_shared(sizeof(int)*logger->current_cfg_terminal, sizeof(int),
+                             MPI_INFO_NULL, logger->node_comm, &mapping, &map_win);
+    PMPI_Win_fence(0, cst_win);
+    PMPI_Win_fence(0, map_win);
+
+    CallSignature *shard = NULL;
+    if(node_rank == 0) {
+        CallSignature *node_cst = NULL, *entry;
+        int node_entries = 0;
+
+        // Members are visited in world rank order, so entry->rank
+        // stays the lowest rank that has the signature
+        for(int m = 0; m < node_size; m++) {
+            MPI_Aint seg_size;
+            int disp_unit, *ids;
+            void *ptr;
+            PMPI_Win_shared_query(cst_win, m, &seg_size, &disp_unit, &ptr);
+            PMPI_Win_shared_query(map_win, m, &seg_size, &disp_unit, &ids);
+
+            int entries;
+            memcpy(&entries, ptr, sizeof(int));
+            ptr += sizeof(int);
+            for(int i = 0; i < entries; i++) {
+                int terminal_id, rank, key_len;
+                unsigned count;
+                memcpy(&terminal_id, ptr, sizeof(int));
+                ptr += sizeof(int);
+                memcpy(&rank, ptr, sizeof(int));
+                ptr += sizeof(int);
+                memcpy(&key_len, ptr, sizeof(int));
+                ptr += sizeof(int);
                 memcpy(&count, ptr, sizeof(unsigned));
-                ptr = ptr + sizeof(unsigned);
+                ptr += sizeof(unsigned);
 
-                // key length bytes key
-                void *key = recorder_malloc(key_len);
-                memcpy(key, ptr, key_len);
-                ptr = ptr + key_len;
+                // the stats (if any) follow the key, possibly unaligned
+                CallStats stats_buf, *stats = NULL;
+                if(logger->ts_stats_only) {
+                    memcpy(&stats_buf, ptr + key_len, sizeof(CallStats));
+                    stats = &stats_buf;
+                }
 
-                // Check to see if this function entry is already in the cst
-                CallSignature *entry = NULL;
-                HASH_FIND(hh, merged_cst, key, key_len, entry);
+                HASH_FIND(hh, node_cst, ptr, key_len, entry);
                 if(entry) {
-                    recorder_free(key, key_len);
                     entry->count += count;
-                } else {                                // Not exist, add to cst
-                    entry = (CallSignature*) recorder_malloc(sizeof(CallSignature));
-                    entry->key = key;
+                    if(stats)
+                        cs_stats_merge(entry->stats, stats);
+                } else {
+                    entry = recorder_malloc(sizeof(CallSignature));
+                    entry->key = recorder_malloc(key_len);
+                    memcpy(entry->key, ptr, key_len);
                     entry->key_len = key_len;
-                    entry->rank = cst_rank;
+                    entry->rank = rank;
                     entry->count = count;
-                    HASH_ADD_KEYPTR(hh, merged_cst, key, key_len, entry);
-
-                    //*key_len = sizeof(pthread_t) + sizeof(record->func_id) + sizeof(record->call_depth) +
-                    //           sizeof(record->arg_count) + sizeof(int) + arg_strlen;
-                    /*
-                    pthread_t thread_id;
-                    unsigned char func_id, call_depth, arg_count;
-                    int arg_strlen;
-                    memcpy(&thread_id, key, sizeof(thread_id));
-                    memcpy(&func_id, key+sizeof(thread_id), sizeof(func_id));
-                    memcpy(&call_depth, key+sizeof(thread_id)+sizeof(func_id), sizeof(call_depth));
-                    memcpy(&arg_count, key+sizeof(thread_id)+sizeof(func_id)+sizeof(call_depth), sizeof(arg_count));
-                    memcpy(&arg_strlen, key+sizeof(thread_id)+sizeof(func_id)+sizeof(call_depth)+sizeof(arg_count), sizeof(arg_strlen));
-                    printf("CHEN2 rank:%d tid: %ld, func_id:%d, call_depth:%d, arg_count:%d, arg_strlen:%d, count:%u, key:%s\n",
-                    cst_rank, thread_id, func_id, call_depth, arg_count, arg_strlen, count, ((char*)key)+15);
-                    */
+                    entry->stats = stats ? cs_stats_dup(stats) : NULL;
+                    entry->terminal_id = node_entries++;
+                    HASH_ADD_KEYPTR(hh, node_cst, entry->key, entry->key_len, entry);
                 }
+                ids[terminal_id] = entry->terminal_id;
+                ptr += key_len;
+                if(stats)
+                    ptr += sizeof(CallStats);
             }
-            recorder_free(buf, size);
-
-        } else {   // SENDER
-            buf = serialize_cst(merged_cst, &size);
-            recorder_send(&size, sizeof(size), other_rank, mask, MPI_COMM_WORLD);
-            recorder_send(buf, size, other_rank, mask, MPI_COMM_WORLD);
-            recorder_free(buf, size);
-            done = true;
         }
-    }
 
-    // Eventually the root (rank 0) will get the fully merged CST
-    // Update (re-assign) terminal id for all unique signatures
-    if(my_rank == 0) {
-        //linear_regression(merged_cst);
-        int terminal_id = 0;
-        CallSignature *entry, *tmp;
-        HASH_ITER(hh, merged_cst, entry, tmp) {
-            entry->terminal_id = terminal_id++;
+        int *update_node_id = recorder_malloc(sizeof(int) * node_entries);
+        shard = compress_csts(node_cst, logger->leader_comm, logger->ts_stats_only, update_node_id,
+                              overlap, overlap_arg);
+        cleanup_cst(node_cst);
+
+        for(int m = 0; m < node_size; m++) {
+            MPI_Aint seg_size;
+            int disp_unit, *ids;
+            PMPI_Win_shared_query(map_win, m, &seg_size, &disp_unit, &ids);
+            for(int i = 0; i < seg_size / sizeof(int); i++)
+                ids[i] = update_node_id[ids[i]];
         }
-    } else {
-        cleanup_cst(merged_cst);
+        recorder_free(update_node_id, sizeof(int) * node_entries);
+    } else if(overlap) {
+        overlap(overlap_arg);
     }
-    return merged_cst;
-}
 
+    PMPI_Win_fence(0, map_win);
+    memcpy(update_terminal_id, mapping, sizeof(int)*logger->current_cfg_terminal);
+    PMPI_Win_free(&map_win);
+    PMPI_Win_free(&cst_win);
+    return shard;
+}
 
-void save_cst_merged(RecorderLogger* logger) {
+/*
+ * The grammar is not updated here, the caller serializes it
+ * (possibly in the overlap work) and applies update_terminal_id
+ * to the serialized grammar with sequitur_update_serialized().
+ *
+ * @update_terminal_id: [out] local terminal id -> merged terminal id
+ */
+void save_cst_merged(RecorderLogger* logger, int* update_terminal_id, OverlapFunc overlap, void* overlap_arg) {
     // 1. Inter-process copmression for CSTs
-    // Eventually, rank 0 will have the compressed cst.
-    CallSignature* compressed_cst = compress_csts(logger);
-
-    // 2. Broadcast the merged CST to all ranks
-    size_t cst_stream_size;
-    void *cst_stream;
-
-    if(logger->rank == 0) {
-        cst_stream = serialize_cst(compressed_cst, &cst_stream_size);
+    // Every rank (or every node leader with the two-level
+    // finalize) owns a shard of the merged CST and every rank
+    // gets back the merged terminal ids of its signatures.
+    CallSignature* shard = NULL;
+    MPI_Comm shard_comm = recorder_internal_comm(MPI_COMM_WORLD);
+    if(logger->node_comm != MPI_COMM_NULL) {
+        shard = compress_csts_two_level(logger, update_terminal_id, overlap, overlap_arg);
+        shard_comm = logger->leader_comm;
+    } else {
+        shard = compress_csts(logger->cst, shard_comm, logger->ts_stats_only, update_terminal_id,
+                              overlap, overlap_arg);
+    }
 
-        recorder_bcast(&cst_stream_size, sizeof(cst_stream_size), 0, MPI_COMM_WORLD);
-        recorder_bcast(cst_stream, cst_stream_size, 0, MPI_COMM_WORLD);
+    // The local CST was only needed to get the terminal id
+    // mapping, release it before the shards are written
+    cleanup_cst(logger->cst);
+    logger->cst = NULL;
+
+    // 2. Every shard owner compresses its shard and all shards
+    // are written to recorder.cst in parallel, one block each
+    if(shard_comm != MPI_COMM_NULL) {
+        int shard_rank, num_shards;
+        PMPI_Comm_rank(shard_comm, &shard_rank);
+        PMPI_Comm_size(shard_comm, &num_shards);
+
+        size_t shard_size, block_size;
+        void* shard_stream = serialize_cst(shard, &shard_size);
+        cleanup_cst(shard);
+        unsigned char* block = recorder_compress_block(shard_stream, shard_size, &block_size, RECORDER_STREAM_CST);
+        recorder_free(shard_stream, shard_size);
+        if(block == NULL)
+            RECORDER_LOGERR("[Recorder] rank %d: out of memory, call signature shard %d is lost\n",
+                            logger->rank, shard_rank);
 
-        // 3. Rank 0 write out the compressed CST
-        errno = 0;
         char cst_fname[1096];
         sprintf(cst_fname, "%s/recorder.cst", logger->traces_dir);
-        FILE *cst_file = fopen(cst_fname, "wb");
-        if(cst_file) {
-            recorder_write_zlib(cst_stream, cst_stream_size, cst_file);
-            GOTCHA_REAL_CALL(fclose)(cst_file);
-        } else {
-            printf("[Recorder] Open file: %s failed, errno: %d\n", cst_fname, errno);
-        }
-    } else {
-        recorder_bcast(&cst_stream_size, sizeof(cst_stream_size), 0, MPI_COMM_WORLD);
-        cst_stream = recorder_malloc(cst_stream_size);
-        recorder_bcast(cst_stream, cst_stream_size, 0, MPI_COMM_WORLD);
-
-        // 3. Other rank get the compressed cst stream from rank 0
-        // then convert it to the CST
-        compressed_cst = deserialize_cst(cst_stream);
+        recorder_write_indexed_blocks(cst_fname, block, block_size, block ? shard_rank : -1, num_shards, shard_comm);
+        free(block);
     }
+}
 
-    // 4. Update function entry's terminal id
-    int *update_terminal_id = recorder_malloc(sizeof(int) * logger->current_cfg_terminal);
-    CallSignature *entry, *tmp, *res;
-    HASH_ITER(hh, logger->cst, entry, tmp) {
-        HASH_FIND(hh, compressed_cst, entry->key, entry->key_len, res);
-        if(res)
-            update_terminal_id[entry->terminal_id] = res->terminal_id;
-        else
-            printf("[Recorder] %d Not possible! Not exist in merged cst?\n", logger->rank);
+void cfg_get_epoch_filename(RecorderLogger* logger, char* epoch_filename) {
+    sprintf(epoch_filename, "%s/%d.cfg.epochs", logger->traces_dir, logger->rank);
+}
+
+/**
+ * Epoch mode
+ *
+ * Serialize the current grammar, append it to the per-rank
+ * epoch file and start a fresh grammar. Rule ids continue
+ * from the last epoch so they stay unique within this rank.
+ *
+ * Each epoch is stored as | #integers | serialized grammar |
+ */
+void cfg_flush_epoch(RecorderLogger* logger) {
+    GOTCHA_SET_REAL_CALL(fopen,  RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fwrite, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fflush, RECORDER_POSIX);
+
+    if(logger->cfg_epoch_file == NULL) {
+        char epoch_filename[1024];
+        cfg_get_epoch_filename(logger, epoch_filename);
+        logger->cfg_epoch_file = GOTCHA_REAL_CALL(fopen) (epoch_filename, "w+b");
+        if(logger->cfg_epoch_file == NULL) {
+            RECORDER_LOGERR("[Recorder] failed to open %s, epoch mode disabled\n", epoch_filename);
+            logger->epoch_memory   = 0;
+            logger->epoch_interval = 0;
+            return;
+        }
     }
 
+    int integers;
+    int* data = serialize_grammar(&logger->cfg, &integers);
+    GOTCHA_REAL_CALL(fwrite)(&integers, sizeof(int), 1, logger->cfg_epoch_file);
+    GOTCHA_REAL_CALL(fwrite)(data, sizeof(int), integers, logger->cfg_epoch_file);
+    recorder_free(data, sizeof(int)*integers);
+
+    GOTCHA_REAL_CALL(fflush)(logger->cfg_epoch_file);
+
+    int next_rule_id = logger->cfg.rule_id;
+    sequitur_cleanup(&logger->cfg);
+    sequitur_init_rule_id(&logger->cfg, next_rule_id, true);
+    logger->cfg_epochs++;
 
-    cleanup_cst(compressed_cst);
-    recorder_free(cst_stream, cst_stream_size);
+    RECORDER_LOGDBG("[Recorder] rank %d flushed grammar epoch %d\n", logger->rank, logger->cfg_epochs);
+}
+
+void cfg_cleanup_epochs(RecorderLogger* logger) {
+    if(logger->cfg_epoch_file == NULL) return;
+
+    GOTCHA_REAL_CALL(fclose)(logger->cfg_epoch_file);
+    logger->cfg_epoch_file = NULL;
+
+    char epoch_filename[1024];
+    cfg_get_epoch_filename(logger, epoch_filename);
+    GOTCHA_REAL_CALL(remove)(epoch_filename);
+}
+
+/**
+ * Serialize the grammar of this rank.
+ *
+ * Without epoch mode, this is simply serialize_grammar().
+ *
+ * In epoch mode, the flushed epochs are read back and put
+ * together with the current grammar under the root rule -1,
+ * whose body is the main rule of each epoch in order:
+ *
+ * | #rules | -1 | #epochs | main rule 1, 1, ..., main rule N, 1 |
+ * | rules of epoch 1 | ... | rules of epoch N |
+ *
+ * The reader then expands the epochs one after another
+ * without knowing about them.
+ */
+static int* serialize_cfg_epochs(RecorderLogger* logger, int* serialized_integers) {
+    GOTCHA_SET_REAL_CALL(fread, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fseek, RECORDER_POSIX);
+
+    int current_integers;
+    int* current = serialize_grammar(&logger->cfg, &current_integers);
+
+    int epochs = logger->cfg_epochs + 1;    // flushed ones + the current one
+    int rules  = 1 + current[0];
+    int total_integers = 1 + 2 + 2*epochs + (current_integers-1);
+
+    // First pass, only read the size and the rule count of each epoch
+    FILE* f = logger->cfg_epoch_file;
+    if(f) GOTCHA_REAL_CALL(fseek)(f, 0, SEEK_SET);
+    for(int i = 0; i < logger->cfg_epochs; i++) {
+        int header[2];  // #integers, #rules
+        GOTCHA_REAL_CALL(fread)(header, sizeof(int), 2, f);
+        GOTCHA_REAL_CALL(fseek)(f, sizeof(int)*(header[0]-1), SEEK_CUR);
+        rules += header[1];
+        total_integers += header[0] - 1;
+    }
+
+    int *data = recorder_malloc(sizeof(int) * total_integers);
+    int root_pos = 1;
+    int pos = 1 + 2 + 2*epochs;
+    data[0] = rules;
+    data[root_pos++] = -1;
+    data[root_pos++] = epochs;
+
+    // Second pass, copy rules of every epoch. The first rule
+    // of a serialized grammar is always its main rule.
+    if(f) GOTCHA_REAL_CALL(fseek)(f, 0, SEEK_SET);
+    for(int i = 0; i < logger->cfg_epochs; i++) {
+        int header[2];
+        GOTCHA_REAL_CALL(fread)(header, sizeof(int), 2, f);
+        GOTCHA_REAL_CALL(fread)(data+pos, sizeof(int), header[0]-1, f);
+        data[root_pos++] = data[pos];
+        data[root_pos++] = 1;
+        pos += header[0] - 1;
+    }
+    memcpy(data+pos, current+1, sizeof(int)*(current_integers-1));
+    data[root_pos++] = current[1];
+    data[root_pos++] = 1;
+    recorder_free(current, sizeof(int)*current_integers);
 
-    sequitur_update(&(logger->cfg), update_terminal_id);
-    recorder_free(update_terminal_id, sizeof(int)* logger->current_cfg_terminal);
+    *serialized_integers = total_integers;
+    return data;
 }
 
+/*
+ * If enabled, run the offline re-compression pass on the
+ * final grammar, see recorder-sequitur-minimize.c
+ */
+int* serialize_cfg(RecorderLogger* logger, int* serialized_integers) {
+    int* data;
+    if(logger->epoch_memory == 0 && logger->epoch_interval <= 0 && logger->flush_interval <= 0 &&
+       logger->cfg_epochs == 0)
+        data = serialize_grammar(&logger->cfg, serialized_integers);
+    else
+        data = serialize_cfg_epochs(logger, serialized_integers);
+
+    if(logger->cfg_recompression) {
+        int minimized_integers;
+        int* minimized = sequitur_minimize_grammar(data, *serialized_integers, &minimized_integers);
+        recorder_free(data, sizeof(int) * (*serialized_integers));
+        data = minimized;
+        *serialized_integers = minimized_integers;
+    }
+    return data;
+}
 
 void save_cfg_local(RecorderLogger* logger) {
     FILE* f = GOTCHA_REAL_CALL(fopen) (logger->cfg_path, "wb");
     int integers;
-    int* data = serialize_grammar(&logger->cfg, &integers);
-    recorder_write_zlib((unsigned char*)data, sizeof(int)*integers, f);
+    int* data = serialize_cfg(logger, &integers);
+    int bytes;
+    unsigned char* encoded = sequitur_encode_grammar(data, &bytes);
+    if(!recorder_write_block(encoded, bytes, f, RECORDER_STREAM_CFG))
+        RECORDER_LOGERR("[Recorder] failed to write %s\n", logger->cfg_path);
     GOTCHA_REAL_CALL(fclose)(f);
+    recorder_free(encoded, bytes);
+    recorder_free(data, sizeof(int)*integers);
 }
 
-void save_cfg_merged(RecorderLogger* logger) {
-    sequitur_save_unique_grammars(logger->traces_dir, &logger->cfg, logger->rank, logger->nprocs);
+/*
+ * @serialized_grammar: output of serialize_cfg() with the merged
+ * terminal ids already applied, freed here
+ */
+void save_cfg_merged(RecorderLogger* logger, int* serialized_grammar, int serialized_integers) {
+    int integers = serialized_integers;
+    int* data = serialized_grammar;
+
+    int dict_rules = 0;
+    if(logger->cfg_dictionary) {
+        int factored_integers = integers;
+        int* factored = sequitur_factor_grammars(logger->traces_dir, data, &factored_integers,
+                                                 &dict_rules, logger->rank, logger->nprocs);
+        recorder_free(data, sizeof(int)*integers);
+        data = factored;
+        integers = factored_integers;
+    }
+
+    sequitur_save_unique_grammars(logger->traces_dir, data, dict_rules, logger->rank, logger->nprocs);
+    recorder_free(data, sizeof(int)*integers);
 }
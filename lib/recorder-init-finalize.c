@@ -64,6 +64,7 @@ void update_mpi_info() {
     rank   = 0;
     nprocs = 1;
     if(mpi_initialized) {
+        recorder_init_internal_comms();
         GOTCHA_REAL_CALL(MPI_Comm_rank)(MPI_COMM_WORLD, &rank);
         GOTCHA_REAL_CALL(MPI_Comm_size)(MPI_COMM_WORLD, &nprocs);
     }
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <libgen.h>
 #include <alloca.h>
@@ -16,6 +17,9 @@ static bool initialized = false;
 
 static RecorderLogger logger;
 
+static void flusher_start();
+static void flusher_stop();
+
 /**
  * Per-thread FIFO record stack
  * pthread_t tid as key
@@ -57,6 +61,29 @@ void free_record(Record *record) {
     recorder_free(record, sizeof(Record));
 }
 
+/*
+ * Grammar and CST memory, i.e., everything allocated
+ * by recorder_malloc() except the timestamp buffers.
+ */
+static size_t trace_memory_usage() {
+    return recorder_memory_usage() - logger.ts_memory;
+}
+
+/*
+ * Check if the current grammar epoch should be flushed,
+ * either because it grew beyond the memory threshold or
+ * because the wall-clock interval has passed.
+ */
+static bool epoch_due(double now) {
+    if(logger.epoch_memory &&
+       trace_memory_usage() >= logger.epoch_base_memory + logger.epoch_memory)
+        return true;
+    if(logger.epoch_interval > 0 &&
+       now - logger.epoch_tstart >= logger.epoch_interval)
+        return true;
+    return false;
+}
+
 void write_record(Record *record) {
 
     // Before pass the record to compose_cs_key()
@@ -68,11 +95,22 @@ void write_record(Record *record) {
     if(!logger.store_call_depth)
         record->call_depth = 0;
 
+    // Memory budget: drop the offset and count arguments of
+    // reduced functions, see cs_reduce_detail()
+    int64_t reduced_values[2];
+    int num_reduced = 0;
+    if(logger.memory_budget)
+        num_reduced = cs_reduce_args(&logger, record, reduced_values);
+
     int key_len;
     char* key = compose_cs_key(record, &key_len);
 
     pthread_mutex_lock(&g_mutex);
 
+    // in record order, like the terminals of the grammar
+    if(num_reduced && logger.reduced_args == RECORDER_REDUCED_ARGS_STREAM)
+        cs_append_reduced_args(&logger, reduced_values, num_reduced);
+
     CallSignature *entry = NULL;
     HASH_FIND(hh, logger.cst, key, key_len, entry);
     if(entry) {                         // Found
@@ -85,29 +123,36 @@ void write_record(Record *record) {
         entry->rank = logger.rank;
         entry->terminal_id = logger.current_cfg_terminal++;
         entry->count = 1;
+        entry->flushed_count = 0;
+        entry->stats = NULL;
         HASH_ADD_KEYPTR(hh, logger.cst, entry->key, entry->key_len, entry);
+
+        logger.cst_func_entries[record->func_id]++;
+        if(logger.memory_budget && trace_memory_usage() >= logger.budget_next_check)
+            cs_reduce_detail(&logger, trace_memory_usage());
     }
 
     append_terminal(&logger.cfg, entry->terminal_id, 1);
 
-    // store timestamps, only write out at finalize time
-    uint32_t delta_tstart = (record->tstart-logger.prev_tstart) / logger.ts_resolution;
-    uint32_t delta_tend   = (record->tend-logger.prev_tstart)   / logger.ts_resolution;
-    logger.prev_tstart = record->tstart;
-    logger.ts[logger.ts_index++] = delta_tstart;
-    logger.ts[logger.ts_index++] = delta_tend;
-
-    // ts buffer is full, double it
-    if(logger.ts_index == logger.ts_max_elements) {
-        logger.ts_max_elements *= 2;
-        size_t ts_buf_size = logger.ts_max_elements*sizeof(uint32_t);
-        void* ptr = (uint32_t*) recorder_malloc(ts_buf_size);
-        memcpy(ptr, logger.ts, ts_buf_size/2);
-        recorder_free(logger.ts, ts_buf_size/2);
-        logger.ts = ptr;
-    }
+    // store timestamps in the stream of the thread (of the tid in the key,
+    // so one stream for all threads if thread ids are not stored), spilled
+    // to the ts file whenever the buffer is full, or only the duration
+    // statistics of the signature
+    if(logger.ts_stats_only)
+        cs_stats_add(entry, record->tend - record->tstart, logger.ts_resolution);
+    else
+        ts_append(&logger, record->tid, record->tstart, record->tend);
 
     logger.num_records++;
+
+    // Epoch mode: only flush once the traces directory exists.
+    // For non-MPI programs it is created at finalize time.
+    if((logger.epoch_memory || logger.epoch_interval > 0) &&
+       logger.directory_created && epoch_due(record->tend)) {
+        cfg_flush_epoch(&logger);
+        logger.epoch_tstart = record->tend;
+        logger.epoch_base_memory = trace_memory_usage();
+    }
     pthread_mutex_unlock(&g_mutex);
 }
 
@@ -218,11 +263,11 @@ void logger_set_mpi_info(int mpi_rank, int mpi_size) {
     if(mpi_initialized)
         recorder_barrier(MPI_COMM_WORLD);
 
-    char perprocess_ts_filename[1024];
-    ts_get_filename(&logger, perprocess_ts_filename);
-    logger.ts_file = GOTCHA_REAL_CALL(fopen) (perprocess_ts_filename, "w+b");
-
     logger.directory_created = true;
+
+    // Non-MPI programs only get here at finalize time
+    if(logger.flush_interval > 0 && mpi_initialized && initialized)
+        flusher_start();
 }
 
 
@@ -249,9 +294,7 @@ void logger_init() {
     logger.nprocs = 1;
     logger.num_records = 0;
     logger.start_ts = global_tstart;
-    logger.prev_tstart = logger.start_ts;
     logger.cst = NULL;
-    sequitur_init(&logger.cfg);
     logger.current_cfg_terminal = 0;
     logger.directory_created = false;
     logger.store_tid   = false;
@@ -259,13 +302,57 @@ void logger_init() {
     logger.interprocess_compression = true;
     logger.intraprocess_pattern_recognition = false;
     logger.interprocess_pattern_recognition = false;
-    logger.ts_index = 0;
     logger.ts_resolution = 1e-7;            // 100ns
     logger.ts_compression = true;
-    logger.ts_max_elements = 1*1024*1024;   // enough for half million records
-
-    size_t ts_buf_size = logger.ts_max_elements*sizeof(uint32_t);
-    logger.ts = recorder_malloc(ts_buf_size);
+    logger.ts_buffer_size = 4*1024*1024;    // about a million records
+    logger.ts_spill_thread = true;
+    logger.ts_spill_limit = 64*1024*1024;
+    logger.ts_stats_only = false;
+    logger.cfg_epoch_file = NULL;
+    logger.cfg_epochs = 0;
+    logger.epoch_memory = 0;
+    logger.epoch_interval = 0;
+    logger.epoch_tstart = global_tstart;
+    logger.flush_interval = 0;
+    logger.flushed_records = 0;
+    logger.cst_segment_file = NULL;
+    logger.cst_flushed = 0;
+    logger.cst_segment_bytes = 0;
+    logger.flusher_running = false;
+    logger.cfg_recompression = false;
+    logger.cfg_dictionary = true;
+    logger.node_aggregation = true;
+    logger.node_comm = MPI_COMM_NULL;
+    logger.leader_comm = MPI_COMM_NULL;
+    logger.ts_merge_request = MPI_REQUEST_NULL;
+    logger.ts_merge_win = MPI_WIN_NULL;
+    logger.ts_merge_buf = NULL;
+    logger.trace_container = false;
+    logger.memory_budget = 0;
+    logger.reduced_args = RECORDER_REDUCED_ARGS_STREAM;
+    memset(logger.reduced_funcs, 0, sizeof(logger.reduced_funcs));
+    memset(logger.cst_func_entries, 0, sizeof(logger.cst_func_entries));
+    logger.args_stream = NULL;
+    logger.args_stream_len = 0;
+    logger.args_stream_cap = 0;
+    logger.args_stream_values = 0;
+    logger.args_file = NULL;
+    logger.args_lost = false;
+
+    const char* buffer_size_str = getenv(RECORDER_BUFFER_SIZE);
+    if(buffer_size_str && atof(buffer_size_str) > 0)
+        logger.ts_buffer_size = atof(buffer_size_str) * 1024 * 1024;   // in MB
+    const char* spill_thread_str = getenv(RECORDER_BUFFER_SPILL_THREAD);
+    if(spill_thread_str)
+        logger.ts_spill_thread = atoi(spill_thread_str);
+    const char* spill_limit_str = getenv(RECORDER_BUFFER_SPILL_LIMIT);
+    if(spill_limit_str)
+        logger.ts_spill_limit = atof(spill_limit_str) * 1024 * 1024;  // in MB
+    const char* stats_only_str = getenv(RECORDER_TIME_STATS_ONLY);
+    if(stats_only_str)
+        logger.ts_stats_only = atoi(stats_only_str);
+
+    ts_init(&logger);
 
     const char* ts_compression_str = getenv(RECORDER_TIME_COMPRESSION);
     if(ts_compression_str)
@@ -291,6 +378,49 @@ void logger_init() {
     if(intraprocess_pattern_recognition_env)
         logger.intraprocess_pattern_recognition = atoi(intraprocess_pattern_recognition_env);
 
+    const char* epoch_memory_str = getenv(RECORDER_EPOCH_MEMORY);
+    if(epoch_memory_str)
+        logger.epoch_memory = atol(epoch_memory_str) * 1024 * 1024;   // in MB
+    const char* epoch_interval_str = getenv(RECORDER_EPOCH_INTERVAL);
+    if(epoch_interval_str)
+        logger.epoch_interval = atof(epoch_interval_str);            // in seconds
+    const char* flush_interval_str = getenv(RECORDER_FLUSH_INTERVAL);
+    if(flush_interval_str)
+        logger.flush_interval = atof(flush_interval_str);            // in seconds
+    const char* cfg_recompression_str = getenv(RECORDER_CFG_RECOMPRESSION);
+    if(cfg_recompression_str)
+        logger.cfg_recompression = atoi(cfg_recompression_str);
+    const char* cfg_dictionary_str = getenv(RECORDER_CFG_DICTIONARY);
+    if(cfg_dictionary_str)
+        logger.cfg_dictionary = atoi(cfg_dictionary_str);
+    const char* node_aggregation_str = getenv(RECORDER_NODE_AGGREGATION);
+    if(node_aggregation_str)
+        logger.node_aggregation = atoi(node_aggregation_str);
+    const char* trace_container_str = getenv(RECORDER_TRACE_CONTAINER);
+    if(trace_container_str)
+        logger.trace_container = atoi(trace_container_str);
+    const char* memory_budget_str = getenv(RECORDER_MEMORY_BUDGET);
+    if(memory_budget_str)
+        logger.memory_budget = atof(memory_budget_str) * 1024 * 1024;   // in MB
+    logger.budget_next_check = logger.memory_budget * 0.9;
+    // The side stream counts against the budget too, keep it
+    // below the step between two checks, see cs_reduce_detail()
+    logger.args_spill_limit = logger.ts_spill_limit;
+    if(logger.memory_budget && logger.memory_budget / 20 < logger.args_spill_limit)
+        logger.args_spill_limit = logger.memory_budget / 20;
+    const char* reduced_args_str = getenv(RECORDER_REDUCED_ARGS);
+    if(reduced_args_str && strcmp(reduced_args_str, "drop") == 0)
+        logger.reduced_args = RECORDER_REDUCED_ARGS_DROP;
+
+    // In epoch mode, rule -1 is reserved for the root rule
+    // that concatenates all epochs, see serialize_cfg().
+    // The background flusher writes the grammar as epochs too.
+    if(logger.epoch_memory || logger.epoch_interval > 0 || logger.flush_interval > 0)
+        sequitur_init_rule_id(&logger.cfg, -2, true);
+    else
+        sequitur_init(&logger.cfg);
+    logger.epoch_base_memory = trace_memory_usage();
+
     // For non-mpi programs, ignore interprocess configurations.
     const char* non_mpi_env = getenv(RECORDER_WITH_NON_MPI);
     if (non_mpi_env && atoi(non_mpi_env) == 1) {
@@ -310,6 +440,18 @@ void cleanup_record_stack() {
     }
 }
 
+/*
+ * How reduced signatures were recorded, RECORDER_REDUCED_ARGS_NONE
+ * if no rank had to reduce any (after the reduction at finalize)
+ */
+static int logger_reduced_args() {
+    for(int i = 0; i < RECORDER_MAX_FUNCS; i++) {
+        if(logger.reduced_funcs[i])
+            return logger.reduced_args;
+    }
+    return RECORDER_REDUCED_ARGS_NONE;
+}
+
 void save_global_metadata() {
     if (logger.rank != 0) return;
 
@@ -326,12 +468,15 @@ void save_global_metadata() {
         .store_tid           = logger.store_tid,
         .store_call_depth    = logger.store_call_depth,
         .start_ts            = logger.start_ts,
-        .ts_buffer_elements  = logger.ts_max_elements,
+        .ts_buffer_size      = logger.ts_buffer_size,
         .ts_compression      = logger.ts_compression,
+        .ts_stats_only       = logger.ts_stats_only,
         .interprocess_compression = logger.interprocess_compression,
         .interprocess_pattern_recognition = logger.interprocess_pattern_recognition,
         .intraprocess_pattern_recognition = logger.intraprocess_pattern_recognition,
+        .reduced_args        = logger_reduced_args(),
     };
+    memcpy(metadata.reduced_funcs, logger.reduced_funcs, sizeof(metadata.reduced_funcs));
     GOTCHA_REAL_CALL(fwrite)(&metadata, sizeof(RecorderMetadata), 1, metafh);
 
     for(int i = 0; i < sizeof(func_list)/sizeof(char*); i++) {
@@ -353,55 +498,325 @@ void save_global_metadata() {
     GOTCHA_REAL_CALL(fclose)(version_file);
 }
 
+/*
+ * Background flusher
+ *
+ * Every flush_interval seconds, everything recorded since the last
+ * flush is appended to the per-rank segment files in the traces
+ * directory: the timestamp blocks to N.ts, the new CST entries and
+ * the updated counts of the old ones to N.cst.segments and the
+ * grammar, as a new epoch, to N.cfg.epochs. Then the index N.idx is
+ * replaced with one describing the complete part of each file:
+ * | int cfg_epochs | int cst_entries | size_t cst_bytes | size_t ts_bytes |
+ * | int num_records | int num_streams | pthread_t tid of each stream |
+ * So, if the program dies, the trace up to the last flush survives.
+ * Otherwise, finalize only writes out what was recorded after it and
+ * the segment files and the index are removed.
+ */
+static void flush_index(size_t ts_bytes) {
+    GOTCHA_SET_REAL_CALL(rename, RECORDER_POSIX);
+
+    char index_filename[1024], tmp_filename[1100];
+    sprintf(index_filename, "%s/%d.idx", logger.traces_dir, logger.rank);
+    sprintf(tmp_filename, "%s.tmp", index_filename);
+
+    FILE* f = GOTCHA_REAL_CALL(fopen) (tmp_filename, "wb");
+    if(f == NULL) {
+        RECORDER_LOGERR("[Recorder] failed to open %s\n", tmp_filename);
+        return;
+    }
+    GOTCHA_REAL_CALL(fwrite)(&logger.cfg_epochs, sizeof(int), 1, f);
+    GOTCHA_REAL_CALL(fwrite)(&logger.cst_flushed, sizeof(int), 1, f);
+    GOTCHA_REAL_CALL(fwrite)(&logger.cst_segment_bytes, sizeof(size_t), 1, f);
+    GOTCHA_REAL_CALL(fwrite)(&ts_bytes, sizeof(size_t), 1, f);
+    GOTCHA_REAL_CALL(fwrite)(&logger.num_records, sizeof(int), 1, f);
+    GOTCHA_REAL_CALL(fwrite)(&logger.ts_num_streams, sizeof(int), 1, f);
+    TimestampStream *stream, *tmp;
+    HASH_ITER(hh, logger.ts_streams, stream, tmp)
+        GOTCHA_REAL_CALL(fwrite)(&stream->tid, sizeof(pthread_t), 1, f);
+    GOTCHA_REAL_CALL(fclose)(f);
+
+    // Readers see either the old or the new index
+    GOTCHA_REAL_CALL(rename)(tmp_filename, index_filename);
+}
+
+static void flush_segments() {
+    pthread_mutex_lock(&g_mutex);
+    if(logger.num_records != logger.flushed_records) {
+        size_t ts_bytes = 0;
+        if(!logger.ts_stats_only)
+            ts_bytes = ts_flush(&logger);
+        cfg_flush_epoch(&logger);
+        logger.epoch_tstart = recorder_wtime();
+        logger.epoch_base_memory = trace_memory_usage();
+        cst_flush_segment(&logger);
+        flush_index(ts_bytes);
+        logger.flushed_records = logger.num_records;
+    }
+    pthread_mutex_unlock(&g_mutex);
+}
+
+static void* flusher_thread(void* arg) {
+    pthread_mutex_lock(&logger.flusher_mutex);
+    while(!logger.flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double t = deadline.tv_sec + deadline.tv_nsec * 1e-9 + logger.flush_interval;
+        deadline.tv_sec  = (time_t) t;
+        deadline.tv_nsec = (long) ((t - deadline.tv_sec) * 1e9);
+
+        int rc = 0;
+        while(!logger.flusher_stop && rc != ETIMEDOUT)
+            rc = pthread_cond_timedwait(&logger.flusher_cond, &logger.flusher_mutex, &deadline);
+        if(logger.flusher_stop)
+            break;
+
+        pthread_mutex_unlock(&logger.flusher_mutex);
+        flush_segments();
+        pthread_mutex_lock(&logger.flusher_mutex);
+    }
+    pthread_mutex_unlock(&logger.flusher_mutex);
+    return NULL;
+}
+
+static void flusher_start() {
+    // So the trace is readable even if finalize never happens
+    save_global_metadata();
+
+    pthread_mutex_init(&logger.flusher_mutex, NULL);
+    pthread_cond_init(&logger.flusher_cond, NULL);
+    logger.flusher_stop = false;
+    logger.flusher_running = (pthread_create(&logger.flusher_tid, NULL, flusher_thread, NULL) == 0);
+    if(!logger.flusher_running)
+        RECORDER_LOGERR("[Recorder] can not create the background flusher thread\n");
+}
+
+static void flusher_stop() {
+    if(!logger.flusher_running)
+        return;
+
+    pthread_mutex_lock(&logger.flusher_mutex);
+    logger.flusher_stop = true;
+    pthread_cond_broadcast(&logger.flusher_cond);
+    pthread_mutex_unlock(&logger.flusher_mutex);
+    pthread_join(logger.flusher_tid, NULL);
+    pthread_mutex_destroy(&logger.flusher_mutex);
+    pthread_cond_destroy(&logger.flusher_cond);
+    logger.flusher_running = false;
+}
+
+/*
+ * Ranks sharing a node are grouped into node_comm, ordered by
+ * their world rank, and the first rank of each node joins
+ * leader_comm. Used by the two-level finalize.
+ */
+static void create_node_comms() {
+    int mpi_initialized;
+    PMPI_Initialized(&mpi_initialized);
+    if(!mpi_initialized || !logger.node_aggregation)
+        return;
+
+    int node_rank, node_size, num_nodes = 0;
+    MPI_Comm world = recorder_internal_comm(MPI_COMM_WORLD);
+    PMPI_Comm_split_type(world, MPI_COMM_TYPE_SHARED, logger.rank, MPI_INFO_NULL, &logger.node_comm);
+    PMPI_Comm_rank(logger.node_comm, &node_rank);
+    PMPI_Comm_size(logger.node_comm, &node_size);
+    PMPI_Comm_split(world, node_rank == 0 ? 0 : MPI_UNDEFINED, logger.rank, &logger.leader_comm);
+
+    if(logger.leader_comm != MPI_COMM_NULL)
+        PMPI_Comm_size(logger.leader_comm, &num_nodes);
+    if(logger.rank == 0)
+        RECORDER_LOGDBG("[Recorder] two-level finalize, %d nodes, %d ranks on node 0\n", num_nodes, node_size);
+}
+
+static void free_node_comms() {
+    if(logger.leader_comm != MPI_COMM_NULL)
+        PMPI_Comm_free(&logger.leader_comm);
+    if(logger.node_comm != MPI_COMM_NULL)
+        PMPI_Comm_free(&logger.node_comm);
+}
+
+/*
+ * Finalize work that does not depend on the merged CST: write out
+ * the remaining timestamps and serialize the grammar. With
+ * interprocess compression it runs while CST fingerprints are
+ * being exchanged, see compress_csts().
+ */
+typedef struct FinalizeLocalWork_t {
+    bool   serialize_cfg;
+    int*   cfg;
+    int    cfg_integers;
+    double seconds;
+} FinalizeLocalWork;
+
+static void finalize_local_work(void* arg) {
+    FinalizeLocalWork* work = arg;
+    double t = recorder_wtime();
+
+    if(!logger.ts_stats_only)
+        ts_spill_finalize(&logger);
+
+    if(work->serialize_cfg)
+        work->cfg = serialize_cfg(&logger, &work->cfg_integers);
+
+    work->seconds = recorder_wtime() - t;
+}
+
+enum {
+    PHASE_IOPR,
+    PHASE_CST,
+    PHASE_LOCAL,
+    PHASE_CFG,
+    PHASE_TS_IN_FLIGHT,
+    PHASE_TS_WAIT,
+    NUM_FINALIZE_PHASES
+};
+
+/*
+ * Report the interprocess compression time, and at debug level the
+ * slowest rank of each finalize phase. The local work is part of the
+ * CST merge, and only the wait of the timestamp merge is not hidden
+ * behind the other phases.
+ */
+static void report_finalize_phases(double* phases) {
+    if(logger.interprocess_compression && logger.rank == 0)
+        RECORDER_LOGINFO("[Recorder] interprocess compression time: %.3f secs\n",
+                         phases[PHASE_CST] + phases[PHASE_CFG]);
+    if(recorder_debug_level() < 3)
+        return;
+
+    int mpi_initialized;
+    PMPI_Initialized(&mpi_initialized);
+
+    double max_phases[NUM_FINALIZE_PHASES];
+    if(mpi_initialized)
+        PMPI_Reduce(phases, max_phases, NUM_FINALIZE_PHASES, MPI_DOUBLE, MPI_MAX, 0, recorder_internal_comm(MPI_COMM_WORLD));
+    else
+        memcpy(max_phases, phases, sizeof(max_phases));
+
+    if(logger.rank != 0)
+        return;
+    RECORDER_LOGDBG("[Recorder] finalize phases (slowest rank, secs):\n");
+    RECORDER_LOGDBG("[Recorder]   pattern recognition:  %.3f\n", max_phases[PHASE_IOPR]);
+    RECORDER_LOGDBG("[Recorder]   cst merge:            %.3f (%.3f ts write-out and cfg serialization overlapped)\n",
+                    max_phases[PHASE_CST], max_phases[PHASE_LOCAL]);
+    RECORDER_LOGDBG("[Recorder]   cfg merge:            %.3f\n", max_phases[PHASE_CFG]);
+    RECORDER_LOGDBG("[Recorder]   ts merge:             %.3f in flight, %.3f waited\n",
+                    max_phases[PHASE_TS_IN_FLIGHT], max_phases[PHASE_TS_WAIT]);
+}
+
+/*
+ * Phases and their dependencies:
+ *
+ *   pattern recognition
+ *   cst merge  <-- ts write-out, cfg serialization (overlapped)
+ *   ts merge begin                 (needs the ts write-out)
+ *   cfg merge                      (needs the cst merge and the serialized cfg)
+ *   ts merge end
+ *   metadata, container           (needs all files of all ranks)
+ */
 void logger_finalize() {
     if(!logger.directory_created)
         logger_set_mpi_info(0, 1);
 
     initialized = false;
+    flusher_stop();
 
     #ifdef RECORDER_ENABLE_CUDA_TRACE
     cuda_profiler_exit();
     #endif
 
 
-    // Write out timestamps
-    // and merge per-process ts files into a single one
-    if(logger.ts_index > 0)
-        ts_write_out(&logger);
-    GOTCHA_REAL_CALL(fflush)(logger.ts_file);
-    recorder_free(logger.ts, sizeof(uint32_t)*logger.ts_max_elements);
-    ts_merge_files(&logger);
-    GOTCHA_REAL_CALL(fclose)(logger.ts_file);
-    char perprocess_ts_filename[1024];
-    ts_get_filename(&logger, perprocess_ts_filename);
-    GOTCHA_REAL_CALL(remove)(perprocess_ts_filename);
+    create_node_comms();
+    double phases[NUM_FINALIZE_PHASES] = {0};
+    double t;
+
+    int mpi_initialized;
+    PMPI_Initialized(&mpi_initialized);
 
+    // Memory budget: the functions reduced on any rank, for the
+    // metadata, and their dropped arguments if they were kept
+    if(logger.memory_budget && mpi_initialized)
+        PMPI_Allreduce(MPI_IN_PLACE, logger.reduced_funcs, RECORDER_MAX_FUNCS, MPI_UNSIGNED_CHAR,
+                       MPI_MAX, recorder_internal_comm(MPI_COMM_WORLD));
+    if(logger_reduced_args() == RECORDER_REDUCED_ARGS_STREAM)
+        save_reduced_args(&logger);
+    cleanup_reduced_args(&logger);
 
     // interprocess I/O pattern recognition
+    t = recorder_wtime();
     if (logger.interprocess_pattern_recognition) {
         iopr_interprocess(&logger);
     }
+    phases[PHASE_IOPR] = recorder_wtime() - t;
 
     // interprocess cst and cfg compression
     cleanup_record_stack();
+    FinalizeLocalWork work = {
+        .serialize_cfg = logger.interprocess_compression,
+    };
+    double ts_merge_start;
     if(logger.interprocess_compression) {
-        double t1 = recorder_wtime();
-        save_cst_merged(&logger);
-        save_cfg_merged(&logger);
-        double t2 = recorder_wtime();
-        if(logger.rank == 0)
-            RECORDER_LOGINFO("[Recorder] interprocess compression time: %.3f secs\n", (t2-t1));
+        t = recorder_wtime();
+        int *update_terminal_id = recorder_malloc(sizeof(int) * logger.current_cfg_terminal);
+        save_cst_merged(&logger, update_terminal_id, finalize_local_work, &work);
+        phases[PHASE_CST] = recorder_wtime() - t;
+
+        // Merge per-process ts files into a single one,
+        // in the background of the cfg merge
+        ts_merge_start = recorder_wtime();
+        if(!logger.ts_stats_only)
+            ts_merge_files_begin(&logger);
+
+        t = recorder_wtime();
+        sequitur_update_serialized(work.cfg, update_terminal_id);
+        recorder_free(update_terminal_id, sizeof(int) * logger.current_cfg_terminal);
+        save_cfg_merged(&logger, work.cfg, work.cfg_integers);
+        phases[PHASE_CFG] = recorder_wtime() - t;
     } else {
+        finalize_local_work(&work);
+        ts_merge_start = recorder_wtime();
+        if(!logger.ts_stats_only)
+            ts_merge_files_begin(&logger);
         save_cst_local(&logger);
         save_cfg_local(&logger);
     }
+    phases[PHASE_LOCAL] = work.seconds;
+
+    t = recorder_wtime();
+    ts_merge_files_end(&logger);
+    phases[PHASE_TS_WAIT] = recorder_wtime() - t;
+    phases[PHASE_TS_IN_FLIGHT] = recorder_wtime() - ts_merge_start;
+    if(logger.ts_file) {
+        GOTCHA_REAL_CALL(fclose)(logger.ts_file);
+        char perprocess_ts_filename[1024];
+        ts_get_filename(&logger, perprocess_ts_filename);
+        GOTCHA_REAL_CALL(remove)(perprocess_ts_filename);
+    }
+
     cleanup_cst(logger.cst);
     sequitur_cleanup(&logger.cfg);
+    cfg_cleanup_epochs(&logger);
+    cst_cleanup_segments(&logger);
+    if(logger.flush_interval > 0) {
+        char index_filename[1024];
+        sprintf(index_filename, "%s/%d.idx", logger.traces_dir, logger.rank);
+        GOTCHA_REAL_CALL(remove)(index_filename);
+    }
+    free_node_comms();
+    report_finalize_phases(phases);
 
-    if(logger.rank == 0) {
+    if(logger.rank == 0)
         save_global_metadata();
-        RECORDER_LOGINFO("[Recorder] trace files have been written to %s\n", logger.traces_dir);
+
+    // All ranks must be done with their files
+    // before they are packed into the container
+    if(logger.trace_container && mpi_initialized) {
+        recorder_barrier(MPI_COMM_WORLD);
+        recorder_write_container(&logger);
     }
 
-}
+    if(logger.rank == 0)
+        RECORDER_LOGINFO("[Recorder] trace files have been written to %s\n", logger.traces_dir);
 
+}
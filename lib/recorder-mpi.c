@@ -35,6 +35,7 @@
 typedef struct MPICommHash_t {
     void *key;      // MPI_Comm as key
     char* id;
+    int   seq;      // communicators and files created from this one so far
     UT_hash_handle hh;
 } MPICommHash;
 
@@ -49,28 +50,97 @@ static MPICommHash *mpi_comm_table = NULL;
 static MPIFileHash *mpi_file_table = NULL;
 static int mpi_file_id = 0;
 static int mpi_comm_id = 0;
+static int world_seq = 0;
+static int self_seq = 0;
 
 // placeholder for C wrappers
 static MPI_Fint* ierr = NULL;
 
 
-void add_mpi_file(MPI_Comm comm, MPI_File *file, CONST char* filename) {
-    if(file == NULL)
-        return;
+/*
+ * Ids of new communicators and files are derived locally,
+ * without communication:
+ *
+ *   [parent id/]root-seq
+ *
+ * root is the world rank of rank 0 of the new communicator (or of
+ * the communicator the file is opened on), found by group
+ * translation. seq counts the communicators and files created from
+ * the parent so far; all ranks of the parent create them in the same
+ * order, so they agree on it. Children of MPI_COMM_WORLD omit the
+ * parent id.
+ *
+ * Parents we have not seen being created (e.g., created by calls we
+ * do not intercept) have no consistent seq. For those, rank 0 of the
+ * new communicator picks the id and broadcasts it, as before.
+ */
+static int* parent_seq(MPI_Comm parent, const char** parent_id) {
+    if(parent == MPI_COMM_WORLD) {
+        *parent_id = NULL;
+        return &world_seq;
+    }
+    if(parent == MPI_COMM_SELF) {
+        *parent_id = "MPI_COMM_SELF";
+        return &self_seq;
+    }
+    MPICommHash *entry = NULL;
+    HASH_FIND(hh, mpi_comm_table, &parent, sizeof(MPI_Comm), entry);
+    if(entry == NULL)
+        return NULL;
+    *parent_id = entry->id;
+    return &entry->seq;
+}
+
+static int root_world_rank(MPI_Comm comm) {
+    MPI_Group group, world_group;
+    int zero = 0, root;
+    PMPI_Comm_group(comm, &group);
+    PMPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    PMPI_Group_translate_ranks(group, 1, &zero, world_group, &root);
+    PMPI_Group_free(&group);
+    PMPI_Group_free(&world_group);
+    return root;
+}
+
+static char* derive_id(const char* parent_id, int seq, MPI_Comm comm) {
+    int root = root_world_rank(comm);
+    size_t len = (parent_id ? strlen(parent_id) + 1 : 0) + 32;
+    char* id = calloc(len, sizeof(char));
+    if(parent_id)
+        sprintf(id, "%s/%d-%d", parent_id, root, seq);
+    else
+        sprintf(id, "%d-%d", root, seq);
+    return id;
+}
 
+// rank 0 of comm decides the id and broadcasts it
+static char* bcast_id(MPI_Comm comm, int* counter) {
     int rank, world_rank;
     PMPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
     PMPI_Comm_rank(comm, &rank);
+    char* id = calloc(64, sizeof(char));
+    if(rank == 0)
+        sprintf(id, "MPI_COMM_UNKNOWN/%d-%d", world_rank, (*counter)++);
+    recorder_bcast(id, 64, 0, comm);
+    return id;
+}
+
+void add_mpi_file(MPI_Comm comm, MPI_File *file, CONST char* filename) {
+    const char* parent_id;
+    int* seq = parent_seq(comm, &parent_id);
+    int file_seq = seq ? (*seq)++ : 0;
+
+    if(file == NULL)
+        return;
 
     MPIFileHash *entry = malloc(sizeof(MPIFileHash));
     entry->key = malloc(sizeof(MPI_File));
     memcpy(entry->key, file, sizeof(MPI_File));
 
-    char* id = calloc(32, sizeof(char));
-    if(rank == 0)
-        sprintf(id, "%d-%d", world_rank, mpi_file_id++);
-    recorder_bcast(id, 32, 0, comm);
-    entry->id = id;
+    if(seq)
+        entry->id = derive_id(parent_id, file_seq, comm);
+    else
+        entry->id = bcast_id(comm, &mpi_file_id);
     char* tmp_filename = realrealpath(filename);
     entry->accept = accept_filename(tmp_filename);
     free(tmp_filename);
@@ -105,25 +175,27 @@ char* file2id(MPI_File *file) {
 
 
 // Return the relative rank in the new communicator
-int add_mpi_comm(MPI_Comm *newcomm) {
+int add_mpi_comm(MPI_Comm parent, MPI_Comm *newcomm) {
+    // Count the creation even on ranks that do not get a new
+    // communicator, so all ranks of the parent agree on seq
+    const char* parent_id;
+    int* seq = parent_seq(parent, &parent_id);
+    int comm_seq = seq ? (*seq)++ : 0;
+
     if(newcomm == NULL || *newcomm == MPI_COMM_NULL)
         return - 1;
-    int new_rank, world_rank;
+    int new_rank;
     PMPI_Comm_rank(*newcomm, &new_rank);
-    PMPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 
     MPICommHash *entry = malloc(sizeof(MPICommHash));
     entry->key = malloc(sizeof(MPI_Comm));
     memcpy(entry->key, newcomm, sizeof(MPI_Comm));
+    entry->seq = 0;
 
-    // Rank 0 of the new communicator decides an unique id
-    // and broadcast it to all others, then everyone stores it
-    // in the hash table.
-    char *id = calloc(32, sizeof(char));
-    if(new_rank == 0)
-        sprintf(id, "%d-%d", world_rank, mpi_comm_id++);
-    recorder_bcast(id, 32, 0, *newcomm);
-    entry->id = id;
+    if(seq)
+        entry->id = derive_id(parent_id, comm_seq, *newcomm);
+    else
+        entry->id = bcast_id(*newcomm, &mpi_comm_id);
 
     HASH_ADD_KEYPTR(hh, mpi_comm_table, entry->key, sizeof(MPI_Comm), entry);
     return new_rank;
@@ -615,7 +687,7 @@ int RECORDER_MPI_IMP(MPI_Cart_rank) (MPI_Comm comm, CONST int coords[], int *ran
 }
 int RECORDER_MPI_IMP(MPI_Cart_create) (MPI_Comm comm_old, int ndims, CONST int dims[], CONST int periods[], int reorder, MPI_Comm *comm_cart, MPI_Fint* ierr) {
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_Cart_create, (comm_old, ndims, dims, periods, reorder, comm_cart), ierr);
-    int newrank = add_mpi_comm(comm_cart);
+    int newrank = add_mpi_comm(comm_old, comm_cart);
     char **args = assemble_args_list(7, comm2name(&comm_old), itoa(ndims), ptoa(dims), ptoa(periods), itoa(reorder), comm2name(comm_cart), itoa(newrank));
     RECORDER_INTERCEPTOR_EPILOGUE(7, args);
 }
@@ -715,21 +787,21 @@ int RECORDER_MPI_IMP(MPI_Ssend) (CONST void *buf, int count, MPI_Datatype dataty
 
 int RECORDER_MPI_IMP(MPI_Comm_split) (MPI_Comm comm, int color, int key, MPI_Comm *newcomm, MPI_Fint* ierr) {
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_Comm_split, (comm, color, key, newcomm), ierr);
-    int newrank = add_mpi_comm(newcomm);
+    int newrank = add_mpi_comm(comm, newcomm);
     char **args = assemble_args_list(5, comm2name(&comm), itoa(color), itoa(key), comm2name(newcomm), itoa(newrank));
     RECORDER_INTERCEPTOR_EPILOGUE(5, args);
 }
 
 int RECORDER_MPI_IMP(MPI_Comm_create) (MPI_Comm comm, MPI_Group group, MPI_Comm *newcomm, MPI_Fint* ierr) {
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_Comm_create, (comm, group, newcomm), ierr);
-    int newrank = add_mpi_comm(newcomm);
+    int newrank = add_mpi_comm(comm, newcomm);
     char **args = assemble_args_list(4, comm2name(&comm), itoa(group), comm2name(newcomm), itoa(newrank));
     RECORDER_INTERCEPTOR_EPILOGUE(4, args);
 }
 
 int RECORDER_MPI_IMP(MPI_Comm_dup) (MPI_Comm comm, MPI_Comm *newcomm, MPI_Fint* ierr) {
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_Comm_dup, (comm, newcomm), ierr);
-    int newrank = add_mpi_comm(newcomm);
+    int newrank = add_mpi_comm(comm, newcomm);
     char **args = assemble_args_list(3, comm2name(&comm), comm2name(newcomm), itoa(newrank));
     RECORDER_INTERCEPTOR_EPILOGUE(3, args);
 }
@@ -819,6 +891,7 @@ int RECORDER_MPI_IMP(MPI_Comm_free) (MPI_Comm *comm, MPI_Fint* ierr) {
         free(entry->id);
         free(entry);
     }
+    recorder_free_internal_comm(*comm);
 
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_Comm_free, (comm), ierr);
     char **args = assemble_args_list(1, comm_name);
@@ -827,14 +900,14 @@ int RECORDER_MPI_IMP(MPI_Comm_free) (MPI_Comm *comm, MPI_Fint* ierr) {
 
 int RECORDER_MPI_IMP(MPI_Cart_sub) (MPI_Comm comm, CONST int remain_dims[], MPI_Comm *newcomm, MPI_Fint* ierr) {
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_Cart_sub, (comm, remain_dims, newcomm), ierr);
-    int newrank = add_mpi_comm(newcomm);
+    int newrank = add_mpi_comm(comm, newcomm);
     char **args = assemble_args_list(4, comm2name(&comm), ptoa(remain_dims), comm2name(newcomm), itoa(newrank));
     RECORDER_INTERCEPTOR_EPILOGUE(4, args);
 }
 
 int RECORDER_MPI_IMP(MPI_Comm_split_type) (MPI_Comm comm, int split_type, int key, MPI_Info info, MPI_Comm *newcomm, MPI_Fint* ierr) {
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_Comm_split_type, (comm, split_type, key, info, newcomm), ierr);
-    int newrank = add_mpi_comm(newcomm);
+    int newrank = add_mpi_comm(comm, newcomm);
     char **args = assemble_args_list(6, comm2name(&comm), itoa(split_type), itoa(key), ptoa(&info), comm2name(newcomm), itoa(newrank));
     RECORDER_INTERCEPTOR_EPILOGUE(6, args);
 }
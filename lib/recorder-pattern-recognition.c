@@ -11,6 +11,7 @@
 struct offset_cs_entry {
     int offset_key_start;
     int offset_key_end;
+    bool reduced;           // offset dropped because of the memory budget
     CallSignature* cs;
 };
 
@@ -32,173 +33,271 @@ off64_t iopr_intraprocess(const char *func, off64_t offset) {
     }
 }
 
-int count_function(RecorderLogger *logger, unsigned char filter_func_id) {
-    int func_count = 0;
+/*
+ * Candidate functions and the index of their offset argument
+ */
+static const struct {
+    const char* func;
+    int offset_arg_idx;
+} iopr_funcs[] = {
+    {"lseek", 1},
+    {"lseek64", 1},
+    {"pread", 3},
+    {"pread64", 3},
+    {"pwrite", 3},
+    {"pwrite64", 3},
+    {"MPI_File_read_at", 1},
+    {"MPI_File_read_at_all", 1},
+    {"MPI_File_write_at", 1},
+    {"MPI_File_write_at_all", 1},
+};
+#define NUM_IOPR_FUNCS ((int)(sizeof(iopr_funcs)/sizeof(iopr_funcs[0])))
 
-    CallSignature *entry, *tmp;
-    HASH_ITER(hh, logger->cst, entry, tmp) {
-        void* ptr = entry->key+sizeof(pthread_t);
-        unsigned char func_id;
-        memcpy(&func_id, ptr, sizeof(func_id));
-        if(func_id == filter_func_id)
-            func_count++;
+// Result of the linear fit of one signature, offset = a * world rank + b
+struct offset_pattern {
+    long int a;
+    long int b;
+    int same_pattern;
+};
+
+// Locate the offset argument in the key, between start and end
+static long int parse_offset(CallSignature* entry, int offset_arg_idx, int args_start,
+                             struct offset_cs_entry* out) {
+    char* key = (char*) entry->key;
+
+    int arg_idx = 0;
+    int start = args_start, end = args_start;
+
+    for(int i = args_start; i < entry->key_len; i++) {
+        if(key[i] == ' ') {
+            if(arg_idx == offset_arg_idx) {
+                end = i;
+                break;
+            } else {
+                arg_idx++;
+                start = i;
+            }
+        }
     }
 
-    return func_count;
+    assert(end > start);
+    char offset_str[64] = {0};
+    memcpy(offset_str, key+start+1, end-start-1);
+
+    out->offset_key_start = start;
+    out->offset_key_end   = end;
+    out->reduced = (strcmp(offset_str, RECORDER_REDUCED_ARG) == 0);
+    out->cs = entry;
+    return atol(offset_str);
 }
 
-void iopr_interprocess_by_func(RecorderLogger *logger, char* func_name, int offset_arg_idx) {
+// Store the pattern instead of the actual offset in the call signature
+static void replace_offset(RecorderLogger *logger, struct offset_cs_entry* e, long int a, long int b) {
+    int args_start = cs_key_args_start();
+    HASH_DEL(logger->cst, e->cs);
 
-    unsigned char filter_func_id = get_function_id_by_name(func_name);
-    int func_count = count_function(logger, filter_func_id);
+    int start = e->offset_key_start;
+    int end   = e->offset_key_end;
 
-    struct offset_cs_entry *offset_cs_entries = malloc(sizeof(struct offset_cs_entry) * func_count);
-    long int *offsets = malloc(sizeof(long int) * func_count);
+    char* tmp = calloc(64, 1);
+    sprintf(tmp, "%ld*r+%ld", a, b);
 
-    int args_start = cs_key_args_start();
+    int old_keylen = e->cs->key_len;
+    int new_keylen = old_keylen - (end-start-1) + strlen(tmp);
+    int new_arg_strlen = new_keylen - args_start;
 
-    int idx = 0;
-    CallSignature* entry;
-    CallSignature* tmp;
-    HASH_ITER(hh, logger->cst, entry, tmp) {
-        void* ptr = entry->key+sizeof(pthread_t);
+    void* newkey = malloc(new_keylen);
+    void* oldkey = e->cs->key;
 
-        unsigned char func_id;
-        memcpy(&func_id, ptr, sizeof(unsigned char));
+    memcpy(newkey, oldkey, start+1);
+    memcpy(newkey+args_start-sizeof(int), &new_arg_strlen, sizeof(int));
+    memcpy(newkey+start+1, tmp, strlen(tmp));
+    memcpy(newkey+start+1+strlen(tmp), oldkey+end, old_keylen-end);
 
-        if(func_id == filter_func_id) {
+    e->cs->key = newkey;
+    e->cs->key_len = new_keylen;
+    HASH_ADD_KEYPTR(hh, logger->cst, e->cs->key, e->cs->key_len, e->cs);
 
-            char* key = (char*) entry->key;
+    free(oldkey);
+    free(tmp);
+}
 
-            int arg_idx = 0;
-            int start = args_start, end = args_start;
+/*
+ * Interprocess offset pattern recognition, one fused pass over
+ * all candidate functions:
+ *
+ * 1. Every rank packs the offsets of all candidate signatures into
+ *    one buffer, grouped by function, in CST order.
+ * 2. Ranks are grouped by their vector of per-function signature
+ *    counts with a single split. The color is a hash of the vector,
+ *    so the group verifies that all its members have the same vector
+ *    and gives up otherwise.
+ * 3. The i-th signature of every rank in a group is checked for
+ *    offset = a * rank + b, where rank is the world rank, not the
+ *    rank within the group: the reader evaluates the pattern with
+ *    the world rank, and it holds even if some ranks are in other
+ *    groups. The checks
+ *    are distributed: each rank receives one slice of the signatures
+ *    from all group members.
+ * 4. The results of all slices are allgathered and every rank
+ *    rewrites its matching signatures.
+ *
+ * The number of collectives does not depend on the number of
+ * functions or signatures.
+ */
+void iopr_interprocess(RecorderLogger *logger) {
 
-            for(int i = args_start; i < entry->key_len; i++) {
-                if(key[i] == ' ') {
-                    if(arg_idx == offset_arg_idx) {
-                        end = i;
-                        break;
-                    } else {
-                        arg_idx++;
-                        start = i;
-                    }
-                }
-            }
+    // Non-MPI programs
+    // no need for interprocess pattern recognition
+    int mpi_initialized;
+    PMPI_Initialized(&mpi_initialized);
+    if (!mpi_initialized)
+        return;
 
-            assert(end > start);
-            char offset_str[64] = {0};
-            memcpy(offset_str, key+start+1, end-start-1);
-            long int offset = atol(offset_str);
+    unsigned char func_ids[NUM_IOPR_FUNCS];
+    int counts[NUM_IOPR_FUNCS] = {0};
+    for(int k = 0; k < NUM_IOPR_FUNCS; k++)
+        func_ids[k] = get_function_id_by_name(iopr_funcs[k].func);
 
-            offsets[idx] = offset;
-            offset_cs_entries[idx].offset_key_start = start;
-            offset_cs_entries[idx].offset_key_end   = end;
-            offset_cs_entries[idx].cs = entry;
+    // 1. Count and pack the offsets
+    CallSignature *entry, *tmp;
+    HASH_ITER(hh, logger->cst, entry, tmp) {
+        unsigned char func_id;
+        memcpy(&func_id, entry->key+sizeof(pthread_t), sizeof(func_id));
+        for(int k = 0; k < NUM_IOPR_FUNCS; k++)
+            if(func_id == func_ids[k]) counts[k]++;
+    }
 
-            idx++;
+    int total = 0, pos[NUM_IOPR_FUNCS];
+    for(int k = 0; k < NUM_IOPR_FUNCS; k++) {
+        pos[k] = total;
+        total += counts[k];
+    }
+
+    int args_start = cs_key_args_start();
+    struct offset_cs_entry *offset_cs_entries = malloc(sizeof(struct offset_cs_entry) * total);
+    long int *offsets = malloc(sizeof(long int) * total);
+    HASH_ITER(hh, logger->cst, entry, tmp) {
+        unsigned char func_id;
+        memcpy(&func_id, entry->key+sizeof(pthread_t), sizeof(func_id));
+        for(int k = 0; k < NUM_IOPR_FUNCS; k++) {
+            if(func_id != func_ids[k]) continue;
+            int idx = pos[k]++;
+            offsets[idx] = parse_offset(entry, iopr_funcs[k].offset_arg_idx, args_start, &offset_cs_entries[idx]);
         }
     }
 
+    // 2. Group ranks by their count vector
     GOTCHA_SET_REAL_CALL(MPI_Comm_split, RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Comm_size,  RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Comm_rank,  RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Comm_free,  RECORDER_MPI);
-    GOTCHA_SET_REAL_CALL(MPI_Allgather,  RECORDER_MPI);
 
     MPI_Comm comm;
     int comm_size, comm_rank;
-    GOTCHA_REAL_CALL(MPI_Comm_split)(MPI_COMM_WORLD, func_count, logger->rank, &comm);
+    int color = (int)(recorder_hash32(counts, sizeof(counts)) & 0x7fffffff);
+    GOTCHA_REAL_CALL(MPI_Comm_split)(recorder_internal_comm(MPI_COMM_WORLD), color, logger->rank, &comm);
     GOTCHA_REAL_CALL(MPI_Comm_size)(comm, &comm_size);
     GOTCHA_REAL_CALL(MPI_Comm_rank)(comm, &comm_rank);
 
+    // max of counts and of -counts, i.e., min of counts, at once
+    int bounds[2*NUM_IOPR_FUNCS], max_bounds[2*NUM_IOPR_FUNCS];
+    for(int k = 0; k < NUM_IOPR_FUNCS; k++) {
+        bounds[k] = counts[k];
+        bounds[k+NUM_IOPR_FUNCS] = -counts[k];
+    }
+    PMPI_Allreduce(bounds, max_bounds, 2*NUM_IOPR_FUNCS, MPI_INT, MPI_MAX, comm);
+    bool same_counts = true;
+    for(int k = 0; k < NUM_IOPR_FUNCS; k++)
+        if(max_bounds[k] != -max_bounds[k+NUM_IOPR_FUNCS]) same_counts = false;
+
     if(comm_rank == 0)
-        RECORDER_LOGDBG("%s count: %d, comm size: %d\n", func_name, func_count, comm_size);
-
-    if(comm_size > 2) {
-        long int *all_offsets = calloc(comm_size*(func_count), sizeof(long int));
-        GOTCHA_REAL_CALL(MPI_Allgather)(offsets, func_count, MPI_LONG,
-                                            all_offsets, func_count, MPI_LONG, comm);
-
-        // Fory every offset of the same I/O call
-        // check if it is the form of offset = a * rank + b;
-        for(int i = 0; i < func_count; i++) {
-
-            long int o1 = all_offsets[i];
-            long int o2 = all_offsets[i+func_count];
-            long int a = o2 - o1;
-            long int b = o1;
-            int same_pattern = 1;
-            for(int r = 0; r < comm_size; r++) {
-                long int o = all_offsets[i+func_count*r];
-                if(o != a*r+b) {
+        RECORDER_LOGDBG("[Recorder] offset pattern recognition, signatures: %d, comm size: %d%s\n",
+                        total, comm_size, same_counts ? "" : " (count vector collision, skipped)");
+
+    if(comm_size > 2 && total > 0 && same_counts) {
+        // 3. Group rank j checks signatures [lo(j), lo(j+1))
+        #define SLICE_START(j) ((int)((long)total * (j) / comm_size))
+        int my_slice = SLICE_START(comm_rank+1) - SLICE_START(comm_rank);
+        int *sendcounts = malloc(sizeof(int) * comm_size);
+        int *sdispls    = malloc(sizeof(int) * comm_size);
+        int *recvcounts = malloc(sizeof(int) * comm_size);
+        int *rdispls    = malloc(sizeof(int) * comm_size);
+        for(int j = 0; j < comm_size; j++) {
+            sendcounts[j] = SLICE_START(j+1) - SLICE_START(j);
+            sdispls[j]    = SLICE_START(j);
+            recvcounts[j] = my_slice;
+            rdispls[j]    = my_slice * j;
+        }
+        long int *slice_offsets = malloc(sizeof(long int) * my_slice * comm_size);
+        PMPI_Alltoallv(offsets, sendcounts, sdispls, MPI_LONG,
+                       slice_offsets, recvcounts, rdispls, MPI_LONG, comm);
+
+        // World ranks of the group members, no communication needed
+        int *world_ranks = malloc(sizeof(int) * comm_size);
+        MPI_Group group, world_group;
+        PMPI_Comm_group(comm, &group);
+        PMPI_Comm_group(MPI_COMM_WORLD, &world_group);
+        for(int r = 0; r < comm_size; r++)
+            recvcounts[r] = r;
+        PMPI_Group_translate_ranks(group, comm_size, recvcounts, world_group, world_ranks);
+        PMPI_Group_free(&group);
+        PMPI_Group_free(&world_group);
+
+        struct offset_pattern *slice_patterns = malloc(sizeof(struct offset_pattern) * my_slice);
+        for(int i = 0; i < my_slice; i++) {
+            long int o1 = slice_offsets[i];
+            long int o2 = slice_offsets[i+my_slice];
+            long int dr = world_ranks[1] - world_ranks[0];
+            int same_pattern = ((o2 - o1) % dr == 0);
+            long int a = (o2 - o1) / dr;
+            long int b = o1 - a * world_ranks[0];
+            for(int r = 0; r < comm_size && same_pattern; r++) {
+                long int o = slice_offsets[i+my_slice*r];
+                if(o != a*world_ranks[r]+b)
                     same_pattern = 0;
-                    break;
-                }
             }
+            slice_patterns[i].a = a;
+            slice_patterns[i].b = b;
+            slice_patterns[i].same_pattern = same_pattern;
+        }
 
-            // Everyone has the same pattern of offset
-            // Then modify the call signature to store
-            // the pattern instead of the actuall offset
-            // TODO we should store a and b, but now we
-            // store a only
-            if(same_pattern) {
-                HASH_DEL(logger->cst, offset_cs_entries[i].cs);
-
-                int start = offset_cs_entries[i].offset_key_start;
-                int end   = offset_cs_entries[i].offset_key_end;
-
-                char* tmp = calloc(64, 1);
-                sprintf(tmp, "%ld*r+%ld", a, b);
-
-                if(comm_rank == 0)
-                    RECORDER_LOGDBG("pattern recognized %d: offset = %ld*rank+%ld\n", offset_cs_entries[i].cs->terminal_id, a, b);
-
-                int old_keylen = offset_cs_entries[i].cs->key_len;
-                int new_keylen = old_keylen - (end-start-1) + strlen(tmp);
-                int new_arg_strlen = new_keylen - args_start;
-
-                void* newkey = malloc(new_keylen);
-                void* oldkey = offset_cs_entries[i].cs->key;
-
-                memcpy(newkey, oldkey, start+1);
-                memcpy(newkey+args_start-sizeof(int), &new_arg_strlen, sizeof(int));
-                memcpy(newkey+start+1, tmp, strlen(tmp));
-                memcpy(newkey+start+1+strlen(tmp), oldkey+end, old_keylen-end);
-
-                offset_cs_entries[i].cs->key = newkey;
-                offset_cs_entries[i].cs->key_len = new_keylen;
-                HASH_ADD_KEYPTR(hh, logger->cst, offset_cs_entries[i].cs->key, offset_cs_entries[i].cs->key_len, offset_cs_entries[i].cs);
-
-
-                free(oldkey);
-                free(tmp);
-            }
+        // 4. Everyone gets the results of all slices
+        for(int j = 0; j < comm_size; j++) {
+            recvcounts[j] = sendcounts[j] * sizeof(struct offset_pattern);
+            rdispls[j]    = sdispls[j] * sizeof(struct offset_pattern);
         }
-        free(all_offsets);
+        struct offset_pattern *patterns = malloc(sizeof(struct offset_pattern) * total);
+        PMPI_Allgatherv(slice_patterns, my_slice*sizeof(struct offset_pattern), MPI_BYTE,
+                        patterns, recvcounts, rdispls, MPI_BYTE, comm);
+        #undef SLICE_START
+
+        // Everyone has the same pattern of offset
+        // Then modify the call signature to store
+        // the pattern instead of the actuall offset
+        int recognized = 0;
+        for(int i = 0; i < total; i++) {
+            if(!patterns[i].same_pattern || offset_cs_entries[i].reduced) continue;
+            if(comm_rank == 0)
+                RECORDER_LOGDBG("pattern recognized %d: offset = %ld*rank+%ld\n",
+                                offset_cs_entries[i].cs->terminal_id, patterns[i].a, patterns[i].b);
+            replace_offset(logger, &offset_cs_entries[i], patterns[i].a, patterns[i].b);
+            recognized++;
+        }
+        if(comm_rank == 0)
+            RECORDER_LOGDBG("[Recorder] offset patterns recognized: %d\n", recognized);
+
+        free(patterns);
+        free(world_ranks);
+        free(slice_patterns);
+        free(slice_offsets);
+        free(sendcounts);
+        free(sdispls);
+        free(recvcounts);
+        free(rdispls);
     }
 
     GOTCHA_REAL_CALL(MPI_Comm_free)(&comm);
     free(offsets);
     free(offset_cs_entries);
 }
-
-void iopr_interprocess(RecorderLogger *logger) {
-
-    // Non-MPI programs
-    // no need for interprocess pattern recognition
-    int mpi_initialized;
-    PMPI_Initialized(&mpi_initialized);
-    if (!mpi_initialized)
-        return;
-
-    iopr_interprocess_by_func(logger, "lseek", 1);
-    iopr_interprocess_by_func(logger, "lseek64", 1);
-    iopr_interprocess_by_func(logger, "pread", 3);
-    iopr_interprocess_by_func(logger, "pread64", 3);
-    iopr_interprocess_by_func(logger, "pwrite", 3);
-    iopr_interprocess_by_func(logger, "pwrite64", 3);
-    iopr_interprocess_by_func(logger, "MPI_File_read_at", 1);
-    iopr_interprocess_by_func(logger, "MPI_File_read_at_all", 1);
-    iopr_interprocess_by_func(logger, "MPI_File_write_at", 1);
-    iopr_interprocess_by_func(logger, "MPI_File_write_at_all", 1);
-}
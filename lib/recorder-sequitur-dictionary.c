@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) by Argonne National Laboratory
+ *     See COPYRIGHT in top-level directory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "recorder-sequitur.h"
+#include "recorder-utils.h"
+#include "mpi.h"
+
+
+/**
+ * Interprocess grammar factoring
+ *
+ * Grammars of different ranks are often identical except for a few
+ * rules, so byte-level deduplication of whole grammars does not help.
+ * Here, every non-main rule gets a structural (Merkle) hash computed
+ * from its body, where a non-terminal contributes the hash of the
+ * rule it refers to. Rules whose hash shows up in at least two ranks
+ * are moved into a shared dictionary that rank 0 writes once to
+ * ug.dict. The per-rank grammars refer to them by dictionary id:
+ *
+ *   -1:                        main rule of the rank
+ *   -2 ... -(D+1):             dictionary rules
+ *   -(D+2) ...:                rules local to the rank
+ *
+ * The dictionary is closed: if a rule is shared, so are the rules
+ * it uses, since their hashes are part of its hash.
+ *
+ * Rules are matched by hash only, so once the dictionary is built
+ * every rank checks that its rules mapped to dictionary ids have
+ * exactly the same bodies as the dictionary rules. If any rank finds
+ * a difference (a hash collision), no rule is shared at all.
+ */
+
+typedef struct HashedRule_t {
+    int id;                 // key, rule id in the input grammar
+    int symbols;
+    int *body;              // points into the input grammar, val and exp pairs
+    uint64_t hash;
+    bool hashed;
+    int new_id;
+    UT_hash_handle hh;
+} HashedRule;
+
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t rule_hash(HashedRule *rules, HashedRule *rule) {
+    if(rule->hashed)
+        return rule->hash;
+
+    uint64_t h = mix64(0x9e3779b97f4a7c15ULL ^ rule->symbols);
+    for(int i = 0; i < rule->symbols; i++) {
+        int val = rule->body[2*i];
+        int exp = rule->body[2*i+1];
+        if(val >= 0) {
+            h = mix64(h ^ 1);
+            h = mix64(h ^ (uint32_t)val);
+        } else {
+            HashedRule *child = NULL;
+            HASH_FIND_INT(rules, &val, child);
+            assert(child != NULL);
+            h = mix64(h ^ 2);
+            h = mix64(h ^ rule_hash(rules, child));
+        }
+        h = mix64(h ^ (uint32_t)exp);
+    }
+
+    rule->hash   = h;
+    rule->hashed = true;
+    return h;
+}
+
+static int compare_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// (hash, rank) pairs, sorted by hash then by rank
+static int compare_hash_rank(const void *a, const void *b) {
+    const uint64_t *x = a, *y = b;
+    if(x[0] != y[0])
+        return (x[0] > y[0]) - (x[0] < y[0]);
+    return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+static int find_dict_id(uint64_t *dict_hashes, int dict_rules, uint64_t hash) {
+    uint64_t *found = bsearch(&hash, dict_hashes, dict_rules, sizeof(uint64_t), compare_uint64);
+    if(found == NULL)
+        return 0;
+    return -2 - (int)(found - dict_hashes);
+}
+
+/*
+ * Give every rule its new id: -1 for the main rule, the dictionary
+ * id if its hash is in the dictionary, a local id otherwise. Return
+ * the number of rules that stay in the local grammar.
+ */
+static int assign_rule_ids(HashedRule *rules, int num_rules, uint64_t *dict_hashes, int D, int *kept_integers) {
+    int kept_rules = 0;
+    int next_local_id = -2 - D;
+    *kept_integers = 1;
+    for(int i = 0; i < num_rules; i++) {
+        HashedRule *rule = &rules[i];
+        if(i == 0)
+            rule->new_id = -1;
+        else
+            rule->new_id = find_dict_id(dict_hashes, D, rule->hash);
+
+        if(rule->new_id == 0)
+            rule->new_id = next_local_id--;
+        if(i == 0 || rule->new_id < -1 - D) {
+            kept_rules++;
+            *kept_integers += 2 + 2 * rule->symbols;
+        }
+    }
+    return kept_rules;
+}
+
+// Write the rule using the new ids, return the number of integers
+static int write_rule(HashedRule *rules_table, HashedRule *rule, int *out) {
+    out[0] = rule->new_id;
+    out[1] = rule->symbols;
+    for(int j = 0; j < rule->symbols; j++) {
+        int val = rule->body[2*j];
+        if(val < 0) {
+            HashedRule *child = NULL;
+            HASH_FIND_INT(rules_table, &val, child);
+            val = child->new_id;
+        }
+        out[2+2*j]   = val;
+        out[2+2*j+1] = rule->body[2*j+1];
+    }
+    return 2 + 2 * rule->symbols;
+}
+
+/*
+ * Rank 0 puts the dictionary rules sent by their owners in id
+ * order: | D | rule -2 | rule -3 | ... |, same layout as a grammar
+ */
+static int* order_dictionary(int *bodies, int integers, int dict_rules) {
+    int **rules = recorder_malloc(sizeof(int*) * dict_rules);
+    int *ptr = bodies;
+    while(ptr < bodies + integers) {
+        int d = -2 - ptr[0];
+        rules[d] = ptr;
+        ptr += 2 + 2 * ptr[1];
+    }
+
+    int *dict = recorder_malloc(sizeof(int) * (integers + 1));
+    int pos = 0;
+    dict[pos++] = dict_rules;
+    for(int d = 0; d < dict_rules; d++) {
+        int len = 2 + 2 * rules[d][1];
+        memcpy(dict + pos, rules[d], sizeof(int) * len);
+        pos += len;
+    }
+    recorder_free(rules, sizeof(int*) * dict_rules);
+    return dict;
+}
+
+/*
+ * Check that every rule of this rank that maps to a dictionary id
+ * is exactly that dictionary rule. Return false on a hash collision.
+ */
+static bool verify_dictionary(HashedRule *rules_table, HashedRule *rules, int num_rules, int *dict, int D) {
+    int **dict_rules = recorder_malloc(sizeof(int*) * D);
+    int *ptr = dict + 1;
+    for(int d = 0; d < D; d++) {
+        dict_rules[d] = ptr;
+        ptr += 2 + 2 * ptr[1];
+    }
+
+    bool same = true;
+    for(int i = 1; i < num_rules && same; i++) {
+        HashedRule *rule = &rules[i];
+        int d = -2 - rule->new_id;
+        if(d >= D)
+            continue;
+        int *expected = dict_rules[d];
+        if(expected[1] != rule->symbols) {
+            same = false;
+            break;
+        }
+        for(int j = 0; j < rule->symbols; j++) {
+            int val = rule->body[2*j];
+            if(val < 0) {
+                HashedRule *child = NULL;
+                HASH_FIND_INT(rules_table, &val, child);
+                val = child->new_id;
+            }
+            if(val != expected[2+2*j] || rule->body[2*j+1] != expected[2+2*j+1]) {
+                same = false;
+                break;
+            }
+        }
+    }
+
+    recorder_free(dict_rules, sizeof(int*) * D);
+    return same;
+}
+
+static void write_dictionary(const char* path, int *dict) {
+    int bytes;
+    unsigned char *encoded = sequitur_encode_grammar(dict, &bytes);
+
+    char dict_filename[1096] = {0};
+    sprintf(dict_filename, "%s/ug.dict", path);
+    FILE* f = fopen(dict_filename, "wb");
+    if(!recorder_write_block(encoded, bytes, f, RECORDER_STREAM_CFG))
+        RECORDER_LOGERR("[Recorder] failed to write %s\n", dict_filename);
+    fclose(f);
+
+    recorder_free(encoded, bytes);
+}
+
+/**
+ * Collective call, factors out rules shared by multiple ranks
+ *
+ * @local_grammar: serialized grammar of this rank, terminals must
+ *                 already use the global (merged CST) ids
+ * @integers:      [in/out] length of the grammar
+ * @dict_rules:    [out] number of rules in the dictionary
+ * @return:        the factored local grammar, need to be freed by the caller
+ */
+int* sequitur_factor_grammars(const char* path, int* local_grammar, int* integers,
+                              int* dict_rules, int mpi_rank, int mpi_size) {
+    MPI_Comm comm = recorder_internal_comm(MPI_COMM_WORLD);
+
+    // 1. Hash every rule
+    int *ptr = local_grammar;
+    int num_rules = *ptr++;
+    HashedRule *rules = recorder_malloc(sizeof(HashedRule) * num_rules);
+    HashedRule *rules_table = NULL;
+    for(int i = 0; i < num_rules; i++) {
+        HashedRule *rule = &rules[i];
+        rule->id      = *ptr++;
+        rule->symbols = *ptr++;
+        rule->body    = ptr;
+        rule->hashed  = false;
+        rule->new_id  = 0;
+        ptr += 2 * rule->symbols;
+        HASH_ADD_INT(rules_table, id, rule);
+    }
+
+    // The main rule (first one) always stays local
+    int num_hashes = 0;
+    uint64_t *hashes = recorder_malloc(sizeof(uint64_t) * num_rules);
+    for(int i = 1; i < num_rules; i++)
+        hashes[num_hashes++] = rule_hash(rules_table, &rules[i]);
+    qsort(hashes, num_hashes, sizeof(uint64_t), compare_uint64);
+    int unique_hashes = 0;
+    for(int i = 0; i < num_hashes; i++) {
+        if(unique_hashes == 0 || hashes[unique_hashes-1] != hashes[i])
+            hashes[unique_hashes++] = hashes[i];
+    }
+
+    // 2. Rank 0 finds hashes present in two or more ranks.
+    // The owner (lowest rank having it) will send the rule body.
+    int recvcounts[mpi_size], displs[mpi_size];
+    PMPI_Gather(&unique_hashes, 1, MPI_INT, recvcounts, 1, MPI_INT, 0, comm);
+    size_t gathered = 0;
+    if(mpi_rank == 0) {
+        for(int i = 0; i < mpi_size; i++) {
+            displs[i] = gathered;
+            gathered += recvcounts[i];
+        }
+    }
+
+    uint64_t *gathered_hashes = NULL;
+    if(mpi_rank == 0)
+        gathered_hashes = recorder_malloc(sizeof(uint64_t) * gathered);
+    PMPI_Gatherv(hashes, unique_hashes, MPI_UINT64_T, gathered_hashes, recvcounts, displs, MPI_UINT64_T, 0, comm);
+
+    int D = 0;
+    uint64_t *dict_hashes = NULL;
+    int *owners = NULL;
+    if(mpi_rank == 0) {
+        uint64_t *pairs = recorder_malloc(sizeof(uint64_t) * 2 * gathered);
+        for(int r = 0; r < mpi_size; r++) {
+            for(int i = 0; i < recvcounts[r]; i++) {
+                pairs[2*(displs[r]+i)+0] = gathered_hashes[displs[r]+i];
+                pairs[2*(displs[r]+i)+1] = r;
+            }
+        }
+        qsort(pairs, gathered, sizeof(uint64_t)*2, compare_hash_rank);
+
+        // Hashes are unique per rank, so a run of length >= 2 means
+        // the rule is shared. Reuse gathered_hashes for the result.
+        owners = recorder_malloc(sizeof(int) * (gathered/2 + 1));
+        for(size_t i = 0; i + 1 < gathered; i++) {
+            if(pairs[2*i] == pairs[2*(i+1)] && (D == 0 || gathered_hashes[D-1] != pairs[2*i])) {
+                gathered_hashes[D] = pairs[2*i];
+                owners[D] = (int) pairs[2*i+1];
+                D++;
+            }
+        }
+        dict_hashes = gathered_hashes;
+        recorder_free(pairs, sizeof(uint64_t) * 2 * gathered);
+    }
+
+    PMPI_Bcast(&D, 1, MPI_INT, 0, comm);
+    if(mpi_rank != 0) {
+        dict_hashes = recorder_malloc(sizeof(uint64_t) * D);
+        owners = recorder_malloc(sizeof(int) * D);
+    }
+    PMPI_Bcast(dict_hashes, D, MPI_UINT64_T, 0, comm);
+    PMPI_Bcast(owners, D, MPI_INT, 0, comm);
+
+    // 3. Assign the new rule ids
+    int kept_integers;
+    int kept_rules = assign_rule_ids(rules, num_rules, dict_hashes, D, &kept_integers);
+
+    // 4. Owners send the dictionary rules to rank 0
+    int owned_integers = 0;
+    bool *sent = recorder_malloc(sizeof(bool) * (D+1));
+    memset(sent, 0, sizeof(bool) * (D+1));
+    for(int i = 1; i < num_rules; i++) {
+        int d = -2 - rules[i].new_id;
+        if(d < D && owners[d] == mpi_rank && !sent[d]) {
+            owned_integers += 2 + 2 * rules[i].symbols;
+            sent[d] = true;
+        }
+    }
+
+    int *owned = recorder_malloc(sizeof(int) * owned_integers);
+    int *factored = recorder_malloc(sizeof(int) * kept_integers);
+    int opos = 0, fpos = 0;
+    factored[fpos++] = kept_rules;
+    memset(sent, 0, sizeof(bool) * (D+1));
+    for(int i = 0; i < num_rules; i++) {
+        HashedRule *rule = &rules[i];
+        int d = -2 - rule->new_id;
+        if(i == 0 || d >= D)
+            fpos += write_rule(rules_table, rule, factored + fpos);
+        else if(owners[d] == mpi_rank && !sent[d]) {
+            opos += write_rule(rules_table, rule, owned + opos);
+            sent[d] = true;
+        }
+    }
+    assert(fpos == kept_integers && opos == owned_integers);
+
+    PMPI_Gather(&owned_integers, 1, MPI_INT, recvcounts, 1, MPI_INT, 0, comm);
+    int *bodies = NULL;
+    size_t bodies_integers = 0;
+    if(mpi_rank == 0) {
+        for(int i = 0; i < mpi_size; i++) {
+            displs[i] = bodies_integers;
+            bodies_integers += recvcounts[i];
+        }
+        bodies = recorder_malloc(sizeof(int) * bodies_integers);
+    }
+    PMPI_Gatherv(owned, owned_integers, MPI_INT, bodies, recvcounts, displs, MPI_INT, 0, comm);
+
+    // 5. Check the dictionary against the rules of every rank
+    int *dict = NULL;
+    int dict_integers = bodies_integers + 1;
+    if(mpi_rank == 0)
+        dict = order_dictionary(bodies, bodies_integers, D);
+    PMPI_Bcast(&dict_integers, 1, MPI_INT, 0, comm);
+    if(mpi_rank != 0)
+        dict = recorder_malloc(sizeof(int) * dict_integers);
+    PMPI_Bcast(dict, dict_integers, MPI_INT, 0, comm);
+
+    int collision = !verify_dictionary(rules_table, rules, num_rules, dict, D);
+    PMPI_Allreduce(MPI_IN_PLACE, &collision, 1, MPI_INT, MPI_LOR, comm);
+    if(collision) {
+        // Keep every rule local
+        if(mpi_rank == 0)
+            RECORDER_LOGDBG("[Recorder] grammar rule hash collision, no grammar dictionary\n");
+        recorder_free(factored, sizeof(int) * kept_integers);
+        kept_rules = assign_rule_ids(rules, num_rules, NULL, 0, &kept_integers);
+        factored = recorder_malloc(sizeof(int) * kept_integers);
+        fpos = 0;
+        factored[fpos++] = kept_rules;
+        for(int i = 0; i < num_rules; i++)
+            fpos += write_rule(rules_table, &rules[i], factored + fpos);
+    }
+
+    if(mpi_rank == 0 && D > 0 && !collision)
+        write_dictionary(path, dict);
+
+    if(mpi_rank == 0) {
+        RECORDER_LOGDBG("[Recorder] grammar dictionary rules: %d\n", collision ? 0 : D);
+        recorder_free(bodies, sizeof(int) * bodies_integers);
+        recorder_free(gathered_hashes, sizeof(uint64_t) * gathered);
+        recorder_free(owners, sizeof(int) * (gathered/2 + 1));
+    } else {
+        recorder_free(dict_hashes, sizeof(uint64_t) * D);
+        recorder_free(owners, sizeof(int) * D);
+    }
+    recorder_free(dict, sizeof(int) * dict_integers);
+    recorder_free(owned, sizeof(int) * owned_integers);
+    recorder_free(sent, sizeof(bool) * (D+1));
+    recorder_free(hashes, sizeof(uint64_t) * num_rules);
+    HASH_CLEAR(hh, rules_table);
+    recorder_free(rules, sizeof(HashedRule) * num_rules);
+
+    *integers   = kept_integers;
+    *dict_rules = collision ? 0 : D;
+    return factored;
+}
@@ -6,21 +6,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <assert.h>
 #include "recorder-sequitur.h"
 #include "recorder-utils.h"
+#include "recorder-varint.h"
 #include "mpi.h"
 #include "uthash.h"
 
+// Identifies a serialized grammar without its bytes
+typedef struct GrammarDigest_t {
+    uint64_t hash;          // recorder_hash64() of the encoded grammar
+    uint32_t check;         // recorder_hash32(), to rule out hash collisions
+    int bytes;              // length of the encoded grammar
+} GrammarDigest;
+
 typedef struct UniqueGrammar_t {
+    GrammarDigest digest;   // key
     int ugi;                // unique grammar id
-    void *key;              // serialized grammar stream as key
-    int count;
+    int rank;               // representative, the lowest rank having this grammar
     UT_hash_handle hh;
 } UniqueGrammar;
 
-static UniqueGrammar *unique_grammars;
-static int current_ugi = 0;
-
 /**
  * Store the Grammer in an integer array
  *
@@ -39,103 +45,196 @@ int* serialize_grammar(Grammar *grammar, int* serialized_integers) {
     int symbols_count  = 0, rules_count = 0;
 
     Symbol *rule, *sym;
-    DL_COUNT(grammar->rules, rule, rules_count);
-
-    total_integers += 2 * rules_count;
-
     DL_FOREACH(grammar->rules, rule) {
         DL_COUNT(rule->rule_body, sym, symbols_count);
-        total_integers += symbols_count*2;  // val and exp
+        total_integers += 2 + symbols_count*2;  // rule head, #symbols, val and exp
+        rules_count++;
     }
 
     int i = 0;
     int *data = recorder_malloc(sizeof(int) * total_integers);
     data[i++]  = rules_count;
     DL_FOREACH(grammar->rules, rule) {
-        DL_COUNT(rule->rule_body, sym, symbols_count);
         data[i++] = rule->val;
-        data[i++] = symbols_count;
+        int count_pos = i++;            // #symbols, filled after the body
 
+        symbols_count = 0;
         DL_FOREACH(rule->rule_body, sym) {
             data[i++] = sym->val;       // rule id does not change
             data[i++] = sym->exp;
+            symbols_count++;
         }
+        data[count_pos] = symbols_count;
     }
 
     *serialized_integers = total_integers;
     return data;
 }
 
-void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank, int mpi_size) {
-    int grammar_ids[mpi_size];
-    int integers;
-    int *local_grammar = serialize_grammar(lg, &integers);
-
-    int recvcounts[mpi_size], displs[mpi_size];
-    PMPI_Gather(&integers, 1, MPI_INT, recvcounts, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-    displs[0] = 0;
-    size_t gathered_integers = recvcounts[0];
-    for(int i = 1; i < mpi_size;i++) {
-        gathered_integers += recvcounts[i];
-        displs[i] = displs[i-1] + recvcounts[i-1];
+static int varint_len(uint64_t v) {
+    int n = 1;
+    while(v >= 0x80) {
+        v >>= 7;
+        n++;
     }
+    return n;
+}
 
-    int *gathered_grammars = NULL;
-    if(mpi_rank == 0)
-        gathered_grammars = recorder_malloc(sizeof(int) * gathered_integers);
+/*
+ * Store a grammar from serialize_grammar() in the compact
+ * on-disk format, see recorder-varint.h
+ *
+ * | #rules |
+ * | rule id - previous rule id | #symbols | symbol 1, ..., symbol N |
+ * ...
+ *
+ * Each symbol is a single varint: (zigzag(val) << 1) | (exp != 1),
+ * followed by a varint exp only if the lowest bit is set.
+ * The previous rule id of the first rule is 0.
+ *
+ * @encoded_bytes: [out] the length of the returned buffer
+ * @return: return the buffer, need to be freed by the caller
+ */
+unsigned char* sequitur_encode_grammar(int *serialized_grammar, int *encoded_bytes) {
+    // First pass only computes the exact size
+    int *ptr = serialized_grammar;
+    int rules = *ptr++;
+    int prev_id = 0;
+    int bytes = varint_len(rules);
+    for(int i = 0; i < rules; i++) {
+        int rule_id = *ptr++;
+        int symbols = *ptr++;
+        bytes += varint_len(zigzag_encode((int64_t)rule_id - prev_id));
+        bytes += varint_len(symbols);
+        prev_id = rule_id;
+        for(int j = 0; j < symbols; j++, ptr += 2) {
+            uint64_t token = (zigzag_encode(ptr[0]) << 1) | (ptr[1] != 1);
+            bytes += varint_len(token);
+            if(ptr[1] != 1)
+                bytes += varint_len(ptr[1]);
+        }
+    }
 
-    PMPI_Gatherv(local_grammar, integers, MPI_INT, gathered_grammars, recvcounts, displs, MPI_INT, 0, MPI_COMM_WORLD);
-    recorder_free(local_grammar, sizeof(int)*integers);
+    unsigned char *buf = recorder_malloc(bytes);
+    unsigned char *out = buf;
+    ptr = serialized_grammar + 1;
+    prev_id = 0;
+    out += varint_put(out, rules);
+    for(int i = 0; i < rules; i++) {
+        int rule_id = *ptr++;
+        int symbols = *ptr++;
+        out += varint_put(out, zigzag_encode((int64_t)rule_id - prev_id));
+        out += varint_put(out, symbols);
+        prev_id = rule_id;
+        for(int j = 0; j < symbols; j++, ptr += 2) {
+            uint64_t token = (zigzag_encode(ptr[0]) << 1) | (ptr[1] != 1);
+            out += varint_put(out, token);
+            if(ptr[1] != 1)
+                out += varint_put(out, ptr[1]);
+        }
+    }
+    assert(out - buf == bytes);
 
-    if(mpi_rank !=0) return;
+    *encoded_bytes = bytes;
+    return buf;
+}
 
-    char ug_filename[1096] = {0};
-    sprintf(ug_filename, "%s/ug.cfg", path);
-    FILE* ug_file = fopen(ug_filename, "wb");
+/**
+ * Same as sequitur_update() but works on a
+ * grammar produced by serialize_grammar()
+ */
+void sequitur_update_serialized(int *serialized_grammar, int *update_terminal_id) {
+    int *ptr = serialized_grammar;
+    int rules = *ptr++;
+    for(int i = 0; i < rules; i++) {
+        ptr++;                      // rule head
+        int symbols = *ptr++;
+        for(int j = 0; j < symbols; j++, ptr += 2) {
+            if(ptr[0] >= 0)
+                ptr[0] = update_terminal_id[ptr[0]];
+        }
+    }
+}
 
-    // Go through each rank's grammar
+/**
+ * Collective call, detects unique grammars and writes them
+ * to ug.cfg, and the grammar id of every rank to ug.mt
+ *
+ * Grammars are compared by digest: every rank hashes its own
+ * encoded grammar and the digests are allgathered. The lowest rank
+ * of each unique grammar is its representative and is the only one
+ * writing the grammar out. Unique grammar ids follow the order
+ * of their representatives.
+ */
+void sequitur_save_unique_grammars(const char* path, int* local_grammar, int dict_rules, int mpi_rank, int mpi_size) {
+    MPI_Comm comm = recorder_internal_comm(MPI_COMM_WORLD);
+    int bytes;
+    unsigned char *encoded = sequitur_encode_grammar(local_grammar, &bytes);
+
+    GrammarDigest digest;
+    digest.hash  = recorder_hash64(encoded, bytes);
+    digest.check = recorder_hash32(encoded, bytes);
+    digest.bytes = bytes;
+
+    GrammarDigest *digests = recorder_malloc(sizeof(GrammarDigest) * mpi_size);
+    PMPI_Allgather(&digest, sizeof(GrammarDigest), MPI_BYTE,
+                   digests, sizeof(GrammarDigest), MPI_BYTE, comm);
+
+    UniqueGrammar *unique_grammars = NULL, *ug, *tmp;
+    int *grammar_ids = recorder_malloc(sizeof(int) * mpi_size);
+    int num_unique_grammars = 0;
     for(int rank = 0; rank < mpi_size; rank++) {
-
-        // Serialized grammar
-        int* g = gathered_grammars + displs[rank];
-        int g_len = recvcounts[rank] * sizeof(int);
-        //printf("rank: %d, grammar lengh: %d\n", rank, g_len);
-
-        UniqueGrammar *ug_entry = NULL;
-        HASH_FIND(hh, unique_grammars, g, g_len, ug_entry);
-
-        if(ug_entry) {
-            // A duplicated grammar, only need to store its id
-            ug_entry->count++;
-            grammar_ids[rank] = ug_entry->ugi;
-        } else {
-            ug_entry = recorder_malloc(sizeof(UniqueGrammar));
-            ug_entry->ugi = current_ugi++;
-            ug_entry->key = g;   // use the existing memory, do not copy it
-            HASH_ADD_KEYPTR(hh, unique_grammars, ug_entry->key, g_len, ug_entry);
-            grammar_ids[rank] = ug_entry->ugi;
-            recorder_write_zlib((unsigned char*)g, g_len, ug_file);
+        HASH_FIND(hh, unique_grammars, &digests[rank], sizeof(GrammarDigest), ug);
+        if(ug == NULL) {
+            ug = recorder_malloc(sizeof(UniqueGrammar));
+            ug->digest = digests[rank];
+            ug->ugi  = num_unique_grammars++;
+            ug->rank = rank;
+            HASH_ADD(hh, unique_grammars, digest, sizeof(GrammarDigest), ug);
         }
+        grammar_ids[rank] = ug->ugi;
     }
-    fclose(ug_file);
 
-    // Clean up the hash table, and gathered grammars
-    int num_unique_grammars = HASH_COUNT(unique_grammars);
+    HASH_FIND(hh, unique_grammars, &digest, sizeof(GrammarDigest), ug);
+    bool representative = (ug->rank == mpi_rank);
 
-    UniqueGrammar *ug, *tmp;
     HASH_ITER(hh, unique_grammars, ug, tmp) {
         HASH_DEL(unique_grammars, ug);
         recorder_free(ug, sizeof(UniqueGrammar));
     }
+    recorder_free(digests, sizeof(GrammarDigest) * mpi_size);
+
+    // Representatives compress their grammar and all write
+    // to ug.cfg in parallel, indexed by unique grammar id
+    char ug_filename[1096] = {0};
+    sprintf(ug_filename, "%s/ug.cfg", path);
+    size_t block_size = 0;
+    unsigned char *block = NULL;
+    if(representative) {
+        block = recorder_compress_block(encoded, bytes, &block_size, RECORDER_STREAM_CFG);
+        if(block == NULL)
+            RECORDER_LOGERR("[Recorder] rank %d: out of memory, grammar %d is lost\n", mpi_rank, grammar_ids[mpi_rank]);
+    }
+    recorder_write_indexed_blocks(ug_filename, block, block_size,
+                                  block ? grammar_ids[mpi_rank] : -1,
+                                  num_unique_grammars, comm);
+    free(block);
+    recorder_free(encoded, bytes);
+
+    if(mpi_rank != 0) {
+        recorder_free(grammar_ids, sizeof(int) * mpi_size);
+        return;
+    }
 
     char ug_metadata_fname[1096] = {0};
     sprintf(ug_metadata_fname, "%s/ug.mt", path);
     FILE* f = fopen(ug_metadata_fname, "wb");
     fwrite(grammar_ids, sizeof(int), mpi_size, f);
     fwrite(&num_unique_grammars, sizeof(int), 1, f);
+    fwrite(&dict_rules, sizeof(int), 1, f);       // rules in ug.dict, 0 if none
     fflush(f);
     fclose(f);
+    recorder_free(grammar_ids, sizeof(int) * mpi_size);
 
     RECORDER_LOGINFO("[Recorder] unique grammars: %d\n", num_unique_grammars);
 }
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) by Argonne National Laboratory
+ *     See COPYRIGHT in top-level directory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include "recorder-sequitur.h"
+#include "recorder-utils.h"
+
+
+/**
+ * Offline re-compression of a serialized grammar
+ *
+ * Online Sequitur only checks the rule utility of the first symbol
+ * of a just-created rule, so the final grammar may still contain
+ * rules that do not pay off. This pass works on the output of
+ * serialize_grammar() and
+ *
+ *  1. inlines rules that are referenced only once (with exp 1),
+ *  2. inlines rules whose body is a single symbol, i.e., R -> x^k,
+ *     by turning R^e into x^(k*e),
+ *  3. merges adjacent twins created by the inlining: a^i a^j -> a^(i+j),
+ *  4. renumbers the remaining rules in the order of their first use,
+ *     starting from the main rule (-1).
+ *
+ * The last step makes the rule ids canonical, so two ranks with the
+ * same grammar end up with byte-identical serialized streams.
+ */
+
+typedef struct SerializedRule_t {
+    int id;                 // key, rule id in the input grammar
+    int symbols;
+    int *body;              // points into the input grammar, val and exp pairs
+    int ref;                // number of references, ignoring exponents
+    int ref_exp;            // exponent of the last reference
+    int new_id;             // canonical id, 0 if not used in the output yet
+    UT_hash_handle hh;
+} SerializedRule;
+
+typedef struct MinimizeContext_t {
+    SerializedRule* rules;
+    SerializedRule** queue; // rules kept in the output, in canonical order
+    int queued;
+    int next_id;
+
+    int *out;               // output integers
+    int out_len;
+    int out_cap;
+    int body_start;         // position of the first symbol of the rule being emitted
+} MinimizeContext;
+
+
+static void out_push(MinimizeContext *ctx, int val) {
+    if(ctx->out_len == ctx->out_cap) {
+        int *tmp = recorder_malloc(sizeof(int) * ctx->out_cap * 2);
+        memcpy(tmp, ctx->out, sizeof(int) * ctx->out_len);
+        recorder_free(ctx->out, sizeof(int) * ctx->out_cap);
+        ctx->out = tmp;
+        ctx->out_cap *= 2;
+    }
+    ctx->out[ctx->out_len++] = val;
+}
+
+// Append a symbol to the rule body being emitted, merging twins
+static void push_symbol(MinimizeContext *ctx, int val, int exp) {
+    int n = ctx->out_len - ctx->body_start;
+    if(n > 0) {
+        int *last = ctx->out + ctx->out_len - 2;
+        if(last[0] == val && (long)last[1] + exp <= INT_MAX) {
+            last[1] += exp;
+            return;
+        }
+    }
+    out_push(ctx, val);
+    out_push(ctx, exp);
+}
+
+static bool should_inline(SerializedRule *rule, int exp) {
+    if(rule->new_id != 0)           // already kept
+        return false;
+    if(rule->symbols == 1)
+        return ((long)rule->body[1] * exp) <= INT_MAX;
+    return (rule->ref == 1 && rule->ref_exp == 1 && exp == 1);
+}
+
+static void emit_symbol(MinimizeContext *ctx, int val, int exp) {
+    if(val >= 0) {
+        push_symbol(ctx, val, exp);
+        return;
+    }
+
+    SerializedRule *rule = NULL;
+    HASH_FIND_INT(ctx->rules, &val, rule);
+    assert(rule != NULL);
+
+    if(should_inline(rule, exp)) {
+        if(rule->symbols == 1) {
+            emit_symbol(ctx, rule->body[0], rule->body[1] * exp);
+        } else {
+            for(int i = 0; i < rule->symbols; i++)
+                emit_symbol(ctx, rule->body[2*i], rule->body[2*i+1]);
+        }
+        return;
+    }
+
+    if(rule->new_id == 0) {
+        rule->new_id = ctx->next_id--;
+        ctx->queue[ctx->queued++] = rule;
+    }
+    push_symbol(ctx, rule->new_id, exp);
+}
+
+int* sequitur_minimize_grammar(int *serialized_grammar, int serialized_integers, int *minimized_integers) {
+    MinimizeContext ctx = {0};
+
+    // 1. Parse the rules and count references
+    int *ptr = serialized_grammar;
+    int num_rules = *ptr++;
+    SerializedRule *rules = recorder_malloc(sizeof(SerializedRule) * num_rules);
+    for(int i = 0; i < num_rules; i++) {
+        SerializedRule *rule = &rules[i];
+        rule->id      = *ptr++;
+        rule->symbols = *ptr++;
+        rule->body    = ptr;
+        rule->ref     = 0;
+        rule->ref_exp = 0;
+        rule->new_id  = 0;
+        ptr += 2 * rule->symbols;
+        HASH_ADD_INT(ctx.rules, id, rule);
+    }
+    assert(ptr - serialized_grammar == serialized_integers);
+
+    for(int i = 0; i < num_rules; i++) {
+        for(int j = 0; j < rules[i].symbols; j++) {
+            int val = rules[i].body[2*j];
+            if(val >= 0) continue;
+            SerializedRule *rule = NULL;
+            HASH_FIND_INT(ctx.rules, &val, rule);
+            assert(rule != NULL);
+            rule->ref++;
+            rule->ref_exp = rules[i].body[2*j+1];
+        }
+    }
+
+    // 2. Emit kept rules in the order of their first use.
+    // The first rule is always the main rule.
+    ctx.queue   = recorder_malloc(sizeof(SerializedRule*) * num_rules);
+    ctx.out_cap = serialized_integers;
+    ctx.out     = recorder_malloc(sizeof(int) * ctx.out_cap);
+    ctx.next_id = -1;
+
+    rules[0].new_id = ctx.next_id--;
+    ctx.queue[ctx.queued++] = &rules[0];
+    out_push(&ctx, 0);                      // #rules, filled at the end
+
+    for(int i = 0; i < ctx.queued; i++) {
+        SerializedRule *rule = ctx.queue[i];
+        out_push(&ctx, rule->new_id);
+        out_push(&ctx, 0);                  // #symbols, filled below
+        int count_pos = ctx.out_len - 1;
+        ctx.body_start = ctx.out_len;
+        for(int j = 0; j < rule->symbols; j++)
+            emit_symbol(&ctx, rule->body[2*j], rule->body[2*j+1]);
+        ctx.out[count_pos] = (ctx.out_len - ctx.body_start) / 2;
+    }
+    ctx.out[0] = ctx.queued;
+
+    RECORDER_LOGDBG("[Recorder] grammar minimized, rules: %d -> %d, integers: %d -> %d\n",
+                    num_rules, ctx.queued, serialized_integers, ctx.out_len);
+
+    HASH_CLEAR(hh, ctx.rules);
+    recorder_free(ctx.queue, sizeof(SerializedRule*) * num_rules);
+    recorder_free(rules, sizeof(SerializedRule) * num_rules);
+
+    // Shrink to fit, so the caller can free it with the returned size
+    int *minimized = recorder_malloc(sizeof(int) * ctx.out_len);
+    memcpy(minimized, ctx.out, sizeof(int) * ctx.out_len);
+    recorder_free(ctx.out, sizeof(int) * ctx.out_cap);
+
+    *minimized_integers = ctx.out_len;
+    return minimized;
+}
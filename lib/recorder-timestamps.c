@@ -4,21 +4,392 @@
 #include <assert.h>
 #include "mpi.h"
 #include "recorder.h"
+#include "recorder-varint.h"
 
 void ts_get_filename(RecorderLogger *logger, char* ts_filename) {
     sprintf(ts_filename, "%s/%d.ts", logger->traces_dir, logger->rank);
 }
 
-void ts_write_out(RecorderLogger* logger) {
+static void ts_buffer_alloc(RecorderLogger* logger, TimestampBuffer* ts, size_t size, int stream) {
+    ts->buf = recorder_malloc(size);
+    ts->size = size;
+    ts->delta_len = 0;
+    ts->duration_len = 0;
+    ts->records = 0;
+    ts->stream = stream;
+    logger->ts_memory += size;
+}
+
+static void ts_buffer_free(RecorderLogger* logger, TimestampBuffer* ts) {
+    recorder_free(ts->buf, ts->size);
+    logger->ts_memory -= ts->size;
+    ts->buf = NULL;
+}
+
+static void ts_buffer_reset(TimestampBuffer* ts) {
+    ts->delta_len = 0;
+    ts->duration_len = 0;
+    ts->records = 0;
+}
+
+/*
+ * Append the data to the in-memory blocks, once they exceed
+ * ts_spill_limit bytes they are appended to the per-rank timestamp
+ * file. The file is only created then, so usually all timestamps
+ * are written once, straight to recorder.ts at finalize time.
+ * Before the traces directory exists (non-MPI programs create it
+ * only at finalize time) the blocks stay in memory.
+ */
+static void ts_write_blocks(RecorderLogger* logger) {
+    if (logger->ts_file == NULL) {
+        char ts_filename[1024];
+        ts_get_filename(logger, ts_filename);
+        logger->ts_file = GOTCHA_REAL_CALL(fopen)(ts_filename, "w+b");
+    }
+    GOTCHA_REAL_CALL(fwrite)(logger->ts_blocks, 1, logger->ts_blocks_len, logger->ts_file);
+    logger->ts_blocks_len = 0;
+}
+
+static void ts_store(RecorderLogger* logger, const void* data, size_t size) {
+    if (logger->ts_blocks_len + size > logger->ts_blocks_cap) {
+        size_t cap = logger->ts_blocks_cap * 2;
+        if (cap < logger->ts_blocks_len + size)
+            cap = logger->ts_blocks_len + size;
+        logger->ts_blocks = realloc(logger->ts_blocks, cap);
+        logger->ts_blocks_cap = cap;
+    }
+    memcpy(logger->ts_blocks + logger->ts_blocks_len, data, size);
+    logger->ts_blocks_len += size;
+
+    if (logger->ts_blocks_len >= logger->ts_spill_limit && logger->directory_created)
+        ts_write_blocks(logger);
+}
+
+/*
+ * Append one buffer to the rank's timestamps as one block:
+ * | int stream | int records | size_t delta_len | size_t duration_len | deltas | durations |
+ * With compression the block is wrapped into a compressed block
+ * (see recorder-codec.h). So a rank's timestamps are a sequence of
+ * blocks of all streams, in the order they were taken, followed by
+ * the directory of streams written by ts_spill_finalize().
+ * See read_timestamps() in the reader.
+ */
+static void ts_write_buffer(RecorderLogger* logger, TimestampBuffer* ts) {
+    size_t header_size = 2*sizeof(int) + 2*sizeof(size_t);
+    size_t size = header_size + ts->delta_len + ts->duration_len;
+    unsigned char* block = malloc(size);
+
+    unsigned char* ptr = block;
+    memcpy(ptr, &ts->stream, sizeof(int));                ptr += sizeof(int);
+    memcpy(ptr, &ts->records, sizeof(int));               ptr += sizeof(int);
+    memcpy(ptr, &ts->delta_len, sizeof(size_t));          ptr += sizeof(size_t);
+    memcpy(ptr, &ts->duration_len, sizeof(size_t));       ptr += sizeof(size_t);
+    memcpy(ptr, ts->buf, ts->delta_len);                  ptr += ts->delta_len;
+    memcpy(ptr, ts->buf + ts->size/2, ts->duration_len);
+
     if (logger->ts_compression) {
-        size_t buf_size = logger->ts_index * sizeof(uint32_t);
-        recorder_write_zlib((unsigned char*)logger->ts, buf_size, logger->ts_file);
+        size_t compressed_size;
+        unsigned char* compressed = recorder_compress_block(block, size, &compressed_size, RECORDER_STREAM_TS);
+        if (compressed)
+            ts_store(logger, compressed, compressed_size);
+        else
+            RECORDER_LOGERR("[Recorder] rank %d: out of memory, %d timestamps are lost\n", logger->rank, ts->records);
+        free(compressed);
     } else {
-        GOTCHA_REAL_CALL(fwrite)(logger->ts, logger->ts_index, sizeof(uint32_t), logger->ts_file);
+        ts_store(logger, block, size);
+    }
+    free(block);
+}
+
+static void* ts_spill_thread(void* arg) {
+    RecorderLogger* logger = arg;
+
+    pthread_mutex_lock(&logger->ts_spill_mutex);
+    while (true) {
+        while (!logger->ts_spilling && !logger->ts_spill_stop)
+            pthread_cond_wait(&logger->ts_spill_cond, &logger->ts_spill_mutex);
+        if (!logger->ts_spilling)
+            break;
+
+        // ts_spare is ours until ts_spilling is reset
+        pthread_mutex_unlock(&logger->ts_spill_mutex);
+        ts_write_buffer(logger, &logger->ts_spare);
+        pthread_mutex_lock(&logger->ts_spill_mutex);
+
+        logger->ts_spilling = false;
+        pthread_cond_broadcast(&logger->ts_spill_cond);
+    }
+    pthread_mutex_unlock(&logger->ts_spill_mutex);
+    return NULL;
+}
+
+// Wait until the spare buffer is no longer being written out
+static void ts_spill_wait(RecorderLogger* logger) {
+    if (!logger->ts_spill_running)
+        return;
+    pthread_mutex_lock(&logger->ts_spill_mutex);
+    while (logger->ts_spilling)
+        pthread_cond_wait(&logger->ts_spill_cond, &logger->ts_spill_mutex);
+    pthread_mutex_unlock(&logger->ts_spill_mutex);
+}
+
+void ts_spill(RecorderLogger* logger, TimestampStream* stream) {
+    TimestampBuffer* ts = &stream->ts;
+
+    if (!logger->ts_spill_thread) {
+        ts_write_buffer(logger, ts);
+        ts_buffer_reset(ts);
+        return;
+    }
+
+    if (logger->ts_spare.buf == NULL)
+        ts_buffer_alloc(logger, &logger->ts_spare, logger->ts_buffer_size, -1);
+    if (!logger->ts_spill_running) {
+        pthread_mutex_init(&logger->ts_spill_mutex, NULL);
+        pthread_cond_init(&logger->ts_spill_cond, NULL);
+        logger->ts_spill_stop = false;
+        logger->ts_spill_running = (pthread_create(&logger->ts_spill_tid, NULL, ts_spill_thread, logger) == 0);
+        if (!logger->ts_spill_running) {
+            RECORDER_LOGERR("[Recorder] can not create the timestamp spill thread, spill synchronously\n");
+            logger->ts_spill_thread = false;
+            ts_spill(logger, stream);
+            return;
+        }
+    }
+
+    // Only blocks if the previous buffer is still being written out
+    ts_spill_wait(logger);
+
+    // The spare buffer now belongs to the stream
+    pthread_mutex_lock(&logger->ts_spill_mutex);
+    TimestampBuffer full = *ts;
+    *ts = logger->ts_spare;
+    ts->stream = full.stream;
+    logger->ts_spare = full;
+    logger->ts_spilling = true;
+    pthread_cond_broadcast(&logger->ts_spill_cond);
+    pthread_mutex_unlock(&logger->ts_spill_mutex);
+
+    ts_buffer_reset(ts);
+}
+
+static TimestampStream* ts_get_stream(RecorderLogger* logger, pthread_t tid) {
+    TimestampStream* stream;
+    HASH_FIND(hh, logger->ts_streams, &tid, sizeof(pthread_t), stream);
+    if (stream == NULL) {
+        stream = recorder_malloc(sizeof(TimestampStream));
+        stream->tid = tid;
+        stream->id = logger->ts_num_streams++;
+        stream->prev_tstart = 0;
+        ts_buffer_alloc(logger, &stream->ts, logger->ts_buffer_size, stream->id);
+        HASH_ADD(hh, logger->ts_streams, tid, sizeof(pthread_t), stream);
     }
+    return stream;
+}
+
+void ts_append(RecorderLogger* logger, pthread_t tid, double tstart, double tend) {
+    TimestampStream* stream = ts_get_stream(logger, tid);
+    TimestampBuffer* ts = &stream->ts;
+    size_t half = ts->size / 2;
+
+    // Quantize absolute times, so rounding errors do not add up
+    int64_t tstart_tick = (int64_t)((tstart - logger->ts_origin) / logger->ts_resolution);
+    int64_t tend_tick   = (int64_t)((tend - logger->ts_origin) / logger->ts_resolution);
+    int64_t duration    = tend_tick - tstart_tick;
+
+    ts->delta_len += varint_put(ts->buf + ts->delta_len, zigzag_encode(tstart_tick - stream->prev_tstart));
+    ts->duration_len += varint_put(ts->buf + half + ts->duration_len, duration > 0 ? duration : 0);
+    ts->records++;
+    stream->prev_tstart = tstart_tick;
+
+    // Spill before the next record might not fit
+    if (ts->delta_len + VARINT_MAX_BYTES > half || ts->duration_len + VARINT_MAX_BYTES > half)
+        ts_spill(logger, stream);
 }
 
-void ts_merge_files(RecorderLogger* logger) {
+void ts_init(RecorderLogger* logger) {
+    // Both halves must hold at least one record
+    if (logger->ts_buffer_size < 4*VARINT_MAX_BYTES)
+        logger->ts_buffer_size = 4*VARINT_MAX_BYTES;
+    // start_ts may later be replaced by the one of rank 0,
+    // the timestamps stay relative to the local start
+    logger->ts_origin = logger->start_ts;
+    logger->ts_file = NULL;
+    logger->ts_blocks = NULL;
+    logger->ts_blocks_len = 0;
+    logger->ts_blocks_cap = 0;
+    logger->ts_streams = NULL;
+    logger->ts_num_streams = 0;
+    logger->ts_memory = 0;
+    logger->ts_spare.buf = NULL;
+    logger->ts_spilling = false;
+    logger->ts_spill_running = false;
+}
+
+/*
+ * Background flusher: write out everything recorded so far, including
+ * the partially filled buffers, to the per-rank file. Called with the
+ * logger locked, so no new spill can start while we wait for the
+ * running one.
+ */
+size_t ts_flush(RecorderLogger* logger) {
+    GOTCHA_SET_REAL_CALL(fflush, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(ftell, RECORDER_POSIX);
+
+    ts_spill_wait(logger);
+
+    TimestampStream *stream, *tmp;
+    HASH_ITER(hh, logger->ts_streams, stream, tmp) {
+        if (stream->ts.records > 0) {
+            ts_write_buffer(logger, &stream->ts);
+            ts_buffer_reset(&stream->ts);
+        }
+    }
+    if (logger->ts_blocks_len > 0)
+        ts_write_blocks(logger);
+    if (logger->ts_file == NULL)
+        return 0;
+    GOTCHA_REAL_CALL(fflush)(logger->ts_file);
+    return GOTCHA_REAL_CALL(ftell)(logger->ts_file);
+}
+
+/*
+ * After the last block comes the directory of the streams,
+ * the thread id of each stream in the order of their ids:
+ * | pthread_t tid of stream 0 | ... | int num_streams |
+ */
+void ts_spill_finalize(RecorderLogger* logger) {
+    if (logger->ts_spill_running) {
+        pthread_mutex_lock(&logger->ts_spill_mutex);
+        logger->ts_spill_stop = true;
+        pthread_cond_broadcast(&logger->ts_spill_cond);
+        pthread_mutex_unlock(&logger->ts_spill_mutex);
+        pthread_join(logger->ts_spill_tid, NULL);
+        pthread_mutex_destroy(&logger->ts_spill_mutex);
+        pthread_cond_destroy(&logger->ts_spill_cond);
+        logger->ts_spill_running = false;
+    }
+
+    // Streams are iterated in insertion, i.e., id order
+    TimestampStream *stream, *tmp;
+    HASH_ITER(hh, logger->ts_streams, stream, tmp) {
+        if (stream->ts.records > 0)
+            ts_write_buffer(logger, &stream->ts);
+    }
+    HASH_ITER(hh, logger->ts_streams, stream, tmp) {
+        ts_store(logger, &stream->tid, sizeof(pthread_t));
+        HASH_DEL(logger->ts_streams, stream);
+        ts_buffer_free(logger, &stream->ts);
+        recorder_free(stream, sizeof(TimestampStream));
+    }
+    ts_store(logger, &logger->ts_num_streams, sizeof(int));
+    if (logger->ts_file)
+        GOTCHA_REAL_CALL(fflush)(logger->ts_file);
+
+    if (logger->ts_spare.buf)
+        ts_buffer_free(logger, &logger->ts_spare);
+}
+
+/*
+ * Copy the rank's timestamps to dst: the blocks spilled to the
+ * per-rank file (file_size bytes, if any) followed by the ones
+ * still in memory, which are released
+ */
+static void ts_read_section(RecorderLogger* logger, void* dst, size_t file_size) {
+    if (file_size > 0) {
+        GOTCHA_REAL_CALL(fseek)(logger->ts_file, 0, SEEK_SET);
+        GOTCHA_REAL_CALL(fread)(dst, 1, file_size, logger->ts_file);
+    }
+    memcpy(dst + file_size, logger->ts_blocks, logger->ts_blocks_len);
+    free(logger->ts_blocks);
+    logger->ts_blocks = NULL;
+    logger->ts_blocks_len = 0;
+    logger->ts_blocks_cap = 0;
+}
+
+/*
+ * Two-level merge: the ranks of a node copy their timestamps into
+ * a shared-memory window, so the data of the whole node is one
+ * contiguous buffer, and only the node leaders write to recorder.ts.
+ * The ranks of a node need not be consecutive, so each leader
+ * describes where its ranks go in the file with derived types.
+ * A node may hold more than INT_MAX bytes, so the data type is a
+ * struct of one recorder_bytes_type() per rank, and the segment
+ * is written as a single element of another one.
+ * The window stays alive until ts_merge_files_end().
+ */
+static void ts_merge_files_two_level(RecorderLogger* logger, const char* merged_ts_filename,
+                                     MPI_Offset file_size, size_t spilled_size) {
+    int node_rank, node_size;
+    PMPI_Comm_rank(logger->node_comm, &node_rank);
+    PMPI_Comm_size(logger->node_comm, &node_size);
+
+    void* segment;
+    PMPI_Win_allocate_shared(file_size, 1, MPI_INFO_NULL, logger->node_comm, &segment, &logger->ts_merge_win);
+    ts_read_section(logger, segment, spilled_size);
+
+    MPI_Offset offset = 0;
+    PMPI_Exscan(&file_size, &offset, 1, MPI_OFFSET, MPI_SUM, recorder_internal_comm(MPI_COMM_WORLD));
+    if(logger->rank == 0) offset = 0;   // undefined on rank 0
+    offset += (logger->nprocs * sizeof(size_t));
+
+    // (world rank, offset, size) of every rank on the node
+    MPI_Offset layout[3] = {logger->rank, offset, file_size};
+    MPI_Offset* layouts = NULL;
+    if(node_rank == 0)
+        layouts = recorder_malloc(sizeof(layout) * node_size);
+    PMPI_Gather(layout, 3, MPI_OFFSET, layouts, 3, MPI_OFFSET, 0, logger->node_comm);
+    PMPI_Win_fence(0, logger->ts_merge_win);
+
+    if(node_rank == 0) {
+        int* lens = recorder_malloc(sizeof(int) * node_size);
+        MPI_Aint* displs = recorder_malloc(sizeof(MPI_Aint) * node_size);
+        MPI_Datatype* types = recorder_malloc(sizeof(MPI_Datatype) * node_size);
+        size_t* sizes = recorder_malloc(sizeof(size_t) * node_size);
+        MPI_Datatype header_type, data_type, segment_type;
+        size_t node_bytes = 0;
+
+        for(int m = 0; m < node_size; m++) {
+            sizes[m]  = layouts[3*m+2];
+            lens[m]   = sizeof(size_t);
+            displs[m] = layouts[3*m] * sizeof(size_t);
+        }
+        PMPI_Type_create_hindexed(node_size, lens, displs, MPI_BYTE, &header_type);
+        PMPI_Type_commit(&header_type);
+
+        for(int m = 0; m < node_size; m++) {
+            lens[m]   = 1;
+            displs[m] = (MPI_Aint) layouts[3*m+1];
+            types[m]  = recorder_bytes_type(layouts[3*m+2]);
+            node_bytes += layouts[3*m+2];
+        }
+        PMPI_Type_create_struct(node_size, lens, displs, types, &data_type);
+        PMPI_Type_commit(&data_type);
+        for(int m = 0; m < node_size; m++)
+            PMPI_Type_free(&types[m]);
+        segment_type = recorder_bytes_type(node_bytes);
+
+        // Segments are contiguous, starting with the leader's
+        MPI_File* fh = &logger->ts_merge_fh;
+        GOTCHA_REAL_CALL(MPI_File_open)(logger->leader_comm, merged_ts_filename, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, fh);
+        PMPI_File_set_view(*fh, 0, MPI_BYTE, header_type, "native", MPI_INFO_NULL);
+        GOTCHA_REAL_CALL(MPI_File_write_at_all)(*fh, 0, sizes, node_size*sizeof(size_t), MPI_BYTE, MPI_STATUS_IGNORE);
+        PMPI_File_set_view(*fh, 0, MPI_BYTE, data_type, "native", MPI_INFO_NULL);
+        PMPI_File_iwrite_at_all(*fh, 0, segment, 1, segment_type, &logger->ts_merge_request);
+
+        // freed once the write completes
+        PMPI_Type_free(&header_type);
+        PMPI_Type_free(&data_type);
+        PMPI_Type_free(&segment_type);
+        recorder_free(sizes, sizeof(size_t) * node_size);
+        recorder_free(types, sizeof(MPI_Datatype) * node_size);
+        recorder_free(displs, sizeof(MPI_Aint) * node_size);
+        recorder_free(lens, sizeof(int) * node_size);
+        recorder_free(layouts, sizeof(layout) * node_size);
+    }
+}
+
+void ts_merge_files_begin(RecorderLogger* logger) {
     GOTCHA_SET_REAL_CALL(fread, RECORDER_POSIX);
     GOTCHA_SET_REAL_CALL(fwrite, RECORDER_POSIX);
     GOTCHA_SET_REAL_CALL(fseek, RECORDER_POSIX);
@@ -30,43 +401,76 @@ void ts_merge_files(RecorderLogger* logger) {
     GOTCHA_SET_REAL_CALL(MPI_File_close, RECORDER_MPIIO);
     GOTCHA_SET_REAL_CALL(MPI_File_sync, RECORDER_MPIIO);
 
+    // The rank's section of recorder.ts: the blocks spilled
+    // to the per-rank file, if any, and the ones in memory
     MPI_Offset file_size = 0, offset = 0;
-    size_t file_size_t;
+    size_t file_size_t, spilled_size = 0;
     void* in;
-    GOTCHA_REAL_CALL(fseek)(logger->ts_file, 0, SEEK_END);
-    file_size = (MPI_Offset) GOTCHA_REAL_CALL(ftell)(logger->ts_file);
-    file_size_t = (size_t) file_size;
-    in = malloc(file_size_t);
-    GOTCHA_REAL_CALL(fseek)(logger->ts_file, 0, SEEK_SET);
-    GOTCHA_REAL_CALL(fread)(in, 1, file_size_t, logger->ts_file);
+    if (logger->ts_file) {
+        GOTCHA_REAL_CALL(fseek)(logger->ts_file, 0, SEEK_END);
+        spilled_size = GOTCHA_REAL_CALL(ftell)(logger->ts_file);
+    }
+    file_size_t = spilled_size + logger->ts_blocks_len;
+    file_size = (MPI_Offset) file_size_t;
 
     char merged_ts_filename[1024];
     sprintf(merged_ts_filename, "%s/recorder.ts", logger->traces_dir);
 
+    if (logger->node_comm != MPI_COMM_NULL) {
+        ts_merge_files_two_level(logger, merged_ts_filename, file_size, spilled_size);
+        return;
+    }
+
+    // Nothing spilled, the in-memory blocks are written as they are
+    if (spilled_size == 0) {
+        in = logger->ts_blocks;
+        logger->ts_blocks = NULL;
+        logger->ts_blocks_len = 0;
+        logger->ts_blocks_cap = 0;
+    } else {
+        in = malloc(file_size_t);
+        ts_read_section(logger, in, spilled_size);
+    }
+
     int mpi_initialized;
     PMPI_Initialized(&mpi_initialized);
     if (!mpi_initialized) {
         // Non-MPI programs, we use fwrite to write to "recorder.ts" file
-        // TODO: we can simply rename 0.ts to recorder.ts instead of read
-        // and write
         FILE* merged_file = GOTCHA_REAL_CALL(fopen)(merged_ts_filename, "wb");
         GOTCHA_REAL_CALL(fwrite)(&file_size_t, sizeof(size_t), 1, merged_file);
         GOTCHA_REAL_CALL(fwrite)(in, 1, file_size_t, merged_file);
         GOTCHA_REAL_CALL(fclose)(merged_file);
+        free(in);
     } else {
         // For MPI programs, we use MPI-IO to collectively write to 
         // the recorder.ts file
-        MPI_File fh;
-        GOTCHA_REAL_CALL(MPI_File_open)(MPI_COMM_WORLD, merged_ts_filename, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+        MPI_File* fh = &logger->ts_merge_fh;
+        MPI_Comm comm = recorder_internal_comm(MPI_COMM_WORLD);
+        GOTCHA_REAL_CALL(MPI_File_open)(comm, merged_ts_filename, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, fh);
         // first write out the compressed file size of each rank
-        GOTCHA_REAL_CALL(MPI_File_write_at_all)(fh, logger->rank*sizeof(size_t), &file_size_t, sizeof(size_t), MPI_BYTE, MPI_STATUS_IGNORE);
+        GOTCHA_REAL_CALL(MPI_File_write_at_all)(*fh, logger->rank*sizeof(size_t), &file_size_t, sizeof(size_t), MPI_BYTE, MPI_STATUS_IGNORE);
         // then write the acutal content of each rank
         // we don't intercept MPI_Exscan
-        MPI_Exscan(&file_size, &offset, 1, MPI_OFFSET, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Exscan(&file_size, &offset, 1, MPI_OFFSET, MPI_SUM, comm);
         offset += (logger->nprocs * sizeof(size_t));
-        GOTCHA_REAL_CALL(MPI_File_write_at_all)(fh, offset, in, file_size, MPI_BYTE, MPI_STATUS_IGNORE);
-        GOTCHA_REAL_CALL(MPI_File_sync)(fh);
-        GOTCHA_REAL_CALL(MPI_File_close)(&fh);
+        MPI_Datatype section_type = recorder_bytes_type(file_size_t);
+        PMPI_File_iwrite_at_all(*fh, offset, in, 1, section_type, &logger->ts_merge_request);
+        PMPI_Type_free(&section_type);
+        logger->ts_merge_buf = in;
+    }
+}
+
+void ts_merge_files_end(RecorderLogger* logger) {
+    if (logger->ts_merge_request != MPI_REQUEST_NULL) {
+        PMPI_Wait(&logger->ts_merge_request, MPI_STATUS_IGNORE);
+        GOTCHA_REAL_CALL(MPI_File_sync)(logger->ts_merge_fh);
+        GOTCHA_REAL_CALL(MPI_File_close)(&logger->ts_merge_fh);
+    }
+    if (logger->ts_merge_win != MPI_WIN_NULL) {
+        // the leader may still be reading other ranks' segments
+        PMPI_Win_fence(0, logger->ts_merge_win);
+        PMPI_Win_free(&logger->ts_merge_win);
     }
-    free(in);
+    free(logger->ts_merge_buf);
+    logger->ts_merge_buf = NULL;
 }
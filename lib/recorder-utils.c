@@ -8,7 +8,14 @@
 #include <errno.h>
 #include <math.h>
 #include <zlib.h>
+#ifdef RECORDER_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef RECORDER_ENABLE_LZ4
+#include <lz4.h>
+#endif
 #include "recorder.h"
+#include "recorder-codec.h"
 
 #define MPI_CHUNK_SIZE (1*1024*1024*1024)
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -18,6 +25,10 @@
 static bool   log_pointer = false;
 static size_t memory_usage = 0;
 static int    debug_level = 2;  // 1:ERR, 2:INFO, 3:DBG
+static int    codecs[RECORDER_NUM_STREAMS];     // compression codec of each stream
+static int    compression_threads = 1;
+
+static void free_internal_comms();
 
 
 char** inclusion_prefix;
@@ -119,10 +130,28 @@ void utils_init() {
     const char *debug_level_str = getenv(RECORDER_DEBUG_LEVEL);
     if(debug_level_str)
         debug_level = atoi(debug_level_str);
+
+    const char* codec_envs[RECORDER_NUM_STREAMS] = {RECORDER_CST_CODEC, RECORDER_CFG_CODEC, RECORDER_TIME_CODEC};
+    for(int stream = 0; stream < RECORDER_NUM_STREAMS; stream++) {
+        codecs[stream] = RECORDER_CODEC_ZLIB;
+        const char* codec_str = getenv(codec_envs[stream]);
+        if(!codec_str)
+            continue;
+        int codec = recorder_codec_by_name(codec_str);
+        if(codec >= 0 && recorder_codec_available(codec))
+            codecs[stream] = codec;
+        else
+            RECORDER_LOGERR("[Recorder] %s=%s is not supported by this build, use zlib\n", codec_envs[stream], codec_str);
+    }
+
+    const char* compression_threads_str = getenv(RECORDER_COMPRESSION_THREADS);
+    if(compression_threads_str && atoi(compression_threads_str) > 0)
+        compression_threads = atoi(compression_threads_str);
 }
 
 
 void utils_finalize() {
+    free_internal_comms();
     if(inclusion_prefix) {
         for (int i = 0; inclusion_prefix[i] != NULL; i++)
             free(inclusion_prefix[i]);
@@ -140,18 +169,41 @@ void* recorder_malloc(size_t size) {
     if(size == 0)
         return NULL;
 
-    memory_usage += size;
+    // also called by the flusher and compression threads
+    __atomic_fetch_add(&memory_usage, size, __ATOMIC_RELAXED);
     return malloc(size);
 }
 void recorder_free(void* ptr, size_t size) {
     if(size == 0 || ptr == NULL)
         return;
-    memory_usage -= size;
+    __atomic_fetch_sub(&memory_usage, size, __ATOMIC_RELAXED);
 
     free(ptr);
     ptr = NULL;
 }
 
+inline size_t recorder_memory_usage() {
+    return __atomic_load_n(&memory_usage, __ATOMIC_RELAXED);
+}
+
+uint64_t recorder_hash64(const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint32_t recorder_hash32(const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    uint32_t h = 5381;
+    for(size_t i = 0; i < len; i++)
+        h = h * 33 + p[i];
+    return h;
+}
+
 /*
  * Some of functions are not made by the application
  * And they are operating on many strange-name files
@@ -209,9 +261,69 @@ inline double recorder_wtime(void) {
   //return PMPI_Wtime();
 }
 
+/*
+ * Private duplicates of the user communicators for our own
+ * traffic, so it never matches the application's messages.
+ * The duplicate of MPI_COMM_WORLD is created at init, the others
+ * on first use; they are cached until the user communicator is
+ * freed, see MPI_Comm_free() in recorder-mpi.c
+ */
+typedef struct InternalComm_t {
+    MPI_Comm key;           // user communicator
+    MPI_Comm comm;          // our duplicate
+    UT_hash_handle hh;
+} InternalComm;
+
+static MPI_Comm      internal_world = MPI_COMM_NULL;
+static InternalComm* internal_comms = NULL;
+
+void recorder_init_internal_comms() {
+    GOTCHA_SET_REAL_CALL(MPI_Comm_dup, RECORDER_MPI);
+    if(internal_world == MPI_COMM_NULL)
+        GOTCHA_REAL_CALL(MPI_Comm_dup)(MPI_COMM_WORLD, &internal_world);
+}
+
+MPI_Comm recorder_internal_comm(MPI_Comm comm) {
+    if(comm == MPI_COMM_WORLD && internal_world != MPI_COMM_NULL)
+        return internal_world;
+
+    InternalComm *entry = NULL;
+    HASH_FIND(hh, internal_comms, &comm, sizeof(MPI_Comm), entry);
+    if(entry == NULL) {
+        GOTCHA_SET_REAL_CALL(MPI_Comm_dup, RECORDER_MPI);
+        entry = malloc(sizeof(InternalComm));
+        entry->key = comm;
+        GOTCHA_REAL_CALL(MPI_Comm_dup)(comm, &entry->comm);
+        HASH_ADD(hh, internal_comms, key, sizeof(MPI_Comm), entry);
+    }
+    return entry->comm;
+}
+
+void recorder_free_internal_comm(MPI_Comm comm) {
+    InternalComm *entry = NULL;
+    HASH_FIND(hh, internal_comms, &comm, sizeof(MPI_Comm), entry);
+    if(entry) {
+        GOTCHA_SET_REAL_CALL(MPI_Comm_free, RECORDER_MPI);
+        HASH_DEL(internal_comms, entry);
+        GOTCHA_REAL_CALL(MPI_Comm_free)(&entry->comm);
+        free(entry);
+    }
+}
+
+static void free_internal_comms() {
+    InternalComm *entry, *tmp;
+    HASH_ITER(hh, internal_comms, entry, tmp) {
+        recorder_free_internal_comm(entry->key);
+    }
+    if(internal_world != MPI_COMM_NULL) {
+        GOTCHA_SET_REAL_CALL(MPI_Comm_free, RECORDER_MPI);
+        GOTCHA_REAL_CALL(MPI_Comm_free)(&internal_world);
+    }
+}
+
 /* 
  * Our own bcast call during the tracing process
- * it creates a tmp comm to perform the bcast
+ * it runs on our private duplicate of the communicator,
  * this avoids interfering with applicaiton's
  * bcast calls on the same communicator.
  *
@@ -221,23 +333,18 @@ inline double recorder_wtime(void) {
  * calls to avoid overflow error.
  */
 void recorder_bcast(void *buf, size_t count, int root, MPI_Comm comm) {
-    GOTCHA_SET_REAL_CALL(MPI_Comm_dup, RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Bcast, RECORDER_MPI);
-    GOTCHA_SET_REAL_CALL(MPI_Comm_free, RECORDER_MPI);
 
-    MPI_Comm tmp_comm;
-    GOTCHA_REAL_CALL(MPI_Comm_dup)(comm, &tmp_comm);
+    MPI_Comm internal_comm = recorder_internal_comm(comm);
 
     size_t remain = count;
     void* buf_ptr = buf;
     do {
         int bcast_count = (int) MIN(remain, MPI_CHUNK_SIZE);
-        GOTCHA_REAL_CALL(MPI_Bcast)(buf_ptr, bcast_count, MPI_BYTE, root, tmp_comm);
+        GOTCHA_REAL_CALL(MPI_Bcast)(buf_ptr, bcast_count, MPI_BYTE, root, internal_comm);
         remain  -= bcast_count;
         buf_ptr += bcast_count;
     } while(remain > 0);
-
-    GOTCHA_REAL_CALL(MPI_Comm_free)(&tmp_comm);
 }
 
 void recorder_send(void *buf, size_t count, int dst, int tag, MPI_Comm comm) {
@@ -265,14 +372,27 @@ void recorder_recv(void *buf, size_t count, int src, int tag, MPI_Comm comm) {
 }
 
 void recorder_barrier(MPI_Comm comm) {
-    GOTCHA_SET_REAL_CALL(MPI_Comm_dup, RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Barrier, RECORDER_MPI);
-    GOTCHA_SET_REAL_CALL(MPI_Comm_free, RECORDER_MPI);
+    GOTCHA_REAL_CALL(MPI_Barrier)(recorder_internal_comm(comm));
+}
 
-    MPI_Comm tmp_comm;
-    GOTCHA_REAL_CALL(MPI_Comm_dup)(comm, &tmp_comm);
-    GOTCHA_REAL_CALL(MPI_Barrier)(tmp_comm);
-    GOTCHA_REAL_CALL(MPI_Comm_free)(&tmp_comm);
+/*
+ * A committed datatype of count contiguous bytes, so that
+ * more than INT_MAX bytes can be transferred with a count
+ * of 1: MPI_CHUNK_SIZE sized chunks followed by the rest.
+ * Caller needs to free it with PMPI_Type_free().
+ */
+MPI_Datatype recorder_bytes_type(size_t count) {
+    MPI_Datatype chunk_type, type;
+    PMPI_Type_contiguous(MPI_CHUNK_SIZE, MPI_BYTE, &chunk_type);
+
+    int          lens[2]   = {(int)(count / MPI_CHUNK_SIZE), (int)(count % MPI_CHUNK_SIZE)};
+    MPI_Aint     displs[2] = {0, (MPI_Aint)(count / MPI_CHUNK_SIZE) * MPI_CHUNK_SIZE};
+    MPI_Datatype types[2]  = {chunk_type, MPI_BYTE};
+    PMPI_Type_create_struct(2, lens, displs, types, &type);
+    PMPI_Type_commit(&type);
+    PMPI_Type_free(&chunk_type);
+    return type;
 }
 
 /* Integer to stirng */
@@ -437,63 +557,300 @@ inline int recorder_debug_level() {
     return debug_level;
 }
 
-void recorder_write_zlib(unsigned char* buf, size_t buf_size, FILE* out_file) {
+static size_t codec_bound(int codec, size_t size) {
+    switch (codec) {
+#ifdef RECORDER_ENABLE_ZSTD
+        case RECORDER_CODEC_ZSTD:
+            return ZSTD_compressBound(size);
+#endif
+#ifdef RECORDER_ENABLE_LZ4
+        case RECORDER_CODEC_LZ4:
+            return LZ4_compressBound(size);
+#endif
+        case RECORDER_CODEC_STORED:
+            return size;
+        default:
+            return compressBound(size);
+    }
+}
+
+/*
+ * Compress one chunk into out (at least codec_bound() bytes),
+ * return the compressed size, 0 on failure
+ */
+static size_t compress_chunk(int codec, unsigned char* in, size_t in_size, unsigned char* out, size_t out_capacity) {
+    switch (codec) {
+        case RECORDER_CODEC_STORED:
+            memcpy(out, in, in_size);
+            return in_size;
+#ifdef RECORDER_ENABLE_ZSTD
+        case RECORDER_CODEC_ZSTD: {
+            size_t ret = ZSTD_compress(out, out_capacity, in, in_size, 1);
+            return ZSTD_isError(ret) ? 0 : ret;
+        }
+#endif
+#ifdef RECORDER_ENABLE_LZ4
+        case RECORDER_CODEC_LZ4: {
+            int ret = LZ4_compress_default((const char*)in, (char*)out, in_size, out_capacity);
+            return ret > 0 ? ret : 0;
+        }
+#endif
+        default: {
+            uLongf len = out_capacity;
+            return compress2(out, &len, in, in_size, Z_DEFAULT_COMPRESSION) == Z_OK ? len : 0;
+        }
+    }
+}
+
+/*
+ * Chunks [first, first+count) of buf, compressed by up to
+ * compression_threads threads, each taking the next chunk
+ */
+typedef struct CompressJob_t {
+    int             codec;
+    unsigned char*  buf;
+    size_t          buf_size;
+    int             next;
+    int             end;
+    unsigned char** chunks;         // compressed chunks, indexed by chunk
+    size_t*         chunk_sizes;
+    bool            ok;
+    pthread_mutex_t mutex;
+} CompressJob;
+
+static void* compress_worker(void* arg) {
+    CompressJob* job = arg;
+    while (true) {
+        pthread_mutex_lock(&job->mutex);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+        if (i >= job->end)
+            break;
+
+        size_t offset = (size_t)i * RECORDER_COMPRESSION_CHUNK;
+        size_t size = MIN(RECORDER_COMPRESSION_CHUNK, job->buf_size - offset);
+        size_t capacity = codec_bound(job->codec, size);
+        job->chunks[i] = malloc(capacity > 0 ? capacity : 1);
+        if (job->chunks[i] != NULL)
+            job->chunk_sizes[i] = compress_chunk(job->codec, job->buf + offset, size, job->chunks[i], capacity);
+        // an empty chunk is only 0 bytes when stored
+        if (job->chunks[i] == NULL || (job->chunk_sizes[i] == 0 && size > 0))
+            job->ok = false;        // only ever set to false, no lock needed
+    }
+    return NULL;
+}
+
+static bool compress_chunks(CompressJob* job, int first, int count) {
+    job->next = first;
+    job->end  = first + count;
+    job->ok   = true;
+
+    int num_threads = MIN(compression_threads, count) - 1;
+    pthread_t threads[num_threads > 0 ? num_threads : 1];
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, compress_worker, job) != 0)
+            break;
+    }
+    compress_worker(job);       // the calling thread helps
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    if (!job->ok)
+        RECORDER_LOGERR("[Recorder] fatal error: %s compression failed.\n", recorder_codec_names[job->codec]);
+    return job->ok;
+}
+
+static void write_block_header(unsigned char* header, CompressJob* job, int num_chunks) {
+    size_t compressed_size = 0;
+    for (int i = 0; i < num_chunks; i++)
+        compressed_size += job->chunk_sizes[i];
+
+    size_t chunk_size = RECORDER_COMPRESSION_CHUNK;
+    memcpy(header, &compressed_size, sizeof(size_t));           header += sizeof(size_t);
+    memcpy(header, &job->buf_size, sizeof(size_t));             header += sizeof(size_t);
+    memcpy(header, &job->codec, sizeof(int));                   header += sizeof(int);
+    memcpy(header, &num_chunks, sizeof(int));                   header += sizeof(int);
+    memcpy(header, &chunk_size, sizeof(size_t));                header += sizeof(size_t);
+    memcpy(header, job->chunk_sizes, sizeof(size_t)*num_chunks);
+}
+
+static int init_compress_job(CompressJob* job, unsigned char* buf, size_t buf_size, int stream) {
+    int num_chunks = (buf_size + RECORDER_COMPRESSION_CHUNK - 1) / RECORDER_COMPRESSION_CHUNK;
+    if (num_chunks == 0)
+        num_chunks = 1;             // an empty chunk for an empty input
+    job->codec       = codecs[stream];
+    job->buf         = buf;
+    job->buf_size    = buf_size;
+    job->chunks      = calloc(num_chunks, sizeof(unsigned char*));
+    job->chunk_sizes = calloc(num_chunks, sizeof(size_t));
+    pthread_mutex_init(&job->mutex, NULL);
+    return num_chunks;
+}
+
+static void free_compress_job(CompressJob* job, int num_chunks) {
+    for (int i = 0; i < num_chunks; i++)
+        free(job->chunks[i]);
+    free(job->chunks);
+    free(job->chunk_sizes);
+    pthread_mutex_destroy(&job->mutex);
+}
+
+// After a compression failure, keep the data rather than lose it
+static void store_uncompressed(CompressJob* job, int num_chunks) {
+    RECORDER_LOGERR("[Recorder] store the block uncompressed\n");
+    for (int i = 0; i < num_chunks; i++) {
+        free(job->chunks[i]);
+        job->chunks[i] = NULL;
+        job->chunk_sizes[i] = 0;
+    }
+    job->codec = RECORDER_CODEC_STORED;
+}
+
+unsigned char* recorder_compress_block(unsigned char* buf, size_t buf_size, size_t* block_size, int stream) {
+    CompressJob job;
+    int num_chunks = init_compress_job(&job, buf, buf_size, stream);
+    if (!compress_chunks(&job, 0, num_chunks)) {
+        store_uncompressed(&job, num_chunks);
+        if (!compress_chunks(&job, 0, num_chunks)) {
+            free_compress_job(&job, num_chunks);
+            return NULL;
+        }
+    }
+
+    size_t meta_size = recorder_block_meta_size(num_chunks);
+    *block_size = meta_size;
+    for (int i = 0; i < num_chunks; i++)
+        *block_size += job.chunk_sizes[i];
+
+    unsigned char* block = malloc(*block_size);
+    if (block == NULL) {
+        free_compress_job(&job, num_chunks);
+        return NULL;
+    }
+    write_block_header(block, &job, num_chunks);
+    unsigned char* ptr = block + meta_size;
+    for (int i = 0; i < num_chunks; i++) {
+        memcpy(ptr, job.chunks[i], job.chunk_sizes[i]);
+        ptr += job.chunk_sizes[i];
+    }
+
+    free_compress_job(&job, num_chunks);
+    return block;
+}
+
+/*
+ * Unlike recorder_compress_block(), the chunks are written out in
+ * rounds of compression_threads chunks, so at most that many
+ * compressed chunks are in memory. The header with the chunk sizes
+ * is filled in at the end. If compression fails, the block is
+ * written again with the chunks stored as they are. If a write
+ * fails, the file is truncated back to the start of the block
+ * rather than left with a header that does not match the chunks.
+ */
+bool recorder_write_block(unsigned char* buf, size_t buf_size, FILE* out_file, int stream) {
     GOTCHA_SET_REAL_CALL(fwrite, RECORDER_POSIX);
     GOTCHA_SET_REAL_CALL(fseek, RECORDER_POSIX);
     GOTCHA_SET_REAL_CALL(ftell, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fflush, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(fileno, RECORDER_POSIX);
+    GOTCHA_SET_REAL_CALL(ftruncate, RECORDER_POSIX);
+
+    CompressJob job;
+    int num_chunks = init_compress_job(&job, buf, buf_size, stream);
+    size_t meta_size = recorder_block_meta_size(num_chunks);
+    unsigned char* header = calloc(1, meta_size);
 
-    // Always write two size_t (compressed_size and decopmressed_size)
-    // before writting the the compressed data.
-    // This allows easier post-processing.
     long off = GOTCHA_REAL_CALL(ftell)(out_file);
-    size_t compressed_size   = 0;
-    size_t decompressed_size = buf_size;
-    GOTCHA_REAL_CALL(fwrite)(&compressed_size, sizeof(size_t), 1, out_file);
-    GOTCHA_REAL_CALL(fwrite)(&decompressed_size, sizeof(size_t), 1, out_file);
-
-    int ret;
-    unsigned have;
-    z_stream strm;
-
-    unsigned char out[buf_size];
-
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree  = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
-    // ret = deflateInit(&strm, Z_BEST_COMPRESSION);
-    if (ret != Z_OK) {
-        RECORDER_LOGERR("[Recorder] fatal error: can't initialize zlib.");
-        return;
+    bool ok, compressed;
+    while (true) {
+        ok = GOTCHA_REAL_CALL(fwrite)(header, 1, meta_size, out_file) == meta_size;
+        compressed = true;      // compress_chunks() reports its own failure
+
+        for (int first = 0; ok && first < num_chunks; first += compression_threads) {
+            int count = MIN(compression_threads, num_chunks - first);
+            ok = compressed = compress_chunks(&job, first, count);
+            for (int i = first; ok && i < first + count; i++) {
+                ok = GOTCHA_REAL_CALL(fwrite)(job.chunks[i], 1, job.chunk_sizes[i], out_file) == job.chunk_sizes[i];
+                free(job.chunks[i]);
+                job.chunks[i] = NULL;
+            }
+        }
+        if (compressed || job.codec == RECORDER_CODEC_STORED)
+            break;
+
+        // Start over and store the chunks as they are
+        store_uncompressed(&job, num_chunks);
+        GOTCHA_REAL_CALL(fflush)(out_file);
+        GOTCHA_REAL_CALL(ftruncate)(GOTCHA_REAL_CALL(fileno)(out_file), off);
+        GOTCHA_REAL_CALL(fseek)(out_file, off, SEEK_SET);
     }
 
-    strm.avail_in = buf_size;
-    strm.next_in  = buf;
-    /* run deflate() on input until output buffer not full, finish
-       compression if all of source has been read in */
-    do {
-        strm.avail_out = buf_size;
-        strm.next_out = out;
-        ret = deflate(&strm, Z_FINISH);    /* no bad return value */
-        assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-        have = buf_size - strm.avail_out;
-        compressed_size += have;
-        if (GOTCHA_REAL_CALL(fwrite)(out, 1, have, out_file) != have) {
-            RECORDER_LOGERR("[Recorder] fatal error: zlib write out error.");
-            (void)deflateEnd(&strm);
-            return;
-        }
-    } while (strm.avail_out == 0);
-    assert(strm.avail_in == 0);         /* all input will be used */
-
-    /* clean up and return */
-    (void)deflateEnd(&strm);
-
-    GOTCHA_REAL_CALL(fseek)(out_file, off, SEEK_SET);
-    GOTCHA_REAL_CALL(fwrite)(&compressed_size, sizeof(size_t), 1, out_file);
-    GOTCHA_REAL_CALL(fwrite)(&decompressed_size, sizeof(size_t), 1, out_file);
-    GOTCHA_REAL_CALL(fseek)(out_file, compressed_size, SEEK_CUR);
-    RECORDER_LOGDBG("[Recorder] recorder_write_zlib seek off: %ld, compressed_size: %ld, decompressed_size: %ld\n",
-                    off, compressed_size, decompressed_size);
+    long end = GOTCHA_REAL_CALL(ftell)(out_file);
+    if (ok) {
+        write_block_header(header, &job, num_chunks);
+        ok = GOTCHA_REAL_CALL(fseek)(out_file, off, SEEK_SET) == 0 &&
+             GOTCHA_REAL_CALL(fwrite)(header, 1, meta_size, out_file) == meta_size &&
+             GOTCHA_REAL_CALL(fseek)(out_file, end, SEEK_SET) == 0;
+    }
+
+    if (ok) {
+        RECORDER_LOGDBG("[Recorder] recorder_write_block codec: %s, chunks: %d, compressed_size: %ld, decompressed_size: %ld\n",
+                        recorder_codec_names[job.codec], num_chunks, end - off - meta_size, buf_size);
+    } else {
+        if (compressed)
+            RECORDER_LOGERR("[Recorder] fatal error: compressed block write out error.\n");
+        GOTCHA_REAL_CALL(fflush)(out_file);
+        GOTCHA_REAL_CALL(ftruncate)(GOTCHA_REAL_CALL(fileno)(out_file), off);
+        GOTCHA_REAL_CALL(fseek)(out_file, off, SEEK_SET);
+    }
+
+    free(header);
+    free_compress_job(&job, num_chunks);
+    return ok;
+}
+
+int recorder_stream_codec(int stream) {
+    return codecs[stream];
+}
+
+void recorder_write_indexed_blocks(const char* filename, void* block, size_t block_size,
+                                   int block_index, int num_blocks, MPI_Comm comm) {
+    GOTCHA_SET_REAL_CALL(MPI_File_open, RECORDER_MPIIO);
+    GOTCHA_SET_REAL_CALL(MPI_File_write_at, RECORDER_MPIIO);
+    GOTCHA_SET_REAL_CALL(MPI_File_write_at_all, RECORDER_MPIIO);
+    GOTCHA_SET_REAL_CALL(MPI_File_close, RECORDER_MPIIO);
+
+    int rank;
+    PMPI_Comm_rank(comm, &rank);
+
+    // Blocks are placed in rank order after the index
+    MPI_Offset size = (block_index >= 0) ? block_size : 0;
+    MPI_Offset offset = 0;
+    PMPI_Exscan(&size, &offset, 1, MPI_OFFSET, MPI_SUM, comm);
+    if (rank == 0) offset = 0;          // undefined on rank 0
+    offset += sizeof(size_t) * (1 + num_blocks);
+
+    MPI_File fh;
+    GOTCHA_REAL_CALL(MPI_File_open)(comm, filename, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+    PMPI_File_set_size(fh, 0);          // in case a larger file exists
+    // the entries of ranks without a block (block_index -1) read as 0,
+    // even if no rank has one
+    PMPI_File_set_size(fh, sizeof(size_t) * (1 + num_blocks));
+
+    if (rank == 0) {
+        size_t n = num_blocks;
+        GOTCHA_REAL_CALL(MPI_File_write_at)(fh, 0, &n, sizeof(size_t), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    size_t block_offset = offset;
+    int count = (block_index >= 0) ? sizeof(size_t) : 0;
+    MPI_Offset index_offset = sizeof(size_t) * (1 + (block_index >= 0 ? block_index : 0));
+    GOTCHA_REAL_CALL(MPI_File_write_at_all)(fh, index_offset, &block_offset, count, MPI_BYTE, MPI_STATUS_IGNORE);
+
+    // Blocks may be larger than INT_MAX bytes
+    MPI_Datatype block_type = recorder_bytes_type(size);
+    GOTCHA_REAL_CALL(MPI_File_write_at_all)(fh, offset, block, 1, block_type, MPI_STATUS_IGNORE);
+    PMPI_Type_free(&block_type);
+    GOTCHA_REAL_CALL(MPI_File_close)(&fh);
 }
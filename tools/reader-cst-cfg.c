@@ -5,10 +5,13 @@
 #include <assert.h>
 #include <zlib.h>
 #include "./reader-private.h"
+#include "recorder-varint.h"
 
 void reader_free_cst(CST* cst) {
-    for(int i = 0; i < cst->entries; i++)
+    for(int i = 0; i < cst->entries; i++) {
         free(cst->cs_list[i].key);
+        free(cst->cs_list[i].stats);
+    }
     free(cst->cs_list);
 }
 
@@ -21,16 +24,15 @@ void reader_free_cfg(CFG* cfg) {
     }
 }
 
-void reader_decode_cst(int rank, void* buf, CST* cst) {
-    cst->rank = rank;
-
-    memcpy(&cst->entries, buf, sizeof(int));
+// cst->cs_list will be stored in the terminal_id order.
+// With stats, each key is followed by the CallStats of the signature.
+// Returns the end of the decoded entries.
+static void* decode_cst_entries(void* buf, CST* cst, bool stats) {
+    int entries;
+    memcpy(&entries, buf, sizeof(int));
     buf += sizeof(int);
 
-	// cst->cs_list will be stored in the terminal_id order.
-    cst->cs_list = malloc(cst->entries * sizeof(CallSignature));
-
-    for(int i = 0; i < cst->entries; i++) {
+    for(int i = 0; i < entries; i++) {
 
 		int terminal_id;
         memcpy(&terminal_id, buf, sizeof(int));
@@ -50,44 +52,186 @@ void reader_decode_cst(int rank, void* buf, CST* cst) {
         cs->key = malloc(cs->key_len);
         memcpy(cs->key, buf, cs->key_len);
         buf += cs->key_len;
+
+        cs->stats = NULL;
+        if(stats) {
+            cs->stats = malloc(sizeof(CallStats));
+            memcpy(cs->stats, buf, sizeof(CallStats));
+            buf += sizeof(CallStats);
+        }
+    }
+    return buf;
+}
+
+void reader_decode_cst(int rank, void* buf, CST* cst, bool stats) {
+    cst->rank = rank;
+    memcpy(&cst->entries, buf, sizeof(int));
+    cst->cs_list = malloc(cst->entries * sizeof(CallSignature));
+    decode_cst_entries(buf, cst, stats);
+}
+
+/*
+ * The merged CST is stored as one shard per rank,
+ * each shard uses the same format as a per-rank CST
+ */
+void reader_decode_cst_shards(void** shards, int num_shards, CST* cst, bool stats) {
+    cst->rank = 0;
+    cst->entries = 0;
+    for(int i = 0; i < num_shards; i++) {
+        int entries;
+        memcpy(&entries, shards[i], sizeof(int));
+        cst->entries += entries;
     }
+
+    cst->cs_list = malloc(cst->entries * sizeof(CallSignature));
+    for(int i = 0; i < num_shards; i++)
+        decode_cst_entries(shards[i], cst, stats);
 }
 
+// Apply the count (and statistics) updates of a flush to the signatures
+static void* apply_cst_updates(void* buf, CST* cst, bool stats) {
+    int updates;
+    memcpy(&updates, buf, sizeof(int));
+    buf += sizeof(int);
+
+    for(int i = 0; i < updates; i++) {
+        int terminal_id;
+        memcpy(&terminal_id, buf, sizeof(int));
+        buf += sizeof(int);
+        assert(terminal_id < cst->entries);
+
+        CallSignature* cs = &(cst->cs_list[terminal_id]);
+        memcpy(&cs->count, buf, sizeof(int));
+        buf += sizeof(int);
+        if(stats) {
+            memcpy(cs->stats, buf, sizeof(CallStats));
+            buf += sizeof(CallStats);
+        }
+    }
+    return buf;
+}
+
+/*
+ * Recovery of a killed run: the segments appended by the background
+ * flusher (N.cst.segments), one per flush, each in the per-rank CST
+ * format followed by the updated counts of the signatures of earlier
+ * flushes, see cst_flush_segment() in the tracing library. Only the
+ * first bytes, i.e., the complete flushes, holding entries signatures
+ * in total, are decoded. The counts and statistics are the ones of
+ * the last complete flush.
+ */
+void reader_decode_cst_segments(int rank, void* buf, size_t bytes, int entries, CST* cst, bool stats) {
+    cst->rank = rank;
+    cst->entries = entries;
+    cst->cs_list = malloc(entries * sizeof(CallSignature));
+
+    void* end = buf + bytes;
+    while(buf < end) {
+        buf = decode_cst_entries(buf, cst, stats);
+        buf = apply_cst_updates(buf, cst, stats);
+    }
+    assert(buf == end);
+}
+
+/*
+ * Recovery of a killed run: the grammar epochs appended by the
+ * background flusher (N.cfg.epochs), each stored by serialize_grammar()
+ * as | #integers | #rules | rule id | #symbols | val, exp ... | ... |.
+ * Only the first epochs epochs are used. They are put under the root
+ * rule -1, like serialize_cfg() in the tracing library does at
+ * finalize time, the first rule of each epoch is its main rule.
+ */
+void reader_decode_cfg_epochs(int rank, int* buf, int epochs, CFG* cfg) {
+    cfg->rank = rank;
+    cfg->rules = 1;
+    cfg->cfg_head = NULL;
+    cfg->dict = NULL;
+
+    RuleHash *root = malloc(sizeof(RuleHash));
+    root->rule_id = -1;
+    root->symbols = epochs;
+    root->rule_body = (int*) malloc(sizeof(int)*epochs*2);
+
+    int* ptr = buf;
+    for(int e = 0; e < epochs; e++) {
+        int integers = *ptr++;
+        int* end = ptr + integers;
+        int rules = *ptr++;
+        for(int i = 0; i < rules; i++) {
+            RuleHash *rule = malloc(sizeof(RuleHash));
+            rule->rule_id = *ptr++;
+            rule->symbols = *ptr++;
+            rule->rule_body = (int*) malloc(sizeof(int)*rule->symbols*2);
+            memcpy(rule->rule_body, ptr, sizeof(int)*rule->symbols*2);
+            ptr += rule->symbols*2;
+            HASH_ADD_INT(cfg->cfg_head, rule_id, rule);
+
+            if(i == 0) {
+                root->rule_body[2*e]   = rule->rule_id;
+                root->rule_body[2*e+1] = 1;
+            }
+        }
+        assert(ptr == end);
+        cfg->rules += rules;
+    }
+    HASH_ADD_INT(cfg->cfg_head, rule_id, root);
+}
+
+/*
+ * Decode a grammar stored by sequitur_encode_grammar(),
+ * see lib/recorder-sequitur-logger.c for the format
+ */
 void reader_decode_cfg(int rank, void* buf, CFG* cfg) {
 
     cfg->rank = rank;
 
-    memcpy(&cfg->rules, buf, sizeof(int));
-    buf += sizeof(int);
+    unsigned char* ptr = buf;
+    cfg->rules = (int) varint_get(&ptr);
 
+    int rule_id = 0;
     cfg->cfg_head = NULL;
+    cfg->dict = NULL;
     for(int i = 0; i < cfg->rules; i++) {
         RuleHash *rule = malloc(sizeof(RuleHash));
 
-        memcpy(&rule->rule_id, buf, sizeof(int));
-        buf += sizeof(int);
-        memcpy(&rule->symbols, buf, sizeof(int));
-        buf += sizeof(int);
+        rule_id += (int) zigzag_decode(varint_get(&ptr));
+        rule->rule_id = rule_id;
+        rule->symbols = (int) varint_get(&ptr);
 
         rule->rule_body = (int*) malloc(sizeof(int)*rule->symbols*2);
-        memcpy(rule->rule_body, buf, sizeof(int)*rule->symbols*2);
-        buf += sizeof(int)*rule->symbols*2;
+        for(int j = 0; j < rule->symbols; j++) {
+            uint64_t token = varint_get(&ptr);
+            rule->rule_body[2*j]   = (int) zigzag_decode(token >> 1);
+            rule->rule_body[2*j+1] = (token & 1) ? (int) varint_get(&ptr) : 1;
+        }
         HASH_ADD_INT(cfg->cfg_head, rule_id, rule);
     }
 }
 
+// From a container, CSTs and grammars are
+// decoded on first use, see reader_load_cst()
 CST* reader_get_cst(RecorderReader* reader, int rank) {
-	CST* cst = reader->csts[rank];
-    return cst;
+    if(reader->csts[rank] == NULL)
+        reader_load_cst(reader, rank);
+    return reader->csts[rank];
 }
 
+// cfgs[rank] already points to the unique grammar
+// of the rank if interprocess compression is enabled
 CFG* reader_get_cfg(RecorderReader* reader, int rank) {
-    CFG* cfg;
-    if (reader->metadata.interprocess_compression)
-	    cfg = reader->cfgs[reader->ug_ids[rank]];
-    else
-        cfg = reader->cfgs[rank];
-    return cfg;
+    if(reader->cfgs[rank] == NULL)
+        reader_load_cfg(reader, rank);
+    return reader->cfgs[rank];
+}
+
+// Rules not found in the grammar itself are
+// looked up in the shared dictionary
+RuleHash* reader_get_rule(CFG* cfg, int rule_id) {
+    RuleHash *rule = NULL;
+    HASH_FIND_INT(cfg->cfg_head, &rule_id, rule);
+    if(rule == NULL && cfg->dict)
+        HASH_FIND_INT(cfg->dict->cfg_head, &rule_id, rule);
+    return rule;
 }
 
 // Caller needs to free the record after use
@@ -48,12 +48,18 @@ typedef struct IntervalsMap_t {
  * recorder_get_cst_cfg() can be used to perform
  * custom tasks with CST and CFG
  */
-void reader_decode_cst(int rank, void* buf, CST* cst);
+void reader_decode_cst(int rank, void* buf, CST* cst, bool stats);
+void reader_decode_cst_shards(void** shards, int num_shards, CST* cst, bool stats);
 void reader_decode_cfg(int rank, void* buf, CFG* cfg);
+void reader_decode_cst_segments(int rank, void* buf, size_t bytes, int entries, CST* cst, bool stats);
+void reader_decode_cfg_epochs(int rank, int* buf, int epochs, CFG* cfg);
 void reader_free_cst(CST *cst);
 void reader_free_cfg(CFG *cfg);
+void reader_load_cst(RecorderReader* reader, int rank);
+void reader_load_cfg(RecorderReader* reader, int rank);
 CST* reader_get_cst(RecorderReader* reader, int rank);
 CFG* reader_get_cfg(RecorderReader* reader, int rank);
+RuleHash* reader_get_rule(CFG* cfg, int rule_id);
 
 Record* reader_cs_to_record(CallSignature *cs);
 
@@ -3,100 +3,280 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib.h>
+#ifdef RECORDER_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef RECORDER_ENABLE_LZ4
+#include <lz4.h>
+#endif
 #include "reader.h"
 #include "reader-private.h"
+#include "recorder-codec.h"
+#include "recorder-container.h"
+#include "recorder-varint.h"
 
-void* read_zlib(FILE* source) {
-    const int CHUNK = 65536;
-    int ret;
-    unsigned have;
-    z_stream strm;
-    unsigned char out[CHUNK]; // TODO remove out, and store directly to uncompressed.
-
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK)
+/*
+ * Chunks of a block, decompressed by several threads,
+ * each taking the next chunk
+ */
+typedef struct DecompressJob_t {
+    int             codec;
+    int             num_chunks;
+    size_t          chunk_size;
+    size_t          decompressed_size;
+    size_t*         chunk_sizes;            // compressed size of each chunk
+    size_t*         chunk_offsets;          // offset of each chunk in compressed
+    unsigned char*  compressed;
+    unsigned char*  decompressed;
+    int             next;
+    bool            ok;
+    pthread_mutex_t mutex;
+} DecompressJob;
+
+static bool decompress_chunk(int codec, unsigned char* in, size_t in_size, unsigned char* out, size_t out_size) {
+    switch(codec) {
+        case RECORDER_CODEC_ZLIB: {
+            uLongf len = out_size;
+            return uncompress(out, &len, in, in_size) == Z_OK && len == out_size;
+        }
+#ifdef RECORDER_ENABLE_ZSTD
+        case RECORDER_CODEC_ZSTD:
+            return ZSTD_decompress(out, out_size, in, in_size) == out_size;
+#endif
+#ifdef RECORDER_ENABLE_LZ4
+        case RECORDER_CODEC_LZ4:
+            return LZ4_decompress_safe((const char*)in, (char*)out, in_size, out_size) == (int)out_size;
+#endif
+        case RECORDER_CODEC_STORED:
+            if(in_size != out_size)
+                return false;
+            memcpy(out, in, in_size);
+            return true;
+    }
+    return false;
+}
+
+static void* decompress_worker(void* arg) {
+    DecompressJob* job = arg;
+    while(true) {
+        pthread_mutex_lock(&job->mutex);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+        if(i >= job->num_chunks)
+            break;
+
+        size_t offset = i * job->chunk_size;
+        size_t size = job->decompressed_size - offset;
+        if(size > job->chunk_size)
+            size = job->chunk_size;
+        if(!decompress_chunk(job->codec, job->compressed + job->chunk_offsets[i], job->chunk_sizes[i],
+                             job->decompressed + offset, size))
+            job->ok = false;        // only ever set to false, no lock needed
+    }
+    return NULL;
+}
+
+/*
+ * Decompress a block written by recorder_compress_block() in the
+ * tracing library, see recorder-codec.h for the layout. Sets
+ * *block_size to the on-disk size of the block.
+ */
+void* decompress_block(unsigned char* block, size_t* block_size) {
+    DecompressJob job;
+    size_t compressed_size;
+    unsigned char* ptr = block;
+    memcpy(&compressed_size, ptr, sizeof(size_t));              ptr += sizeof(size_t);
+    memcpy(&job.decompressed_size, ptr, sizeof(size_t));        ptr += sizeof(size_t);
+    memcpy(&job.codec, ptr, sizeof(int));                       ptr += sizeof(int);
+    memcpy(&job.num_chunks, ptr, sizeof(int));                  ptr += sizeof(int);
+    memcpy(&job.chunk_size, ptr, sizeof(size_t));               ptr += sizeof(size_t);
+    job.chunk_sizes = malloc(sizeof(size_t) * job.num_chunks);
+    memcpy(job.chunk_sizes, ptr, sizeof(size_t) * job.num_chunks);
+    job.compressed = block + recorder_block_meta_size(job.num_chunks);
+    *block_size = recorder_block_meta_size(job.num_chunks) + compressed_size;
+
+    if(!recorder_codec_available(job.codec)) {
+        fprintf(stderr, "the traces use the %s codec, rebuild the reader with it enabled\n",
+                job.codec < RECORDER_NUM_CODECS ? recorder_codec_names[job.codec] : "unknown");
+        free(job.chunk_sizes);
         return NULL;
+    }
 
-    // In the first two size_t we alway store comperssed_size
-    // and decompressed_size. See write_zlib in recorder-utils.c
-    size_t compressed_size, decompressed_size;
-    fread(&compressed_size, sizeof(size_t), 1, source);
-    fread(&decompressed_size, sizeof(size_t), 1, source);
-    void* compressed   = malloc(compressed_size);
-    void* decompressed = malloc(decompressed_size);
-    void* p_decompressed = decompressed;
-    //printf("compressed size: %ld, decompressed size: %ld\n", 
-    //       compressed_size, decompressed_size);
-
-    strm.avail_in = fread(compressed, 1, compressed_size, source);
-    strm.next_in  = compressed;
-    assert(strm.avail_in == compressed_size);
-
-    /* run inflate() on input until output buffer not full */
-    do {
-        strm.avail_out = CHUNK;
-        strm.next_out  = out;
-        ret = inflate(&strm, Z_NO_FLUSH);
-        assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-        switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR;     /* and fall through */
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
-                free(compressed);
-                free(decompressed);
-                return NULL;
-        }
-        have = CHUNK - strm.avail_out;
-        memcpy(p_decompressed, out, have);
-        p_decompressed += have;
-    } while (strm.avail_out == 0);
+    job.chunk_offsets = malloc(sizeof(size_t) * job.num_chunks);
+    size_t offset = 0;
+    for(int i = 0; i < job.num_chunks; i++) {
+        job.chunk_offsets[i] = offset;
+        offset += job.chunk_sizes[i];
+    }
+    job.decompressed = malloc(job.decompressed_size);
+    job.next = 0;
+    job.ok = true;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    // One thread per chunk, at most one per core
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_threads > job.num_chunks)
+        num_threads = job.num_chunks;
+    pthread_t threads[num_threads > 1 ? num_threads - 1 : 1];
+    int started = 0;
+    for(; started < num_threads - 1; started++) {
+        if(pthread_create(&threads[started], NULL, decompress_worker, &job) != 0)
+            break;
+    }
+    decompress_worker(&job);
+    for(int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    pthread_mutex_destroy(&job.mutex);
+    free(job.chunk_offsets);
+    free(job.chunk_sizes);
+    if(!job.ok) {
+        free(job.decompressed);
+        return NULL;
+    }
+    return job.decompressed;
+}
 
-    (void)inflateEnd(&strm);
-    free(compressed);
+/*
+ * Read and decompress the block at the current position of source
+ */
+void* read_block(FILE* source) {
+    unsigned char header[RECORDER_BLOCK_HEADER_SIZE];
+    fread(header, 1, RECORDER_BLOCK_HEADER_SIZE, source);
+
+    size_t compressed_size;
+    int num_chunks;
+    memcpy(&compressed_size, header, sizeof(size_t));
+    memcpy(&num_chunks, header + 2*sizeof(size_t) + sizeof(int), sizeof(int));
+
+    size_t meta_size = recorder_block_meta_size(num_chunks);
+    unsigned char* block = malloc(meta_size + compressed_size);
+    memcpy(block, header, RECORDER_BLOCK_HEADER_SIZE);
+    size_t n = fread(block + RECORDER_BLOCK_HEADER_SIZE, 1, meta_size - RECORDER_BLOCK_HEADER_SIZE + compressed_size, source);
+    assert(n == meta_size - RECORDER_BLOCK_HEADER_SIZE + compressed_size);
+
+    size_t block_size;
+    void* decompressed = decompress_block(block, &block_size);
+    free(block);
     return decompressed;
 }
 
-void check_version(RecorderReader* reader) {
-    char version_file[1096] = {0};
-    sprintf(version_file, "%s/VERSION", reader->logs_dir);
+/*
+ * Read the index of a file written by recorder_write_indexed_blocks()
+ * | num_blocks | offset of block 0 | ... | offset of block n-1 | blocks |
+ * Caller needs to free the returned offsets
+ */
+static size_t* read_block_index(FILE* source, size_t* num_blocks) {
+    fread(num_blocks, sizeof(size_t), 1, source);
+    size_t* offsets = malloc(sizeof(size_t) * (*num_blocks));
+    fread(offsets, sizeof(size_t), *num_blocks, source);
+    return offsets;
+}
+
+/*
+ * Map the container if the traces directory has one (or
+ * logs_dir is the container itself), see recorder-container.h
+ */
+static void open_container(RecorderReader* reader) {
+    char path[1096] = {0};
+    struct stat sb;
+    if(stat(reader->logs_dir, &sb) == 0 && S_ISREG(sb.st_mode))
+        strcpy(path, reader->logs_dir);
+    else
+        sprintf(path, "%s/%s", reader->logs_dir, RECORDER_CONTAINER_NAME);
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return;
+    fstat(fd, &sb);
+    void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED || sb.st_size < sizeof(RecorderContainerHeader) ||
+       !recorder_container_valid(map)) {
+        fprintf(stderr, "invalid trace container %s\n", path);
+        exit(1);
+    }
+    reader->container = map;
+    reader->container_size = sb.st_size;
+}
+
+// Section of the container with the given name, NULL if none
+static unsigned char* container_section(RecorderReader* reader, const char* name, size_t* size) {
+    RecorderContainerHeader* header = (RecorderContainerHeader*) reader->container;
+    RecorderSection* sections = (RecorderSection*) (reader->container + sizeof(RecorderContainerHeader));
+    for(int i = 0; i < header->num_sections; i++) {
+        if(strcmp(sections[i].name, name) == 0) {
+            *size = sections[i].size;
+            return reader->container + sections[i].offset;
+        }
+    }
+    return NULL;
+}
+
+static RecorderRankIndex* container_rank_index(RecorderReader* reader, int rank) {
+    RecorderContainerHeader* header = (RecorderContainerHeader*) reader->container;
+    return (RecorderRankIndex*) (reader->container + header->index_offset) + rank;
+}
 
-    FILE* fp = fopen(version_file, "r");
-    assert(fp != NULL);
+/*
+ * Read a whole uncompressed file of the trace (or the section of
+ * the container that replaces it), NULL if it does not exist.
+ * Returns a NUL-terminated copy that the caller needs to free.
+ */
+static char* read_small_file(RecorderReader* reader, const char* name, size_t* size) {
+    char* buf;
+    if(reader->container) {
+        unsigned char* section = container_section(reader, name, size);
+        if(section == NULL)
+            return NULL;
+        buf = malloc(*size + 1);
+        memcpy(buf, section, *size);
+    } else {
+        char path[1096] = {0};
+        sprintf(path, "%s/%s", reader->logs_dir, name);
+        FILE* fp = fopen(path, "rb");
+        if(fp == NULL)
+            return NULL;
+        fseek(fp, 0, SEEK_END);
+        *size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        buf = malloc(*size + 1);
+        fread(buf, 1, *size, fp);
+        fclose(fp);
+    }
+    buf[*size] = 0;
+    return buf;
+}
+
+void check_version(RecorderReader* reader) {
+    size_t size;
+    char* buf = read_small_file(reader, "VERSION", &size);
+    assert(buf != NULL);
     int major, minor, patch;
-    fscanf(fp, "%d.%d.%d", &major, &minor, &patch);
+    sscanf(buf, "%d.%d.%d", &major, &minor, &patch);
     if(major != RECORDER_VERSION_MAJOR || minor != RECORDER_VERSION_MINOR) {
         fprintf(stderr, "incompatible version: file=%d.%d.%d != reader=%d.%d.%d\n",
                 major, minor, patch, RECORDER_VERSION_MAJOR,
                 RECORDER_VERSION_MINOR, RECORDER_VERSION_PATCH);
         exit(1);
     }
-    fclose(fp);
+    free(buf);
 }
 
 void read_metadata(RecorderReader* reader) {
-    char metadata_file[1096] = {0};
-    sprintf(metadata_file, "%s/recorder.mt", reader->logs_dir);
-
-    FILE* fp = fopen(metadata_file, "rb");
-    assert(fp != NULL);
-    fread(&reader->metadata, sizeof(reader->metadata), 1, fp);
-
-    long pos = ftell(fp);
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp) - pos;
-    char buf[fsize];
+    size_t size;
+    char* file = read_small_file(reader, "recorder.mt", &size);
+    assert(file != NULL);
+    memcpy(&reader->metadata, file, sizeof(reader->metadata));
 
-    fseek(fp, pos, SEEK_SET);
-    fread(buf, 1, fsize, fp);
+    long fsize = size - sizeof(reader->metadata);
+    char* buf = file + sizeof(reader->metadata);
 
     int start_pos = 0, end_pos = 0;
     int func_id = 0;
@@ -119,7 +299,184 @@ void read_metadata(RecorderReader* reader) {
         }
     }
 
-    fclose(fp);
+    free(file);
+}
+
+/*
+ * Container only: decode the CST of the rank, with interprocess
+ * compression the merged one shared by all ranks
+ * | num_shards | offset of shard 0 | ... | shards |
+ */
+void reader_load_cst(RecorderReader* reader, int rank) {
+    assert(reader->container);
+    RecorderRankIndex* index = container_rank_index(reader, rank);
+    unsigned char* section = reader->container + index->cst_offset;
+    size_t block_size;
+
+    if(reader->metadata.interprocess_compression) {
+        if(reader->csts[0] == NULL) {
+            size_t num_shards;
+            memcpy(&num_shards, section, sizeof(size_t));
+            size_t* shard_offsets = (size_t*) malloc(sizeof(size_t) * num_shards);
+            memcpy(shard_offsets, section + sizeof(size_t), sizeof(size_t) * num_shards);
+            void** shards = malloc(sizeof(void*) * num_shards);
+            for(size_t i = 0; i < num_shards; i++)
+                shards[i] = decompress_block(section + shard_offsets[i], &block_size);
+            CST* cst = (CST*) malloc(sizeof(CST));
+            reader_decode_cst_shards(shards, num_shards, cst, reader->metadata.ts_stats_only);
+            for(size_t i = 0; i < num_shards; i++)
+                free(shards[i]);
+            free(shards);
+            free(shard_offsets);
+            for(int r = 0; r < reader->metadata.total_ranks; r++)
+                reader->csts[r] = cst;
+        }
+    } else {
+        void* buf_cst = decompress_block(section, &block_size);
+        reader->csts[rank] = (CST*) malloc(sizeof(CST));
+        reader_decode_cst(rank, buf_cst, reader->csts[rank], reader->metadata.ts_stats_only);
+        free(buf_cst);
+    }
+}
+
+/*
+ * Container only: decode the grammar of the rank, with interprocess
+ * compression the unique grammar it shares with other ranks
+ */
+void reader_load_cfg(RecorderReader* reader, int rank) {
+    assert(reader->container);
+    RecorderRankIndex* index = container_rank_index(reader, rank);
+    size_t block_size;
+
+    if(reader->metadata.interprocess_compression) {
+        int ug_id = reader->ug_ids[rank];
+        if(reader->ugs[ug_id] == NULL) {
+            void* buf_cfg = decompress_block(reader->container + index->cfg_offset, &block_size);
+            reader->ugs[ug_id] = (CFG*) malloc(sizeof(CFG));
+            reader_decode_cfg(ug_id, buf_cfg, reader->ugs[ug_id]);
+            reader->ugs[ug_id]->dict = reader->dict;
+            free(buf_cfg);
+        }
+        reader->cfgs[rank] = reader->ugs[ug_id];
+    } else {
+        void* buf_cfg = decompress_block(reader->container + index->cfg_offset, &block_size);
+        reader->cfgs[rank] = (CFG*) malloc(sizeof(CFG));
+        reader_decode_cfg(rank, buf_cfg, reader->cfgs[rank]);
+        free(buf_cfg);
+    }
+}
+
+/*
+ * From a container, only the metadata and the rule dictionary
+ * are read up front, see reader_load_cst() and reader_load_cfg()
+ */
+static void init_reader_container(RecorderReader* reader) {
+    if(!reader->metadata.interprocess_compression)
+        return;
+
+    int nprocs = reader->metadata.total_ranks;
+    size_t size;
+    char* ug_metadata = read_small_file(reader, "ug.mt", &size);
+    assert(ug_metadata != NULL);
+    int dict_rules = 0;
+    memcpy(reader->ug_ids, ug_metadata, sizeof(int) * nprocs);
+    memcpy(&reader->num_ugs, ug_metadata + sizeof(int) * nprocs, sizeof(int));
+    memcpy(&dict_rules, ug_metadata + sizeof(int) * (nprocs + 1), sizeof(int));
+    free(ug_metadata);
+
+    reader->ugs = realloc(reader->ugs, sizeof(CFG*) * reader->num_ugs);
+    memset(reader->ugs, 0, sizeof(CFG*) * reader->num_ugs);
+
+    unsigned char* dict = container_section(reader, "ug.dict", &size);
+    if(dict_rules > 0 && dict) {
+        size_t block_size;
+        void* buf_dict = decompress_block(dict, &block_size);
+        reader->dict = (CFG*) malloc(sizeof(CFG));
+        reader_decode_cfg(-1, buf_dict, reader->dict);
+        free(buf_dict);
+    }
+}
+
+/*
+ * Recovery of a killed run
+ *
+ * With the background flusher (RECORDER_FLUSH_INTERVAL), VERSION and
+ * recorder.mt are written when tracing starts, and every rank
+ * periodically appends its trace to segment files, see flush_index()
+ * in the tracing library. If the program died before finalize, there
+ * is no recorder.cst or N.cst, so the trace of each rank is rebuilt
+ * from the part of its files that N.idx marks as complete:
+ * | int cfg_epochs | int cst_entries | size_t cst_bytes | size_t ts_bytes |
+ * | int num_records | int num_streams | pthread_t tid of each stream |
+ * A rank that never flushed has no records.
+ */
+typedef struct FlushIndex_t {
+    int        cfg_epochs;      // complete epochs of N.cfg.epochs
+    int        cst_entries;     // signatures in the complete segments of N.cst.segments
+    size_t     cst_bytes;       // complete segments of N.cst.segments
+    size_t     ts_bytes;        // complete timestamp blocks of N.ts
+    int        num_records;
+    int        num_streams;
+    pthread_t* tids;            // thread id of each timestamp stream
+} FlushIndex;
+
+static bool trace_finalized(RecorderReader* reader) {
+    char path[1096] = {0};
+    sprintf(path, "%s/recorder.cst", reader->logs_dir);
+    if(access(path, F_OK) == 0)
+        return true;
+    sprintf(path, "%s/0.cst", reader->logs_dir);
+    return access(path, F_OK) == 0;
+}
+
+// Return false if the rank never flushed, index is then all 0
+static bool read_flush_index(RecorderReader* reader, int rank, FlushIndex* index) {
+    memset(index, 0, sizeof(*index));
+    char path[1096] = {0};
+    sprintf(path, "%s/%d.idx", reader->logs_dir, rank);
+    FILE* f = fopen(path, "rb");
+    if(f == NULL)
+        return false;
+    fread(&index->cfg_epochs, sizeof(int), 1, f);
+    fread(&index->cst_entries, sizeof(int), 1, f);
+    fread(&index->cst_bytes, sizeof(size_t), 1, f);
+    fread(&index->ts_bytes, sizeof(size_t), 1, f);
+    fread(&index->num_records, sizeof(int), 1, f);
+    fread(&index->num_streams, sizeof(int), 1, f);
+    index->tids = malloc(sizeof(pthread_t) * index->num_streams);
+    fread(index->tids, sizeof(pthread_t), index->num_streams, f);
+    fclose(f);
+    return true;
+}
+
+static void recover_rank(RecorderReader* reader, int rank) {
+    FlushIndex index;
+    if(!read_flush_index(reader, rank, &index))
+        fprintf(stderr, "rank %d never flushed its trace, it has no records\n", rank);
+
+    char name[64];
+    size_t size;
+    char* segments = NULL;
+    if(index.cst_bytes > 0) {
+        sprintf(name, "%d.cst.segments", rank);
+        segments = read_small_file(reader, name, &size);
+        assert(segments != NULL && size >= index.cst_bytes);
+    }
+    reader->csts[rank] = (CST*) malloc(sizeof(CST));
+    reader_decode_cst_segments(rank, segments, index.cst_bytes, index.cst_entries, reader->csts[rank],
+                               reader->metadata.ts_stats_only);
+    free(segments);
+
+    char* epochs = NULL;
+    if(index.cfg_epochs > 0) {
+        sprintf(name, "%d.cfg.epochs", rank);
+        epochs = read_small_file(reader, name, &size);
+        assert(epochs != NULL);
+    }
+    reader->cfgs[rank] = (CFG*) malloc(sizeof(CFG));
+    reader_decode_cfg_epochs(rank, (int*) epochs, index.cfg_epochs, reader->cfgs[rank]);
+    free(epochs);
+    free(index.tids);
 }
 
 void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
@@ -132,6 +489,8 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
     reader->hdf5_start_idx = -1;
     reader->prev_tstart = 0.0;
 
+    open_container(reader);
+
     check_version(reader);
 
     read_metadata(reader);
@@ -139,42 +498,79 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
 	int nprocs= reader->metadata.total_ranks;
 
 	reader->ug_ids = malloc(sizeof(int) * nprocs);
-    reader->ugs    = malloc(sizeof(CFG*) * nprocs);
-	reader->csts   = malloc(sizeof(CST*) * nprocs);
-	reader->cfgs   = malloc(sizeof(CFG*) * nprocs);
-
-	if(reader->metadata.interprocess_compression) {
+    reader->ugs    = calloc(nprocs, sizeof(CFG*));
+	reader->csts   = calloc(nprocs, sizeof(CST*));
+	reader->cfgs   = calloc(nprocs, sizeof(CFG*));
+
+    if(reader->container) {
+        init_reader_container(reader);
+    } else if(!trace_finalized(reader)) {
+        // Each rank has its own CST and grammar then
+        fprintf(stderr, "%s has no finalized trace, recovering each rank up to its last flush\n", logs_dir);
+        reader->recovered = true;
+        reader->metadata.interprocess_compression = false;
+        for(int rank = 0; rank < nprocs; rank++)
+            recover_rank(reader, rank);
+    } else if(reader->metadata.interprocess_compression) {
         // a single file for merged csts
         // and a single for unique cfgs
-        void* buf_cst;
         void* buf_cfg;
 
         // Read and parse the cst file
 		char cst_fname[1096] = {0};
 		sprintf(cst_fname, "%s/recorder.cst", reader->logs_dir);
 		FILE* cst_file = fopen(cst_fname, "rb");
-        buf_cst = read_zlib(cst_file);
+        size_t num_shards;
+        size_t* shard_offsets = read_block_index(cst_file, &num_shards);
+        void** shards = malloc(sizeof(void*) * num_shards);
+        for(size_t i = 0; i < num_shards; i++) {
+            fseek(cst_file, shard_offsets[i], SEEK_SET);
+            shards[i] = read_block(cst_file);
+        }
         reader->csts[0] = (CST*) malloc(sizeof(CST));
-		reader_decode_cst(0, buf_cst, reader->csts[0]);
+		reader_decode_cst_shards(shards, num_shards, reader->csts[0], reader->metadata.ts_stats_only);
         fclose(cst_file);
-        free(buf_cst);
+        for(size_t i = 0; i < num_shards; i++)
+            free(shards[i]);
+        free(shards);
+        free(shard_offsets);
 
 		char ug_metadata_fname[1096] = {0};
 		sprintf(ug_metadata_fname, "%s/ug.mt", reader->logs_dir);
 		FILE* f = fopen(ug_metadata_fname, "rb");
 		fread(reader->ug_ids, sizeof(int), nprocs, f);
 		fread(&reader->num_ugs, sizeof(int), 1, f);
+		int dict_rules = 0;
+		fread(&dict_rules, sizeof(int), 1, f);
 		fclose(f);
 
+        // Rules shared by multiple grammars
+        if(dict_rules > 0) {
+            char dict_fname[1096] = {0};
+            sprintf(dict_fname, "%s/ug.dict", reader->logs_dir);
+            FILE* dict_file = fopen(dict_fname, "rb");
+            void* buf_dict = read_block(dict_file);
+            reader->dict = (CFG*) malloc(sizeof(CFG));
+            reader_decode_cfg(-1, buf_dict, reader->dict);
+            free(buf_dict);
+            fclose(dict_file);
+        }
+
 		char cfg_fname[1096] = {0};
 		sprintf(cfg_fname, "%s/ug.cfg", reader->logs_dir);
 		FILE* cfg_file = fopen(cfg_fname, "rb");
+        size_t num_blocks;
+        size_t* cfg_offsets = read_block_index(cfg_file, &num_blocks);
+        assert(num_blocks == reader->num_ugs);
         for(int i = 0; i < reader->num_ugs; i++) {
-            buf_cfg = read_zlib(cfg_file);
+            fseek(cfg_file, cfg_offsets[i], SEEK_SET);
+            buf_cfg = read_block(cfg_file);
             reader->ugs[i] = (CFG*) malloc(sizeof(CFG));
             reader_decode_cfg(i, buf_cfg, reader->ugs[i]);
+            reader->ugs[i]->dict = reader->dict;
             free(buf_cfg);
         }
+        free(cfg_offsets);
         fclose(cfg_file);
 
         for(int rank = 0; rank < nprocs; rank++) {
@@ -187,16 +583,16 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
             char cst_fname[1096] = {0};
             sprintf(cst_fname, "%s/%d.cst", reader->logs_dir, rank);
             FILE* cst_file = fopen(cst_fname, "rb");
-            void* buf_cst = read_zlib(cst_file);
+            void* buf_cst = read_block(cst_file);
             reader->csts[rank] = (CST*) malloc(sizeof(CST));
-		    reader_decode_cst(rank, buf_cst, reader->csts[rank]);
+		    reader_decode_cst(rank, buf_cst, reader->csts[rank], reader->metadata.ts_stats_only);
             free(buf_cst);
             fclose(cst_file);
 
             char cfg_fname[1096] = {0};
             sprintf(cfg_fname, "%s/%d.cfg", reader->logs_dir, rank);
             FILE* cfg_file = fopen(cfg_fname, "rb");
-            void* buf_cfg = read_zlib(cfg_file);
+            void* buf_cfg = read_block(cfg_file);
             reader->cfgs[rank] = (CFG*) malloc(sizeof(CFG));
             reader_decode_cfg(rank, buf_cfg, reader->cfgs[rank]);
             free(buf_cfg);
@@ -208,17 +604,28 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
 void recorder_free_reader(RecorderReader *reader) {
     assert(reader);
 
+    // From a container, CSTs and grammars that
+    // were never needed have not been decoded
 	if(reader->metadata.interprocess_compression) {
-		reader_free_cst(reader->csts[0]);
-		free(reader->csts[0]);
+		if(reader->csts[0]) {
+			reader_free_cst(reader->csts[0]);
+			free(reader->csts[0]);
+		}
 		for(int i = 0; i < reader->num_ugs; i++) {
+			if(reader->ugs[i] == NULL) continue;
 			reader_free_cfg(reader->ugs[i]);
 			free(reader->ugs[i]);
 		}
+		if(reader->dict) {
+			reader_free_cfg(reader->dict);
+			free(reader->dict);
+		}
 	} else {
 		for(int rank = 0; rank < reader->metadata.total_ranks; rank++) {
-            reader_free_cst(reader->csts[rank]);
-            reader_free_cfg(reader->cfgs[rank]);
+            if(reader->csts[rank])
+                reader_free_cst(reader->csts[rank]);
+            if(reader->cfgs[rank])
+                reader_free_cfg(reader->cfgs[rank]);
         }
     }
 
@@ -226,6 +633,8 @@ void recorder_free_reader(RecorderReader *reader) {
 	free(reader->cfgs);
 	free(reader->ugs);
 	free(reader->ug_ids);
+    if(reader->container)
+        munmap(reader->container, reader->container_size);
 
     memset(reader, 0, sizeof(*reader));
 }
@@ -260,11 +669,153 @@ void recorder_free_record(Record* r) {
 
 #define TERMINAL_START_ID 0
 
-void rule_application(RecorderReader* reader, CFG* cfg, CST* cst, int rule_id, uint32_t* ts_buf,
+/*
+ * The timestamps of one rank, one stream per thread, see
+ * read_timestamps()
+ */
+typedef struct TimestampStreams_t {
+    int        num_streams;
+    pthread_t* tids;            // thread id of each stream
+    double**   ts;              // (tstart, tend) of the records of each stream
+    double**   cursors;         // next (tstart, tend) of each stream
+} TimestampStreams;
+
+static double* next_timestamps(TimestampStreams* streams, pthread_t tid) {
+    for(int i = 0; i < streams->num_streams; i++) {
+        if(streams->tids[i] == tid) {
+            double* ts = streams->cursors[i];
+            streams->cursors[i] += 2;
+            return ts;
+        }
+    }
+    assert(false && "no timestamp stream for the thread of a record");
+    return NULL;
+}
+
+/*
+ * Memory budget: put back the offset and count arguments that
+ * were replaced by RECORDER_REDUCED_ARG, the side stream has
+ * their values in record order
+ */
+static void restore_reduced_args(RecorderReader* reader, Record* record) {
+    int k = reader->metadata.reduced_funcs[record->func_id] - 1;
+    for(int j = 0; j < 2; j++) {
+        int idx = reducible_funcs[k].args[j];
+        if(idx < 0 || idx >= record->arg_count || record->args[idx] == NULL ||
+           strcmp(record->args[idx], RECORDER_REDUCED_ARG) != 0)
+            continue;
+        free(record->args[idx]);
+        record->args[idx] = malloc(32);
+        sprintf(record->args[idx], "%ld", zigzag_decode(varint_get(&reader->reduced_args_cursor)));
+    }
+}
+
+/*
+ * Append the varints of the blocks spilled by the tracing library to
+ * stream, bytes of them at spilled. The decompressed size of a block
+ * is the second field of its header, see recorder-codec.h. Return
+ * false if a block cannot be decompressed.
+ */
+static bool append_spilled_args(unsigned char** stream, size_t* len, unsigned char* spilled, size_t bytes) {
+    unsigned char* end = spilled + bytes;
+    while(spilled < end) {
+        size_t block_size, decompressed_size;
+        memcpy(&decompressed_size, spilled + sizeof(size_t), sizeof(size_t));
+        unsigned char* varints = decompress_block(spilled, &block_size);
+        if(varints == NULL)
+            return false;
+        *stream = realloc(*stream, *len + decompressed_size);
+        memcpy(*stream + *len, varints, decompressed_size);
+        *len += decompressed_size;
+        free(varints);
+        spilled += block_size;
+    }
+    return true;
+}
+
+/*
+ * recorder.args: one entry per rank, see save_reduced_args()
+ * in the tracing library
+ * | num_blocks | offset of entry 0 | ... | entries |
+ * The offset is 0 if the rank could not write its entry. An entry
+ * is a block with | number of values | spilled bytes | tail bytes |
+ * tail varints |, followed by the spilled blocks. The varints of the
+ * spilled blocks come first in record order, then the tail.
+ */
+static void read_reduced_args(RecorderReader* reader, int rank) {
+    reader->reduced_args = NULL;
+    reader->reduced_args_cursor = NULL;
+    if(reader->metadata.reduced_args != RECORDER_REDUCED_ARGS_STREAM)
+        return;
+
+    unsigned char* first = NULL;
+    unsigned char* spilled = NULL;
+    size_t header[3];
+    if(reader->container) {
+        size_t size, offset, block_size;
+        unsigned char* section = container_section(reader, "recorder.args", &size);
+        if(section == NULL)
+            return;
+        memcpy(&offset, section + sizeof(size_t) * (1 + rank), sizeof(size_t));
+        if(offset == 0)
+            return;
+        first = decompress_block(section + offset, &block_size);
+        if(first == NULL)
+            return;
+        memcpy(header, first, sizeof(header));
+        spilled = malloc(header[1]);
+        memcpy(spilled, section + offset + block_size, header[1]);
+    } else {
+        char args_fname[1096] = {0};
+        sprintf(args_fname, "%s/recorder.args", reader->logs_dir);
+        FILE* args_file = fopen(args_fname, "rb");
+        if(args_file == NULL)
+            return;
+        size_t num_blocks;
+        size_t* offsets = read_block_index(args_file, &num_blocks);
+        if(offsets[rank] != 0) {
+            fseek(args_file, offsets[rank], SEEK_SET);
+            first = read_block(args_file);
+        }
+        if(first) {
+            memcpy(header, first, sizeof(header));
+            spilled = malloc(header[1]);
+            size_t n = fread(spilled, 1, header[1], args_file);
+            assert(n == header[1]);
+        }
+        free(offsets);
+        fclose(args_file);
+        if(first == NULL)
+            return;
+    }
+
+    size_t len = 0;
+    unsigned char* stream = NULL;
+    if(append_spilled_args(&stream, &len, spilled, header[1])) {
+        // never 0 bytes, NULL means there is no stream
+        stream = realloc(stream, len + header[2] + 1);
+        memcpy(stream + len, first + sizeof(header), header[2]);
+    } else {
+        free(stream);
+        stream = NULL;
+    }
+    free(spilled);
+    free(first);
+    reader->reduced_args = stream;
+    reader->reduced_args_cursor = stream;
+}
+
+/*
+ * The cursors of ts are shared by the recursive calls so that each
+ * record consumes the next pair of timestamps of its thread's stream
+ * no matter which rule emits it.
+ * ts is NULL if the traces have no timestamps (statistics-only
+ * timing mode), tstart and tend are 0 then.
+ */
+void rule_application(RecorderReader* reader, CFG* cfg, CST* cst, int rule_id, TimestampStreams* ts,
                       void (*user_op)(Record*, void*), void* user_arg, int free_record) {
 
-    RuleHash *rule = NULL;
-    HASH_FIND_INT(cfg->cfg_head, &rule_id, rule);
+    RuleHash *rule = reader_get_rule(cfg, rule_id);
     assert(rule != NULL);
 
     for(int i = 0; i < rule->symbols; i++) {
@@ -273,12 +824,18 @@ void rule_application(RecorderReader* reader, CFG* cfg, CST* cst, int rule_id, u
         if (sym_val >= TERMINAL_START_ID) { // terminal
             for(int j = 0; j < sym_exp; j++) {
                 Record* record = reader_cs_to_record(&(cst->cs_list[sym_val]));
+                if(reader->reduced_args && reader->metadata.reduced_funcs[record->func_id])
+                    restore_reduced_args(reader, record);
 
                 // Fill in timestamps
-                uint32_t ts[2] = {ts_buf[0], ts_buf[1]};
-                ts_buf += 2;
-                record->tstart = ts[0] * reader->metadata.time_resolution + reader->prev_tstart;
-                record->tend   = ts[1] * reader->metadata.time_resolution + reader->prev_tstart;
+                if(ts) {
+                    double* pair = next_timestamps(ts, record->tid);
+                    record->tstart = pair[0];
+                    record->tend   = pair[1];
+                } else {
+                    record->tstart = 0;
+                    record->tend   = 0;
+                }
                 reader->prev_tstart = record->tstart;
 
                 user_op(record, user_arg);
@@ -288,11 +845,124 @@ void rule_application(RecorderReader* reader, CFG* cfg, CST* cst, int rule_id, u
             }
         } else {                            // non-terminal (i.e., rule)
             for(int j = 0; j < sym_exp; j++)
-                rule_application(reader, cfg, cst, sym_val, ts_buf, user_op, user_arg, free_record);
+                rule_application(reader, cfg, cst, sym_val, ts, user_op, user_arg, free_record);
         }
     }
 }
 
+/*
+ * The timestamps of a rank are a sequence of blocks, one per buffer
+ * spilled during the run, each wrapped into a compressed block if the
+ * timestamps are compressed, followed by the directory of streams:
+ * | block | block | ... | pthread_t tid of stream 0 | ... | int num_streams |
+ * See ts_write_buffer() in the tracing library for the layout of
+ * a block:
+ * | int stream | int records | size_t delta_len | size_t duration_len | deltas | durations |
+ *
+ * Blocks of different streams are interleaved, the blocks of a
+ * stream are in order. Each varint stream is decoded in its own loop,
+ * the ticks are only converted to seconds at the end so rounding
+ * errors do not add up.
+ */
+static void read_timestamps(RecorderReader* reader, unsigned char* section, size_t size, TimestampStreams* streams) {
+    int num_streams;
+    memcpy(&num_streams, section + size - sizeof(int), sizeof(int));
+    unsigned char* directory = section + size - sizeof(int) - num_streams * sizeof(pthread_t);
+
+    streams->num_streams = num_streams;
+    streams->tids    = malloc(sizeof(pthread_t) * num_streams);
+    streams->ts      = calloc(num_streams, sizeof(double*));
+    streams->cursors = malloc(sizeof(double*) * num_streams);
+    memcpy(streams->tids, directory, sizeof(pthread_t) * num_streams);
+
+    size_t* records = calloc(num_streams, sizeof(size_t));
+    int64_t* ticks  = calloc(num_streams, sizeof(int64_t));
+    double resolution = reader->metadata.time_resolution;
+
+    unsigned char* ptr = section;
+    while(ptr < directory) {
+        unsigned char* block = ptr;
+        if(reader->metadata.ts_compression) {
+            size_t block_size;
+            block = decompress_block(ptr, &block_size);
+            assert(block != NULL);
+            ptr += block_size;
+        }
+
+        int stream, block_records;
+        size_t delta_len, duration_len;
+        unsigned char* p = block;
+        memcpy(&stream, p, sizeof(int));            p += sizeof(int);
+        memcpy(&block_records, p, sizeof(int));     p += sizeof(int);
+        memcpy(&delta_len, p, sizeof(size_t));      p += sizeof(size_t);
+        memcpy(&duration_len, p, sizeof(size_t));   p += sizeof(size_t);
+        assert(stream >= 0 && stream < num_streams);
+
+        streams->ts[stream] = realloc(streams->ts[stream],
+                                      sizeof(double) * 2 * (records[stream] + block_records));
+        double* out = streams->ts[stream] + 2 * records[stream];
+
+        unsigned char* deltas = p;
+        for(int i = 0; i < block_records; i++) {
+            ticks[stream] += zigzag_decode(varint_get(&deltas));
+            out[2*i] = ticks[stream];
+        }
+        unsigned char* durations = p + delta_len;
+        for(int i = 0; i < block_records; i++) {
+            out[2*i+1] = (out[2*i] + varint_get(&durations)) * resolution;
+            out[2*i] *= resolution;
+        }
+        assert(deltas == p + delta_len && durations == p + delta_len + duration_len);
+        records[stream] += block_records;
+
+        if(reader->metadata.ts_compression)
+            free(block);
+        else
+            ptr = p + delta_len + duration_len;
+    }
+
+    for(int i = 0; i < num_streams; i++)
+        streams->cursors[i] = streams->ts[i];
+
+    free(ticks);
+    free(records);
+}
+
+/*
+ * Recovery of a killed run: the complete blocks of N.ts, the
+ * directory of streams is in N.idx, see recover_rank()
+ */
+static void read_recovered_timestamps(RecorderReader* reader, int rank, TimestampStreams* streams) {
+    FlushIndex index;
+    read_flush_index(reader, rank, &index);
+
+    size_t directory_size = sizeof(pthread_t) * index.num_streams + sizeof(int);
+    unsigned char* section = malloc(index.ts_bytes + directory_size);
+    if(index.ts_bytes > 0) {
+        char ts_fname[1096] = {0};
+        sprintf(ts_fname, "%s/%d.ts", reader->logs_dir, rank);
+        FILE* ts_file = fopen(ts_fname, "rb");
+        assert(ts_file != NULL);
+        size_t n = fread(section, 1, index.ts_bytes, ts_file);
+        assert(n == index.ts_bytes);
+        fclose(ts_file);
+    }
+    memcpy(section + index.ts_bytes, index.tids, sizeof(pthread_t) * index.num_streams);
+    memcpy(section + index.ts_bytes + sizeof(pthread_t) * index.num_streams, &index.num_streams, sizeof(int));
+
+    read_timestamps(reader, section, index.ts_bytes + directory_size, streams);
+    free(section);
+    free(index.tids);
+}
+
+static void free_timestamps(TimestampStreams* streams) {
+    for(int i = 0; i < streams->num_streams; i++)
+        free(streams->ts[i]);
+    free(streams->ts);
+    free(streams->cursors);
+    free(streams->tids);
+}
+
 void decode_records_core(RecorderReader *reader, int rank,
                              void (*user_op)(Record*, void*), void* user_arg, bool free_record) {
 
@@ -301,38 +971,56 @@ void decode_records_core(RecorderReader *reader, int rank,
 	CFG* cfg = reader_get_cfg(reader, rank);
 
     reader->prev_tstart = 0.0;
+    read_reduced_args(reader, rank);
+
+    if(reader->metadata.ts_stats_only) {
+        rule_application(reader, cfg, cst, -1, NULL, user_op, user_arg, free_record);
+    } else if(reader->recovered) {
+        TimestampStreams streams;
+        read_recovered_timestamps(reader, rank, &streams);
+        rule_application(reader, cfg, cst, -1, &streams, user_op, user_arg, free_record);
+        free_timestamps(&streams);
+    } else if(reader->container) {
+        TimestampStreams streams;
+        RecorderRankIndex* index = container_rank_index(reader, rank);
+        read_timestamps(reader, reader->container + index->ts_offset, index->ts_size, &streams);
+        rule_application(reader, cfg, cst, -1, &streams, user_op, user_arg, free_record);
+        free_timestamps(&streams);
+    } else {
+        char ts_fname[1096] = {0};
+        sprintf(ts_fname, "%s/recorder.ts", reader->logs_dir);
+        FILE* ts_file = fopen(ts_fname, "rb");
+
+        // the first nprocs size_t store the buf size 
+        // of timestamps of each rank
+        // see lib/recorder-timestamps.c
+        size_t buf_sizes[nprocs];
+        fread(buf_sizes, sizeof(size_t), nprocs, ts_file);
+
+        // calculate the starting offset of the desired rank
+        // nprocs*sizeof(size_t) + offset
+        size_t offset = 0;
+        for(int r = 0; r < rank; r++) {
+            offset += buf_sizes[r];
+        }
+        fseek(ts_file, offset, SEEK_CUR);
 
-    char ts_fname[1096] = {0};
-    sprintf(ts_fname, "%s/recorder.ts", reader->logs_dir);
-    FILE* ts_file = fopen(ts_fname, "rb");
+        // finally read the timestamp streams of the rank
+        TimestampStreams streams;
+        unsigned char* section = malloc(buf_sizes[rank]);
+        fread(section, 1, buf_sizes[rank], ts_file);
+        fclose(ts_file);
+        read_timestamps(reader, section, buf_sizes[rank], &streams);
+        free(section);
 
-    // the first nprocs size_t store the buf size 
-    // of timestamps of each rank
-    // see lib/recorder-timestamps.c
-    size_t buf_sizes[nprocs];
-    fread(buf_sizes, sizeof(size_t), nprocs, ts_file);
+        rule_application(reader, cfg, cst, -1, &streams, user_op, user_arg, free_record);
 
-    // calculate the starting offset of the desired rank
-    // nprocs*sizeof(size_t) + offset
-    size_t offset = 0;
-    for(int r = 0; r < rank; r++) {
-        offset += buf_sizes[r];
+        free_timestamps(&streams);
     }
-    fseek(ts_file, offset, SEEK_CUR);
-
-    // finally read to the buffer
-    uint32_t* ts_buf;
-    if (reader->metadata.ts_compression) {
-        ts_buf = (uint32_t*) read_zlib(ts_file);
-    } else {
-        ts_buf = (uint32_t*) malloc(buf_sizes[rank]); 
-        fread(ts_buf, 1, buf_sizes[rank], ts_file);
-    }
-    fclose(ts_file);
-
-    rule_application(reader, cfg, cst, -1, ts_buf, user_op, user_arg, free_record);
 
-    free(ts_buf);
+    free(reader->reduced_args);
+    reader->reduced_args = NULL;
+    reader->reduced_args_cursor = NULL;
 }
 
 // Decode all records for one rank
@@ -353,8 +1041,7 @@ void recorder_decode_records2(RecorderReader *reader, int rank,
  * the total number of calls if uncompressed.
  */
 size_t get_uncompressed_count(RecorderReader* reader, CFG* cfg, int rule_id) {
-    RuleHash *rule = NULL;
-    HASH_FIND_INT(cfg->cfg_head, &rule_id, rule);
+    RuleHash *rule = reader_get_rule(cfg, rule_id);
     assert(rule != NULL);
 
     size_t count = 0;
@@ -29,6 +29,7 @@ typedef struct CFG_t {
     int rank;
     int rules;
     RuleHash* cfg_head;
+    struct CFG_t* dict;     // shared rule dictionary (ug.dict), NULL if none
 } CFG;
 
 typedef struct RecorderReader_t {
@@ -49,6 +50,7 @@ typedef struct RecorderReader_t {
     int   num_ugs;	// number of unique grammars
     int*  ug_ids;	// index of unique grammar in cfgs
     CFG** ugs;      // store actual grammars
+    CFG*  dict;     // rules shared by the unique grammars, NULL if none
 
     // in the case of metadata.interprocess_compression = false
     // we have one file for each rank's cst and one file
@@ -56,6 +58,22 @@ typedef struct RecorderReader_t {
     // and cfgs[rank]. 
     CST** csts;
     CFG** cfgs;     
+
+    // Single-file container (recorder.trace, see recorder-container.h)
+    // mapped with mmap(), NULL if the traces are separate files.
+    // CSTs and grammars are then only decoded when first needed.
+    unsigned char* container;
+    size_t         container_size;
+
+    // Side stream of the rank being decoded, with the arguments
+    // dropped from reduced call signatures (memory budget), NULL if
+    // there is none. See restore_reduced_args().
+    unsigned char* reduced_args;
+    unsigned char* reduced_args_cursor;
+
+    // The program died before finalize, the trace was rebuilt
+    // from what the background flusher left, see recover_rank()
+    bool recovered;
 } RecorderReader;
 
 
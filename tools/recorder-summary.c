@@ -12,6 +12,33 @@
 #include "recorder-logger.h"
 
 
+static double stats_mean(CallStats* stats, int count) {
+    return count > 0 ? stats->sum / count : 0;
+}
+
+static double stats_stddev(CallStats* stats, int count) {
+    if(count == 0)
+        return 0;
+    double mean = stats->sum / count;
+    double var = stats->sum_sq / count - mean * mean;
+    return var > 0 ? sqrt(var) : 0;
+}
+
+/*
+ * Bucket i > 0 holds the durations of [2^(i-1), 2^i) ticks,
+ * print the non-empty ones by their upper bound in seconds
+ */
+static void print_histogram(RecorderReader* reader, CallStats* stats) {
+    double resolution = reader->metadata.time_resolution;
+    for(int i = 0; i < RECORDER_STATS_BUCKETS; i++) {
+        if(stats->histogram[i] == 0)
+            continue;
+        if(i == RECORDER_STATS_BUCKETS-1)
+            printf("    >= %-12g %d\n", ldexp(resolution, i-1), stats->histogram[i]);
+        else
+            printf("    <  %-12g %d\n", ldexp(resolution, i), stats->histogram[i]);
+    }
+}
 
 void print_cst(RecorderReader* reader, CST* cst) {
     printf("\nBelow are the unique call signatures: \n");
@@ -28,11 +55,66 @@ void print_cst(RecorderReader* reader, CST* cst) {
             printf(" %s", arg);
         }
 
-        printf(" ), count: %d\n", cst->cs_list[i].count);
+        printf(" ), count: %d", cst->cs_list[i].count);
+        CallStats* stats = cst->cs_list[i].stats;
+        if(stats)
+            printf(", min: %g, mean: %g, max: %g, stddev: %g", stats->min,
+                   stats_mean(stats, cst->cs_list[i].count), stats->max,
+                   stats_stddev(stats, cst->cs_list[i].count));
+        printf("\n");
         recorder_free_record(record);
     }
 }
 
+/*
+ * Duration statistics of each function, only available
+ * in statistics-only timing mode
+ */
+void print_time_statistics(RecorderReader* reader, CST* cst, bool show_histogram) {
+    CallStats func_stats[256];
+    int call_count[256] = {0};
+
+    for(int i = 0; i < cst->entries; i++) {
+        Record* record = reader_cs_to_record(&cst->cs_list[i]);
+        int func_id = record->func_id;
+        CallStats* stats = cst->cs_list[i].stats;
+        if(call_count[func_id] == 0) {
+            func_stats[func_id] = *stats;
+        } else {
+            CallStats* f = &func_stats[func_id];
+            if(stats->min < f->min) f->min = stats->min;
+            if(stats->max > f->max) f->max = stats->max;
+            f->sum    += stats->sum;
+            f->sum_sq += stats->sum_sq;
+            for(int b = 0; b < RECORDER_STATS_BUCKETS; b++)
+                f->histogram[b] += stats->histogram[b];
+        }
+        call_count[func_id] += cst->cs_list[i].count;
+        recorder_free_record(record);
+    }
+
+    printf("\n%-25s %12s %12s %12s %12s %12s %12s\n", "Func", "Calls",
+           "Total(s)", "Min(s)", "Mean(s)", "Max(s)", "Stddev(s)");
+    for(int i = 0; i < 256; i++) {
+        if(call_count[i] == 0)
+            continue;
+        CallStats* f = &func_stats[i];
+        // %g, calls may be shorter than a microsecond
+        printf("%-25s %12d %12.6g %12.6g %12.6g %12.6g %12.6g\n", func_list[i], call_count[i],
+               f->sum, f->min, stats_mean(f, call_count[i]), f->max, stats_stddev(f, call_count[i]));
+    }
+
+    if(!show_histogram)
+        return;
+    printf("\nDuration histograms (seconds):\n");
+    for(int i = 0; i < 256; i++) {
+        if(call_count[i] == 0)
+            continue;
+        printf("%s\n", func_list[i]);
+        print_histogram(reader, &func_stats[i]);
+    }
+}
+
 void print_statistics(RecorderReader* reader, CST* cst) {
 
     int unique_signature[256] = {0};
@@ -88,9 +170,21 @@ void print_metadata(RecorderReader* reader) {
     printf("Store thread id: %s\n", meta->store_tid?"True":"False");
     printf("Store call depth: %s\n", meta->store_call_depth?"True":"False");
     printf("Timestamp compression: %s\n", meta->ts_compression?"True":"False");
+    printf("Timing: %s\n", meta->ts_stats_only?"Statistics only":"Timestamps");
     printf("Interprocess compression: %s\n", meta->interprocess_compression?"True":"False");
     printf("Intraprocess pattern recognition: %s\n", meta->intraprocess_pattern_recognition?"True":"False");
     printf("Interprocess pattern recognition: %s\n", meta->interprocess_pattern_recognition?"True":"False");
+    if(meta->reduced_args != RECORDER_REDUCED_ARGS_NONE) {
+        // Memory budget, offsets and counts of these functions
+        // are either in the side stream or lost
+        printf("Reduced signatures (%s):", meta->reduced_args == RECORDER_REDUCED_ARGS_STREAM ?
+                                            "offsets and counts kept separately" : "offsets and counts dropped");
+        for(int i = 0; i < RECORDER_MAX_FUNCS; i++) {
+            if(meta->reduced_funcs[i])
+                printf(" %s", reader->func_list[i]);
+        }
+        printf("\n");
+    }
     printf("===========================================\n\n");
 }
 
@@ -113,6 +207,8 @@ int main(int argc, char **argv) {
     CST* cst = reader_get_cst(&reader, 0);
     print_metadata(&reader);
     print_statistics(&reader, cst);
+    if (reader.metadata.ts_stats_only)
+        print_time_statistics(&reader, cst, show_cst);
 
     if (show_cst) {
         print_cst(&reader, cst);
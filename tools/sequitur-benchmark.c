@@ -0,0 +1,241 @@
+/*
+ * Standalone throughput benchmark of the Sequitur implementation
+ * (lib/recorder-sequitur*.c), without the rest of the tracing library.
+ *
+ * Terminal streams are either generated or replayed from existing
+ * traces, the stream is fully materialized before the timer starts,
+ * so only append_terminal() is measured.
+ *
+ * Usage:
+ *   sequitur-benchmark [-p loops|strided|random] [-n terminals]
+ *                      [-a alphabet] [-i inner] [-s stride] [-t 0|1]
+ *   sequitur-benchmark -r [path to traces]
+ */
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "recorder-sequitur.h"
+#include "reader.h"
+#include "reader-private.h"
+
+
+/*
+ * The Sequitur code allocates everything through recorder_malloc()
+ * and recorder_free(). We provide our own versions here to track the
+ * peak memory instead of linking the whole tracing library.
+ */
+static size_t memory_usage = 0;
+static size_t peak_memory_usage = 0;
+
+void* recorder_malloc(size_t size) {
+    if(size == 0)
+        return NULL;
+
+    memory_usage += size;
+    if(memory_usage > peak_memory_usage)
+        peak_memory_usage = memory_usage;
+    return malloc(size);
+}
+
+void recorder_free(void* ptr, size_t size) {
+    if(size == 0 || ptr == NULL)
+        return;
+    memory_usage -= size;
+    free(ptr);
+}
+
+size_t recorder_memory_usage() {
+    return memory_usage;
+}
+
+
+typedef struct Stream_t {
+    int *terminals;
+    size_t len;
+    size_t cap;
+} Stream;
+
+static void stream_push(Stream *s, int terminal) {
+    if(s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->terminals = realloc(s->terminals, sizeof(int) * s->cap);
+    }
+    s->terminals[s->len++] = terminal;
+}
+
+/*
+ * Typical checkpoint loop: open, a number of
+ * (seek, write) pairs with a few distinct signatures, close
+ */
+static void gen_loops(Stream *s, size_t n, int alphabet, int inner) {
+    int distinct = alphabet > 3 ? alphabet - 3 : 1;
+    while(s->len < n) {
+        stream_push(s, 0);
+        for(int j = 0; j < inner && s->len < n; j++) {
+            stream_push(s, 1);
+            stream_push(s, 3 + j % distinct);
+        }
+        stream_push(s, 2);
+    }
+    s->len = n;
+}
+
+/*
+ * Strided accesses where the signature cycles through the alphabet
+ */
+static void gen_strided(Stream *s, size_t n, int alphabet, int stride) {
+    for(size_t i = 0; i < n; i++)
+        stream_push(s, (int)((i * stride) % alphabet));
+}
+
+/*
+ * Worst case for Sequitur, almost nothing repeats
+ */
+static void gen_random(Stream *s, size_t n, int alphabet) {
+    uint64_t x = 88172645463325252ULL;      // xorshift64, fixed seed
+    for(size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        stream_push(s, (int)(x % alphabet));
+    }
+}
+
+static void expand_rule(CFG *cfg, int rule_id, Stream *s) {
+    RuleHash *rule = reader_get_rule(cfg, rule_id);
+    if(rule == NULL) {
+        fprintf(stderr, "can not find rule %d\n", rule_id);
+        exit(1);
+    }
+
+    for(int i = 0; i < rule->symbols; i++) {
+        int val = rule->rule_body[2*i];
+        int exp = rule->rule_body[2*i+1];
+        for(int j = 0; j < exp; j++) {
+            if(val >= 0)
+                stream_push(s, val);
+            else
+                expand_rule(cfg, val, s);
+        }
+    }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct BenchResult_t {
+    size_t terminals;
+    double seconds;
+    size_t peak_memory;
+    int rules;
+    int symbols;
+} BenchResult;
+
+static void run(Stream *s, bool twins_removal, BenchResult *res) {
+    Grammar grammar;
+    memory_usage = 0;
+    peak_memory_usage = 0;
+
+    sequitur_init_rule_id(&grammar, -1, twins_removal);
+
+    double t1 = now();
+    for(size_t i = 0; i < s->len; i++)
+        append_terminal(&grammar, s->terminals[i], 1);
+    double t2 = now();
+
+    int rules = 0, symbols = 0, count;
+    Symbol *rule, *sym;
+    DL_FOREACH(grammar.rules, rule) {
+        DL_COUNT(rule->rule_body, sym, count);
+        symbols += count;
+        rules++;
+    }
+
+    res->terminals   += s->len;
+    res->seconds     += t2 - t1;
+    res->peak_memory  = peak_memory_usage > res->peak_memory ? peak_memory_usage : res->peak_memory;
+    res->rules       += rules;
+    res->symbols     += symbols;
+
+    sequitur_cleanup(&grammar);
+}
+
+static void print_result(const char* name, BenchResult *res) {
+    printf("pattern: %s\n", name);
+    printf("terminals: %zu\n", res->terminals);
+    printf("time: %.3f seconds\n", res->seconds);
+    printf("throughput: %.2f M terminals/s\n", res->terminals / res->seconds / 1e6);
+    printf("peak memory: %.2f MB\n", res->peak_memory / 1024.0 / 1024.0);
+    printf("rules: %d, symbols: %d\n", res->rules, res->symbols);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-p loops|strided|random] [-n terminals] [-a alphabet]"
+                    " [-i inner] [-s stride] [-t 0|1]\n", prog);
+    fprintf(stderr, "       %s -r [path to traces]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char* pattern = "loops";
+    size_t n = 10*1000*1000;
+    int alphabet = 64, inner = 100, stride = 7;
+    bool twins_removal = true, replay = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:a:i:s:t:r")) != -1) {
+        switch(opt) {
+            case 'p': pattern = optarg; break;
+            case 'n': n = atol(optarg); break;
+            case 'a': alphabet = atoi(optarg); break;
+            case 'i': inner = atoi(optarg); break;
+            case 's': stride = atoi(optarg); break;
+            case 't': twins_removal = atoi(optarg); break;
+            case 'r': replay = true; break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(alphabet <= 0 || inner <= 0)
+        usage(argv[0]);
+
+    BenchResult res = {0};
+    Stream s = {0};
+
+    if(replay) {
+        if(optind >= argc)
+            usage(argv[0]);
+
+        // Replay the terminal stream of every rank into a fresh grammar
+        RecorderReader reader;
+        recorder_init_reader(argv[optind], &reader);
+        for(int rank = 0; rank < reader.metadata.total_ranks; rank++) {
+            s.len = 0;
+            expand_rule(reader_get_cfg(&reader, rank), -1, &s);
+            run(&s, twins_removal, &res);
+        }
+        recorder_free_reader(&reader);
+        print_result("replay", &res);
+    } else {
+        if(strcmp(pattern, "loops") == 0)
+            gen_loops(&s, n, alphabet, inner);
+        else if(strcmp(pattern, "strided") == 0)
+            gen_strided(&s, n, alphabet, stride);
+        else if(strcmp(pattern, "random") == 0)
+            gen_random(&s, n, alphabet);
+        else
+            usage(argv[0]);
+        run(&s, twins_removal, &res);
+        print_result(pattern, &res);
+    }
+
+    free(s.terminals);
+    return 0;
+}